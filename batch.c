@@ -0,0 +1,279 @@
+#include "cli.h"
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "scheduler.h"
+
+/* Batch mode */
+
+static void filelist_add(filelist_t *l, const char *path)
+{
+  if (l->count == l->capacity)
+  {
+    l->capacity = l->capacity ? l->capacity * 2 : 64;
+    l->paths = realloc(l->paths, sizeof(char*) * l->capacity);
+  }
+  l->paths[l->count++] = strdup(path);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int add_directory(filelist_t *l, const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+    return -1;
+
+  int first = l->count;
+  struct dirent *e;
+  while ((e = readdir(d)))
+  {
+    if (e->d_name[0] == '.')
+      continue;
+
+    char *path = malloc(strlen(dir) + strlen(e->d_name) + 2);
+    sprintf(path, "%s/%s", dir, e->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      filelist_add(l, path);
+    free(path);
+  }
+  closedir(d);
+
+  qsort(l->paths + first, l->count - first, sizeof(char*), compare_paths);
+  return 0;
+}
+
+static int add_manifest(filelist_t *l, const char *manifest)
+{
+  FILE *f = fopen(manifest, "r");
+  if (!f)
+    return -1;
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, f)) >= 0)
+  {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = 0;
+    if (len > 0 && line[0] != '#')
+      filelist_add(l, line);
+  }
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+static int add_input(filelist_t *l, const char *input)
+{
+  if (input[0] == '@')
+    return add_manifest(l, input + 1);
+
+  struct stat st;
+  if (stat(input, &st) == 0)
+  {
+    if (S_ISDIR(st.st_mode))
+      return add_directory(l, input);
+    filelist_add(l, input);
+    return 0;
+  }
+
+  if (strpbrk(input, "*?["))
+  {
+    glob_t g;
+    if (glob(input, 0, NULL, &g) != 0)
+      return -1;
+    for (size_t i = 0; i < g.gl_pathc; ++i)
+      filelist_add(l, g.gl_pathv[i]);
+    globfree(&g);
+    return 0;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+typedef struct {
+  const cli_options_t *opt;
+  threadpool_t *pool;
+  const char *input;
+  char *output;
+  const char *error;
+} job_t;
+
+char *batch_output_path(const char *outdir, const char *input,
+                        recel_format_t format)
+{
+  const char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  const char *dot = strrchr(base, '.');
+  int len = dot && dot != base ? dot - base : (int)strlen(base);
+  const char *ext = recel_format_extension(format);
+
+  char *path = malloc(strlen(outdir) + len + strlen(ext) + 3);
+  sprintf(path, "%s/%.*s.%s", outdir, len, base, ext);
+  return path;
+}
+
+typedef struct {
+  const char *output;
+  int index;
+} output_t;
+
+static int compare_outputs(const void *a, const void *b)
+{
+  const output_t *x = a, *y = b;
+  int c = strcmp(x->output, y->output);
+  return c ? c : x->index - y->index;
+}
+
+int batch_check_outputs(int count, char *const *outputs,
+                        char *const *inputs)
+{
+  output_t *sorted = malloc(sizeof(output_t) * (count ? count : 1));
+  if (!sorted)
+    return -1;
+  for (int i = 0; i < count; ++i)
+    sorted[i] = (output_t){ outputs[i], i };
+  qsort(sorted, count, sizeof(output_t), compare_outputs);
+
+  int status = 0;
+  for (int i = 1; i < count; ++i)
+  {
+    if (strcmp(sorted[i].output, sorted[i - 1].output) != 0)
+      continue;
+    if (inputs)
+      fprintf(stderr, "%s and %s both write %s\n", inputs[sorted[i - 1].index],
+              inputs[sorted[i].index], sorted[i].output);
+    else
+      fprintf(stderr, "%s is written twice\n", sorted[i].output);
+    status = -1;
+  }
+  free(sorted);
+  return status;
+}
+
+static void job_run(void *arg)
+{
+  job_t *job = arg;
+  recel_image_t source;
+
+  if (recel_image_load(&source, job->input, RECEL_FORMAT_AUTO) != 0)
+  {
+    job->error = "cannot load";
+    return;
+  }
+
+  recel_options_t options = {
+    .pool = job->pool, .cache = job->opt->cache, .pages = job->opt->pages,
+  };
+  uint32_t w = source.w, h = source.h;
+  uint32_t *result = recel_upscale(&options, &w, &h, source.pixels);
+  recel_image_release(&source);
+
+  if (!result)
+  {
+    job->error = "cannot upscale (out of memory or image too large)";
+    return;
+  }
+
+  if (recel_image_save(job->output, job->opt->format, w, h, result) != 0)
+    job->error = "cannot write";
+  recel_free(result);
+}
+
+int filelist_collect(filelist_t *l, int count, char **inputs)
+{
+  int status = 0;
+  memset(l, 0, sizeof(*l));
+
+  for (int i = 0; i < count; ++i)
+  {
+    if (add_input(l, inputs[i]) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", inputs[i], strerror(errno));
+      status = -1;
+    }
+  }
+
+  return status;
+}
+
+void filelist_free(filelist_t *l)
+{
+  for (int i = 0; i < l->count; ++i)
+    free(l->paths[i]);
+  free(l->paths);
+}
+
+int batch_main(const cli_options_t *opt, threadpool_t *pool,
+               int count, char **inputs)
+{
+  filelist_t files;
+  int status = filelist_collect(&files, count, inputs) != 0;
+
+  if (mkdir(opt->output, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "%s: %s\n", opt->output, strerror(errno));
+    filelist_free(&files);
+    return 1;
+  }
+
+  // Inputs of the same name would overwrite each other's result
+  char **outputs = malloc(sizeof(char*) * (files.count ? files.count : 1));
+  for (int i = 0; i < files.count; ++i)
+    outputs[i] = batch_output_path(opt->output, files.paths[i], opt->format);
+  if (batch_check_outputs(files.count, outputs, files.paths) != 0)
+  {
+    for (int i = 0; i < files.count; ++i)
+      free(outputs[i]);
+    free(outputs);
+    filelist_free(&files);
+    return 1;
+  }
+
+  // Only the size is known before decoding, read it to pick a lane
+  scheduler_t *sched = scheduler_new(pool, 0, opt->large_share);
+  job_t *jobs = calloc(files.count, sizeof(job_t));
+  for (int i = 0; i < files.count; ++i)
+  {
+    uint32_t w = 0, h = 0;
+    recel_image_info(files.paths[i], &w, &h);
+
+    jobs[i].opt = opt;
+    jobs[i].pool = pool;
+    jobs[i].input = files.paths[i];
+    jobs[i].output = outputs[i];
+    scheduler_submit(sched, recel_cost(w, h, 0), job_run, &jobs[i]);
+  }
+  free(outputs);
+
+  threadpool_wait(pool);
+
+  int failed = 0;
+  for (int i = 0; i < files.count; ++i)
+  {
+    if (jobs[i].error)
+    {
+      fprintf(stderr, "%s: %s\n", jobs[i].input, jobs[i].error);
+      failed += 1;
+    }
+    free(jobs[i].output);
+  }
+
+  fprintf(stderr, "%d files processed, %d failed\n", files.count, failed);
+  scheduler_report(sched, stderr);
+  scheduler_delete(sched);
+
+  free(jobs);
+  filelist_free(&files);
+  return status || failed ? 1 : 0;
+}
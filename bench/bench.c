@@ -0,0 +1,784 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recel.h"
+#include "threadpool.h"
+#include "trace.h"
+
+/* Benchmarks: synthetic images and the sprites of bench/sprites, upscaled
+ * stage by stage on one thread and as a whole on the pool, and a generated
+ * sequence of frames.  Results can be saved as JSON and compared against a
+ * previous run. */
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+      "Usage: %s [-j threads] [--time ms] [--sprites dir] [--quick]\n"
+      "          [--isa scalar|sse2|avx2|avx512]\n"
+      "          [--image name:WxH:colors:run:edges:flat]... [--save dir]\n"
+      "          [--json file] [--compare file [--threshold percent]]\n"
+      "  Each image is upscaled on one thread until --time ms (default 200)\n"
+      "  have passed, and at least 15 times; the median run of each stage is\n"
+      "  kept.  The whole pipeline is then timed as often on the pool.\n"
+      "  A 256x240 scrolling tilemap of 600 frames is then played through a\n"
+      "  plan on one thread, as --realtime does, and its p50 and p99 frame\n"
+      "  times are reported against a 16.667 ms budget.\n"
+      "  --image adds a synthetic image: colors in its palette, mean length\n"
+      "  of horizontal runs, fraction of runs that differ from the row above\n"
+      "  (edges) and fraction of the image covered by flat rectangles.\n"
+      "  --quick only runs the small images.\n"
+      "  --isa forces the instruction set of the kernels.\n"
+      "  --save writes the synthetic images to dir as PNG.\n"
+      "  --compare reports the changes from a previous --json file, and\n"
+      "  fails if a time or the peak memory grew by more than --threshold\n"
+      "  percent (default 10); times under 1 ms in both runs are skipped.\n",
+      argv0);
+}
+
+/* Synthetic images */
+
+typedef struct {
+  char name[64];
+  uint32_t w, h;
+  uint32_t colors;
+  double run;   // mean length of horizontal runs
+  double edges; // fraction of runs not copied from the row above
+  double flat;  // fraction of the image in flat rectangles
+} synth_t;
+
+static const synth_t corpus[] = {
+  { "flat-256",     256,  256,   8, 16, 0.1,  0.7 },
+  { "sprite-256",   256,  256,  16,  4, 0.3,  0.3 },
+  { "dither-256",   256,  256,  32,  2, 0.5,  0.2 },
+  { "noise-256",    256,  256,  64,  1, 1.0,  0.0 },
+  { "sprite-1024", 1024, 1024,  16,  4, 0.3,  0.3 },
+  { "palette-1024", 1024, 1024, 256, 3, 0.6,  0.1 },
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+  // xorshift32, the corpus is the same on every run
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static double rng_unit(void)
+{
+  return (rng() >> 8) / 16777216.0;
+}
+
+static uint32_t *synth_image(const synth_t *s)
+{
+  uint32_t w = s->w, h = s->h;
+  uint32_t *pixels = malloc(sizeof(uint32_t) * w * h);
+  uint32_t *palette = malloc(sizeof(uint32_t) * s->colors);
+  uint8_t *covered = calloc((size_t)w * h, 1);
+  if (!pixels || !palette || !covered)
+  {
+    free(pixels);
+    free(palette);
+    free(covered);
+    return NULL;
+  }
+
+  rng_state = 0x9e3779b9 ^ (w * 31 + h) ^ (s->colors << 16);
+  for (uint32_t i = 0; i < s->colors; ++i)
+    palette[i] = rng() | 0xff000000;
+
+  // Flat rectangles, until they cover the requested fraction
+  uint64_t area = (uint64_t)w * h, target = s->flat * area, done = 0;
+  for (int tries = 0; done < target && tries < 100000; ++tries)
+  {
+    uint32_t rw = 4 + rng() % (w / 4 + 1), rh = 4 + rng() % (h / 4 + 1);
+    uint32_t x0 = rng() % w, y0 = rng() % h;
+    uint32_t color = palette[rng() % s->colors];
+    for (uint32_t y = y0; y < y0 + rh && y < h; ++y)
+    {
+      for (uint32_t x = x0; x < x0 + rw && x < w; ++x)
+      {
+        size_t i = (size_t)y * w + x;
+        done += !covered[i];
+        covered[i] = 1;
+        pixels[i] = color;
+      }
+    }
+  }
+
+  // Runs of geometric length, either new colors or copies of the row above
+  double stop = s->run > 1 ? 1 / s->run : 1;
+  for (uint32_t y = 0; y < h; ++y)
+  {
+    uint32_t x = 0;
+    while (x < w)
+    {
+      bool copy = y > 0 && rng_unit() >= s->edges;
+      uint32_t color = palette[rng() % s->colors];
+      do
+      {
+        size_t i = (size_t)y * w + x;
+        if (!covered[i])
+          pixels[i] = copy ? pixels[i - w] : color;
+        x += 1;
+      } while (x < w && rng_unit() >= stop);
+    }
+  }
+
+  free(palette);
+  free(covered);
+  return pixels;
+}
+
+// name:WxH:colors:run:edges:flat
+static int parse_synth(const char *arg, synth_t *s)
+{
+  const char *colon = strchr(arg, ':');
+  if (!colon || colon - arg >= (int)sizeof(s->name))
+    return -1;
+  memcpy(s->name, arg, colon - arg);
+  s->name[colon - arg] = 0;
+  return sscanf(colon + 1, "%ux%u:%u:%lf:%lf:%lf", &s->w, &s->h, &s->colors,
+                &s->run, &s->edges, &s->flat) == 6 &&
+         s->w >= 2 && s->h >= 2 && s->colors > 0 ? 0 : -1;
+}
+
+/* Measurements */
+
+typedef struct {
+  char name[64];
+  uint32_t w, h, colors, levels;
+  uint32_t runs;          // single-threaded runs
+  uint64_t stage_ns[RECEL_STAGE_COUNT]; // median of each stage
+  uint64_t total_ns;      // median single-threaded run
+  uint64_t threaded_ns;   // median run on the pool
+  uint64_t peak_bytes;    // heap above the input at the highest point
+  recel_estimate_t estimate;
+} result_t;
+
+// Fewest runs of each image, whatever --time
+#define MIN_RUNS 15
+
+static int compare_ns(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Median of the count values, reordered
+static uint64_t median(uint64_t *values, uint32_t count)
+{
+  qsort(values, count, sizeof(*values), compare_ns);
+  return count % 2 ? values[count / 2] :
+    (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static int measure(threadpool_t *pool, uint64_t min_ns, const char *name,
+                   uint32_t w, uint32_t h, const uint32_t *input,
+                   result_t *r)
+{
+  memset(r, 0, sizeof(*r));
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->w = w;
+  r->h = h;
+  r->colors = recel_count_colors(w, h, input, 0);
+  recel_estimate(NULL, w, h, r->colors, &r->estimate);
+
+  // Times of each run: the stages, then the total
+  enum { SAMPLE = RECEL_STAGE_COUNT + 1 };
+  uint64_t *samples = NULL, *values = NULL;
+  uint32_t capacity = 0;
+  int status = 0;
+
+  recel_memory_t before;
+  recel_memory_get(&before);
+  uint64_t start = trace_now();
+  while (r->runs < MIN_RUNS || trace_now() - start < min_ns)
+  {
+    if (r->runs == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      uint64_t *more = realloc(samples, sizeof(*samples) * SAMPLE * capacity);
+      if (!more)
+      {
+        status = -1;
+        goto done;
+      }
+      samples = more;
+    }
+
+    recel_stats_t stats = {0};
+    recel_options_t options = { .stats = &stats };
+    uint32_t ow = w, oh = h;
+    uint64_t t = trace_now();
+    uint32_t *output = recel_upscale(&options, &ow, &oh, input);
+    t = trace_now() - t;
+    if (!output)
+    {
+      status = -1;
+      goto done;
+    }
+    recel_free(output);
+
+    uint64_t *sample = samples + (size_t)SAMPLE * r->runs;
+    for (int i = 0; i < RECEL_STAGE_COUNT; ++i)
+    {
+      const recel_stage_stats_t *s = &stats.stage[i];
+      sample[i] = s->ns;
+      if (s->peak_bytes > before.live_bytes &&
+          s->peak_bytes - before.live_bytes > r->peak_bytes)
+        r->peak_bytes = s->peak_bytes - before.live_bytes;
+    }
+    sample[RECEL_STAGE_COUNT] = t;
+    r->levels = stats.levels;
+    r->runs += 1;
+  }
+
+  values = malloc(sizeof(*values) * r->runs);
+  if (!values)
+  {
+    status = -1;
+    goto done;
+  }
+  for (int i = 0; i < SAMPLE; ++i)
+  {
+    for (uint32_t j = 0; j < r->runs; ++j)
+      values[j] = samples[(size_t)SAMPLE * j + i];
+    if (i < RECEL_STAGE_COUNT)
+      r->stage_ns[i] = median(values, r->runs);
+    else
+      r->total_ns = median(values, r->runs);
+  }
+
+  recel_options_t options = { .pool = pool };
+  for (uint32_t i = 0; i < r->runs; ++i)
+  {
+    uint32_t ow = w, oh = h;
+    uint64_t t = trace_now();
+    uint32_t *output = recel_upscale(&options, &ow, &oh, input);
+    t = trace_now() - t;
+    if (!output)
+    {
+      status = -1;
+      goto done;
+    }
+    recel_free(output);
+    values[i] = t;
+  }
+  r->threaded_ns = median(values, r->runs);
+
+done:
+  free(values);
+  free(samples);
+  return status;
+}
+
+/* Frame sequences */
+
+// A scrolling 256x240 tilemap, as a console game shows it: 16x16 tiles of a
+// 64x32 world, scrolled 2 pixels right and half a pixel down per frame, with
+// a sprite walking over it.  Played through one plan on one thread, as
+// --realtime does, against a 60 fps budget.
+enum { SCROLL_W = 256, SCROLL_H = 240, SCROLL_FRAMES = 600, TILE = 16 };
+enum { TILES = 32, WORLD_W = 64, WORLD_H = 32 };
+#define FRAME_BUDGET_NS 16667000
+
+typedef struct {
+  char name[64];
+  uint32_t w, h, frames, missed;
+  uint64_t p50_ns, p99_ns, max_ns;
+} sequence_t;
+
+typedef struct {
+  uint32_t tiles[TILES][TILE * TILE];
+  uint8_t map[WORLD_H][WORLD_W];
+  uint32_t sprite[TILE * TILE]; // 0 where the background shows through
+} tilemap_t;
+
+static void tilemap_init(tilemap_t *t)
+{
+  uint32_t palette[24];
+  rng_state = 0x2545f491;
+  for (int i = 0; i < 24; ++i)
+    palette[i] = rng() | 0xff000000;
+
+  // Tiles of 4 colors, in runs that often repeat the row above
+  for (int i = 0; i < TILES; ++i)
+  {
+    uint32_t colors[4];
+    for (int c = 0; c < 4; ++c)
+      colors[c] = palette[rng() % 24];
+    uint32_t *tile = t->tiles[i];
+    for (int y = 0; y < TILE; ++y)
+      for (int x = 0; x < TILE; ++x)
+      {
+        bool copy = y > 0 && rng_unit() < 0.7;
+        bool run = x > 0 && rng_unit() < 0.6;
+        tile[y * TILE + x] = copy ? tile[(y - 1) * TILE + x] :
+          run ? tile[y * TILE + x - 1] : colors[rng() % 4];
+      }
+  }
+
+  // Mostly sky and ground tiles, a few of the others
+  for (int y = 0; y < WORLD_H; ++y)
+    for (int x = 0; x < WORLD_W; ++x)
+      t->map[y][x] = rng_unit() < 0.6 ? (y < WORLD_H / 2 ? 0 : 1) :
+        rng() % TILES;
+
+  for (int i = 0; i < TILE * TILE; ++i)
+  {
+    int x = i % TILE, y = i / TILE;
+    bool inside = (x - 7.5) * (x - 7.5) + (y - 7.5) * (y - 7.5) < 56;
+    t->sprite[i] = inside ? palette[(x / 4 + y / 4) % 3] : 0;
+  }
+}
+
+static void tilemap_frame(const tilemap_t *t, uint32_t f, uint32_t *pixels)
+{
+  uint32_t ox = 2 * f, oy = f / 2;
+  for (uint32_t y = 0; y < SCROLL_H; ++y)
+    for (uint32_t x = 0; x < SCROLL_W; ++x)
+    {
+      uint32_t wx = (ox + x) % (WORLD_W * TILE);
+      uint32_t wy = (oy + y) % (WORLD_H * TILE);
+      const uint32_t *tile = t->tiles[t->map[wy / TILE][wx / TILE]];
+      pixels[y * SCROLL_W + x] = tile[wy % TILE * TILE + wx % TILE];
+    }
+
+  uint32_t sx = 32 + f % 192, sy = 176 - (f / 8) % 2 * 4;
+  for (uint32_t y = 0; y < TILE; ++y)
+    for (uint32_t x = 0; x < TILE; ++x)
+      if (t->sprite[y * TILE + x])
+        pixels[(sy + y) * SCROLL_W + sx + x] = t->sprite[y * TILE + x];
+}
+
+static int measure_scroll(sequence_t *s)
+{
+  memset(s, 0, sizeof(*s));
+  snprintf(s->name, sizeof(s->name), "scroll-%ux%u", SCROLL_W, SCROLL_H);
+  s->w = SCROLL_W;
+  s->h = SCROLL_H;
+
+  tilemap_t *t = malloc(sizeof(tilemap_t));
+  uint32_t *frame = malloc(sizeof(uint32_t) * SCROLL_W * SCROLL_H);
+  uint32_t *output =
+    malloc(sizeof(uint32_t) * (3 * SCROLL_W - 2) * (3 * SCROLL_H - 2));
+  uint64_t *times = malloc(sizeof(uint64_t) * SCROLL_FRAMES);
+  recel_plan_t *plan = recel_plan_new(NULL, SCROLL_W, SCROLL_H);
+  int status = t && frame && output && times && plan ? 0 : -1;
+
+  if (status == 0)
+  {
+    tilemap_init(t);
+    for (uint32_t f = 0; f < SCROLL_FRAMES; ++f)
+    {
+      tilemap_frame(t, f, frame);
+      uint64_t start = trace_now();
+      recel_plan_update(plan, frame, output, NULL);
+      times[f] = trace_now() - start;
+      s->missed += times[f] > FRAME_BUDGET_NS;
+    }
+    s->frames = SCROLL_FRAMES;
+    qsort(times, SCROLL_FRAMES, sizeof(uint64_t), compare_ns);
+    s->p50_ns = times[SCROLL_FRAMES / 2];
+    s->p99_ns = times[SCROLL_FRAMES * 99 / 100];
+    s->max_ns = times[SCROLL_FRAMES - 1];
+  }
+
+  recel_plan_delete(plan);
+  free(times);
+  free(output);
+  free(frame);
+  free(t);
+  return status;
+}
+
+static void print_sequence(const sequence_t *s)
+{
+  printf("\n%s: %u frames on one thread, p50 %.3f ms, p99 %.3f ms,\n"
+         "max %.3f ms, %u over %.3f ms\n", s->name, s->frames,
+         s->p50_ns / 1e6, s->p99_ns / 1e6, s->max_ns / 1e6, s->missed,
+         FRAME_BUDGET_NS / 1e6);
+}
+
+static void print_header(void)
+{
+  printf("%-14s %9s %6s %3s %8s %8s %8s %8s %9s %9s %8s %8s %8s\n",
+         "image", "size", "colors", "lvl", "dist ms", "infl ms", "intl ms",
+         "trsp ms", "total ms", "pool ms", "Mpix/s", "peak MiB", "est MiB");
+}
+
+static void print_result(const result_t *r)
+{
+  char size[24];
+  snprintf(size, sizeof(size), "%ux%u", r->w, r->h);
+  uint64_t dist = 0;
+  for (int i = RECEL_STAGE_DIST_INIT; i <= RECEL_STAGE_DIST_NEXTLEVEL; ++i)
+    dist += r->stage_ns[i];
+  printf("%-14s %9s %6u %3u %8.3f %8.3f %8.3f %8.3f %9.3f %9.3f %8.1f %8.2f "
+         "%8.2f\n", r->name, size, r->colors, r->levels, dist / 1e6,
+         r->stage_ns[RECEL_STAGE_INFLATE] / 1e6,
+         r->stage_ns[RECEL_STAGE_INTERLEAVE] / 1e6,
+         r->stage_ns[RECEL_STAGE_TRANSPOSE] / 1e6, r->total_ns / 1e6,
+         r->threaded_ns / 1e6,
+         r->total_ns ? (double)r->w * r->h / r->total_ns * 1e3 : 0.0,
+         r->peak_bytes / 1048576.0, r->estimate.peak_bytes / 1048576.0);
+}
+
+static void write_json(FILE *f, int threads, const result_t *results,
+                       int count, const sequence_t *seq)
+{
+  fprintf(f, "{\"threads\": %d, \"isa\": \"%s\", \"images\": [\n", threads,
+          recel_isa_name(recel_isa()));
+  for (int i = 0; i < count; ++i)
+  {
+    const result_t *r = &results[i];
+    fprintf(f, "  {\"name\": \"%s\", \"w\": %u, \"h\": %u, \"colors\": %u, "
+            "\"levels\": %u, \"runs\": %u,\n   \"stages\": {",
+            r->name, r->w, r->h, r->colors, r->levels, r->runs);
+    for (int s = RECEL_STAGE_DIST_INIT; s <= RECEL_STAGE_TRANSPOSE; ++s)
+      fprintf(f, "%s\"%s_ns\": %llu", s > RECEL_STAGE_DIST_INIT ? ", " : "",
+              recel_stage_name(s), (unsigned long long)r->stage_ns[s]);
+    fprintf(f, "},\n   \"total_ns\": %llu, \"threaded_ns\": %llu, "
+            "\"peak_bytes\": %llu, \"estimate_bytes\": %llu, "
+            "\"estimate_ns\": %llu}%s\n",
+            (unsigned long long)r->total_ns,
+            (unsigned long long)r->threaded_ns,
+            (unsigned long long)r->peak_bytes,
+            (unsigned long long)r->estimate.peak_bytes,
+            (unsigned long long)r->estimate.nanoseconds,
+            i + 1 < count ? "," : "");
+  }
+  fprintf(f, "], \"sequences\": [\n");
+  if (seq)
+    fprintf(f, "  {\"name\": \"%s\", \"w\": %u, \"h\": %u, "
+            "\"frames\": %u, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+            "\"max_ns\": %llu, \"missed\": %u}\n", seq->name, seq->w, seq->h, seq->frames,
+            (unsigned long long)seq->p50_ns, (unsigned long long)seq->p99_ns,
+            (unsigned long long)seq->max_ns, seq->missed);
+  fprintf(f, "]}\n");
+}
+
+/* Comparison with a previous run */
+
+static char *read_file(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  if (data && fread(data, 1, size, f) != (size_t)size)
+  {
+    free(data);
+    data = NULL;
+  }
+  if (data)
+    data[size] = 0;
+  fclose(f);
+  return data;
+}
+
+// Value of key in the object of image name, as written by write_json;
+// returns -1 if missing
+static int json_lookup(const char *json, const char *name, const char *key,
+                       uint64_t *value)
+{
+  char pattern[96];
+  snprintf(pattern, sizeof(pattern), "{\"name\": \"%s\"", name);
+  const char *object = strstr(json, pattern);
+  if (!object)
+    return -1;
+  const char *end = strstr(object + 1, "{\"name\": ");
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  const char *field = strstr(object, pattern);
+  if (!field || (end && field > end))
+    return -1;
+  *value = strtoull(field + strlen(pattern), NULL, 10);
+  return 0;
+}
+
+// Times below this are too noisy to compare
+#define COMPARE_MIN_NS 1000000
+
+// Prints the change of key of name from the previous run if it is beyond
+// threshold; returns 1 for a regression
+static int compare_metric(const char *json, const char *name, const char *key,
+                          uint64_t value, bool time, double threshold)
+{
+  uint64_t old;
+  if (json_lookup(json, name, key, &old) != 0 || old == 0)
+    return 0;
+  if (time && old < COMPARE_MIN_NS && value < COMPARE_MIN_NS)
+    return 0;
+
+  double change = 100.0 * ((double)value - old) / old;
+  bool regressed = change > threshold;
+  if (regressed || change < -threshold)
+    printf("  %-14s %-18s %12llu -> %12llu %+7.1f%%%s\n", name, key,
+           (unsigned long long)old, (unsigned long long)value, change,
+           regressed ? "  REGRESSION" : "");
+  return regressed;
+}
+
+// seq is NULL if the frame sequence did not run
+static int compare(const char *path, double threshold,
+                   const result_t *results, int count, const sequence_t *seq)
+{
+  char *json = read_file(path);
+  if (!json)
+  {
+    perror(path);
+    return -1;
+  }
+
+  int regressions = 0;
+  printf("\nchanges from %s (threshold %.1f%%):\n", path, threshold);
+  for (int i = 0; i < count; ++i)
+  {
+    const result_t *r = &results[i];
+    struct { const char *key; uint64_t value; bool time; } metrics[] = {
+      { "dist_init_ns", r->stage_ns[RECEL_STAGE_DIST_INIT], true },
+      { "dist_propagate_ns", r->stage_ns[RECEL_STAGE_DIST_PROPAGATE], true },
+      { "dist_rank_ns", r->stage_ns[RECEL_STAGE_DIST_RANK], true },
+      { "dist_nextlevel_ns", r->stage_ns[RECEL_STAGE_DIST_NEXTLEVEL], true },
+      { "inflate_ns", r->stage_ns[RECEL_STAGE_INFLATE], true },
+      { "interleave_ns", r->stage_ns[RECEL_STAGE_INTERLEAVE], true },
+      { "transpose_ns", r->stage_ns[RECEL_STAGE_TRANSPOSE], true },
+      { "total_ns", r->total_ns, true },
+      { "threaded_ns", r->threaded_ns, true },
+      { "peak_bytes", r->peak_bytes, false },
+    };
+
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(*metrics); ++m)
+      regressions += compare_metric(json, r->name, metrics[m].key,
+                                    metrics[m].value, metrics[m].time,
+                                    threshold);
+  }
+  // p99 rests on a handful of frames, too few to compare
+  if (seq)
+    regressions += compare_metric(json, seq->name, "p50_ns", seq->p50_ns,
+                                  true, threshold);
+  printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+
+  free(json);
+  return regressions;
+}
+
+/* Sprites */
+
+static int sprite_name(const char *path, char *name, size_t size)
+{
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  const char *dot = strrchr(base, '.');
+  int length = dot ? dot - base : (int)strlen(base);
+  return snprintf(name, size, "%.*s", length, base) < (int)size ? 0 : -1;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+// Image files of dir, sorted; NULL-terminated
+static char **list_sprites(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+  {
+    perror(dir);
+    return NULL;
+  }
+
+  char **paths = NULL;
+  size_t count = 0;
+  struct dirent *e;
+  while ((e = readdir(d)))
+  {
+    if (e->d_name[0] == '.' ||
+        recel_format_from_name(e->d_name) == RECEL_FORMAT_AUTO)
+      continue;
+    paths = realloc(paths, sizeof(char*) * (count + 2));
+    paths[count] = malloc(strlen(dir) + strlen(e->d_name) + 2);
+    sprintf(paths[count], "%s/%s", dir, e->d_name);
+    count += 1;
+  }
+  closedir(d);
+
+  if (paths)
+  {
+    qsort(paths, count, sizeof(char*), compare_names);
+    paths[count] = NULL;
+  }
+  return paths;
+}
+
+int main(int argc, char **argv)
+{
+  int threads = 0;
+  double min_ms = 200, threshold = 10;
+  const char *sprites = "bench/sprites", *json = NULL, *baseline = NULL;
+  const char *save = NULL;
+  bool quick = false;
+  synth_t extra[64];
+  int extra_count = 0;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+      min_ms = strtod(argv[++i], NULL);
+    else if (strcmp(argv[i], "--sprites") == 0 && i + 1 < argc)
+      sprites = argv[++i];
+    else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+    {
+      recel_isa_t isa;
+      if (recel_isa_from_name(argv[++i], &isa) != 0 || recel_set_isa(isa) != 0)
+      {
+        fprintf(stderr, "unsupported instruction set '%s'\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--quick") == 0)
+      quick = true;
+    else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc &&
+             extra_count < 64)
+    {
+      if (parse_synth(argv[++i], &extra[extra_count++]) != 0)
+      {
+        fprintf(stderr, "invalid image '%s'\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+      save = argv[++i];
+    else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+      json = argv[++i];
+    else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+      baseline = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = strtod(argv[++i], NULL);
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  threadpool_t *pool = threadpool_new(threads);
+  uint64_t min_ns = min_ms * 1e6;
+  int corpus_count = sizeof(corpus) / sizeof(*corpus);
+  char **paths = list_sprites(sprites);
+  int sprite_count = 0;
+  while (paths && paths[sprite_count])
+    sprite_count += 1;
+
+  result_t *results =
+    malloc(sizeof(result_t) * (corpus_count + extra_count + sprite_count));
+  int count = 0, status = 0;
+
+  printf("%d threads, %s kernels\n", threadpool_size(pool),
+         recel_isa_name(recel_isa()));
+  print_header();
+  for (int i = 0; i < corpus_count + extra_count; ++i)
+  {
+    const synth_t *s = i < corpus_count ? &corpus[i] : &extra[i - corpus_count];
+    if (quick && i < corpus_count && (uint64_t)s->w * s->h > 256 * 256)
+      continue;
+
+    uint32_t *pixels = synth_image(s);
+    if (!pixels)
+    {
+      fprintf(stderr, "cannot generate '%s'\n", s->name);
+      status = 1;
+      continue;
+    }
+
+    if (save)
+    {
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/%s.png", save, s->name);
+      if (recel_image_save(path, RECEL_FORMAT_PNG, s->w, s->h, pixels) != 0)
+        fprintf(stderr, "cannot write '%s'\n", path);
+    }
+
+    if (measure(pool, min_ns, s->name, s->w, s->h, pixels, &results[count]) == 0)
+      print_result(&results[count++]);
+    else
+    {
+      fprintf(stderr, "cannot upscale '%s'\n", s->name);
+      status = 1;
+    }
+    free(pixels);
+  }
+
+  for (int i = 0; i < sprite_count; ++i)
+  {
+    recel_image_t img;
+    char name[64];
+    if (sprite_name(paths[i], name, sizeof(name)) != 0 ||
+        recel_image_load(&img, paths[i], RECEL_FORMAT_AUTO) != 0)
+    {
+      fprintf(stderr, "cannot load '%s'\n", paths[i]);
+      status = 1;
+      continue;
+    }
+
+    if (measure(pool, min_ns, name, img.w, img.h, img.pixels,
+                &results[count]) == 0)
+      print_result(&results[count++]);
+    else
+    {
+      fprintf(stderr, "cannot upscale '%s'\n", paths[i]);
+      status = 1;
+    }
+    recel_image_release(&img);
+  }
+
+  sequence_t scroll, *seq = &scroll;
+  if (measure_scroll(&scroll) == 0)
+    print_sequence(&scroll);
+  else
+  {
+    fprintf(stderr, "cannot play the frame sequence\n");
+    seq = NULL;
+    status = 1;
+  }
+
+  // Before saving, so that the baseline can be the same file
+  if (baseline)
+  {
+    int regressions = compare(baseline, threshold, results, count, seq);
+    if (regressions != 0)
+      status = 1;
+  }
+
+  if (json)
+  {
+    FILE *f = fopen(json, "w");
+    if (f)
+    {
+      write_json(f, threadpool_size(pool), results, count, seq);
+      fclose(f);
+    }
+    else
+    {
+      perror(json);
+      status = 1;
+    }
+  }
+
+  for (int i = 0; i < sprite_count; ++i)
+    free(paths[i]);
+  free(paths);
+  free(results);
+  threadpool_delete(pool);
+  return status;
+}
@@ -0,0 +1,655 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "recel.h"
+#include "fasttable.h"
+#include "reference.h"
+#include "threadpool.h"
+
+/* Differential checks: every variant of the library (single-threaded,
+ * threaded, chunked kernels, strided views, plans, incremental updates,
+ * animations) is
+ * run on random images and on image files, with the kernels of each
+ * instruction set, and must match the reference kernels bit for bit. */
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+      "Usage: %s [-n count] [--seed n] [--max-size n] [-j threads] [-v]\n"
+      "          [--isa scalar|sse2|avx2|avx512] [inputs...]\n"
+      "  Checks count (default 500) random images of at most max-size\n"
+      "  (default 48) pixels per side, then the image files of inputs\n"
+      "  (files or directories, bench/sprites by default).\n"
+      "  Random image i is generated from seed + i: a failure on it is\n"
+      "  reproduced with --seed <seed + i> -n 1.\n"
+      "  Threaded variants use a pool of 4 threads unless -j is given.\n"
+      "  Every instruction set of the CPU is checked, or only --isa.\n",
+      argv0);
+}
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static uint32_t rng_below(uint32_t n)
+{
+  return rng() % n;
+}
+
+/* Random images, mixing the shapes that stress different paths: noise
+ * (many short segments), runs, blocks (large flat areas), stripes and
+ * checkerboards (diagonal and crossing segments) */
+
+static uint32_t *random_image(uint32_t seed, uint32_t max_size,
+                              uint32_t *pw, uint32_t *ph)
+{
+  rng_state = seed * 2654435761u + 1;
+  uint32_t w = 1 + rng_below(max_size), h = 1 + rng_below(max_size);
+  uint32_t colors = 1 + rng_below(rng_below(2) ? 4 : 40);
+  uint32_t palette[64];
+  for (uint32_t i = 0; i < colors; ++i)
+    palette[i] = rng() | 0xff000000;
+
+  uint32_t *pixels = malloc(sizeof(uint32_t) * w * h);
+  if (!pixels)
+    return NULL;
+
+  int shape = rng_below(5);
+  uint32_t size = 1 + rng_below(6);
+  for (uint32_t y = 0; y < h; ++y)
+  {
+    for (uint32_t x = 0; x < w; ++x)
+    {
+      uint32_t *p = &pixels[(size_t)y * w + x];
+      switch (shape)
+      {
+        case 0: *p = palette[rng_below(colors)]; break;
+        case 1:
+          *p = x > 0 && rng_below(4) ? p[-1] : palette[rng_below(colors)];
+          break;
+        case 2: *p = palette[(x / size * 7 + y / size * 13) % colors]; break;
+        case 3: *p = palette[((x + y) / size) % colors]; break;
+        default: *p = palette[((x / size) ^ (y / size)) % colors]; break;
+      }
+    }
+  }
+
+  // Sprinkle noise over the regular shapes
+  for (uint32_t n = rng_below(w * h / 8 + 1); n > 0; --n)
+    pixels[rng_below(w * h)] = palette[rng_below(colors)];
+
+  *pw = w;
+  *ph = h;
+  return pixels;
+}
+
+/* Variants */
+
+enum {
+  CHECK_DISTANCE, CHECK_OUT_OF_CORE, CHECK_KERNELS, CHECK_SCANLINE, CHECK_VIEWS,
+  CHECK_UPSCALE, CHECK_THREADED, CHECK_PLAN, CHECK_UPDATE, CHECK_FRAMES,
+  CHECK_COUNT
+};
+
+static const char *const check_names[CHECK_COUNT] = {
+  "distance", "outofcore", "kernels", "scanline", "views", "upscale",
+  "threaded", "plan", "update", "frames",
+};
+
+typedef struct {
+  threadpool_t *pool;
+  colorcounter_t *counter; // shared by every image, as in plans
+  bool verbose;
+  uint32_t runs[CHECK_COUNT], failures[CHECK_COUNT];
+} checker_t;
+
+// Reports the first difference of count pixels, returns true if equal
+static bool same(checker_t *c, int check, const char *image,
+                 const uint32_t *expected, const uint32_t *actual,
+                 size_t count)
+{
+  c->runs[check] += 1;
+  if (actual && memcmp(expected, actual, sizeof(uint32_t) * count) == 0)
+    return true;
+
+  c->failures[check] += 1;
+  const char *isa = recel_isa_name(recel_isa());
+  if (!actual)
+    printf("%s, %s: %s failed\n", image, isa, check_names[check]);
+  else
+  {
+    size_t i = 0;
+    while (expected[i] == actual[i])
+      i += 1;
+    printf("%s, %s: %s differs at %zu of %zu: %08x instead of %08x\n",
+           image, isa, check_names[check], i, count, actual[i], expected[i]);
+  }
+  return false;
+}
+
+// Library kernels run on arbitrary chunks, as the pool would split them
+static void check_kernels(checker_t *c, const char *image, int w, int h,
+                          const uint32_t *dist, const uint32_t *input)
+{
+  size_t inner = (size_t)w * (h > 1 ? 2 * h - 2 : 0);
+  size_t outer = (size_t)w * (3 * h - 2);
+  uint32_t *expected = malloc(sizeof(uint32_t) * 2 * outer);
+  uint32_t *actual = malloc(sizeof(uint32_t) * outer);
+  uint32_t *ref_inner = malloc(sizeof(uint32_t) * (inner + 1));
+
+  int a = h > 1 ? rng_below(h) : 0, b = h > 1 ? rng_below(h) : 0;
+  int cuts[4] = { 0, a < b ? a : b, a < b ? b : a, h > 1 ? h - 1 : 0 };
+
+  reference_inflate(dist, input, w, h, ref_inner);
+  memset(actual, 0, sizeof(uint32_t) * inner);
+  for (int i = 0; i < 3; ++i)
+    inflate_rows(dist, input, w, h, actual, cuts[i], cuts[i + 1]);
+  same(c, CHECK_KERNELS, image, ref_inner, actual, inner);
+
+  reference_interleave(expected, input, ref_inner, w, h);
+  memset(actual, 0, sizeof(uint32_t) * outer);
+  if (h == 1)
+    interleave_rows(actual, input, ref_inner, w, h, 0, 0);
+  for (int i = 0; i < 3; ++i)
+    interleave_rows(actual, input, ref_inner, w, h, cuts[i], cuts[i + 1]);
+  same(c, CHECK_KERNELS, image, expected, actual, outer);
+
+  int x = rng_below(w + 1), rows = 3 * h - 2;
+  uint32_t *transposed = expected + outer;
+  reference_transpose(transposed, expected, w, rows);
+  transpose_rows(actual, expected, w, rows, 0, x);
+  transpose_rows(actual, expected, w, rows, x, w);
+  same(c, CHECK_KERNELS, image, transposed, actual, outer);
+
+  free(expected);
+  free(actual);
+  free(ref_inner);
+}
+
+static void widen(uint32_t *out, const uint16_t *in, size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+    out[i] = in[i];
+}
+
+// Same with the distances on 16 bits, when they fit: the image and the
+// distances themselves are inflated, the distances interleaved and
+// transposed
+static void check_kernels16(checker_t *c, const char *image, int w, int h,
+                            const uint32_t *dist, const uint32_t *input)
+{
+  size_t n = (size_t)w * h;
+  size_t inner = (size_t)w * (h > 1 ? 2 * h - 2 : 0);
+  size_t outer = (size_t)w * (3 * h - 2);
+  uint32_t *narrow = malloc(sizeof(uint32_t) * n);
+  memcpy(narrow, dist, sizeof(uint32_t) * n);
+  if (recel_distance_narrow(w, h, narrow) != 0)
+  {
+    free(narrow);
+    return;
+  }
+
+  const uint16_t *dist16 = (const uint16_t*)narrow;
+  uint32_t *expected = malloc(sizeof(uint32_t) * (2 * outer + inner + 1));
+  uint32_t *actual = malloc(sizeof(uint32_t) * (outer + 1));
+  uint16_t *actual16 = malloc(sizeof(uint16_t) * (outer + 1));
+  uint32_t *ref_inner = expected + 2 * outer;
+
+  int a = h > 1 ? rng_below(h) : 0, b = h > 1 ? rng_below(h) : 0;
+  int cuts[4] = { 0, a < b ? a : b, a < b ? b : a, h > 1 ? h - 1 : 0 };
+
+  reference_inflate(dist, input, w, h, expected);
+  memset(actual, 0, sizeof(uint32_t) * inner);
+  for (int i = 0; i < 3; ++i)
+    inflate_rows16(dist16, input, w, h, actual, cuts[i], cuts[i + 1]);
+  same(c, CHECK_KERNELS, image, expected, actual, inner);
+
+  reference_inflate(dist, dist, w, h, ref_inner);
+  memset(actual16, 0, sizeof(uint16_t) * inner);
+  for (int i = 0; i < 3; ++i)
+    inflate_dist16(dist16, w, h, actual16, cuts[i], cuts[i + 1]);
+  widen(actual, actual16, inner);
+  same(c, CHECK_KERNELS, image, ref_inner, actual, inner);
+
+  // actual16 holds the inflated distances, which fit as well
+  uint16_t *outer16 = malloc(sizeof(uint16_t) * (outer + 1));
+  reference_interleave(expected, dist, ref_inner, w, h);
+  memset(outer16, 0, sizeof(uint16_t) * outer);
+  if (h == 1)
+    interleave_rows16(outer16, dist16, actual16, w, h, 0, 0);
+  for (int i = 0; i < 3; ++i)
+    interleave_rows16(outer16, dist16, actual16, w, h, cuts[i], cuts[i + 1]);
+  widen(actual, outer16, outer);
+  same(c, CHECK_KERNELS, image, expected, actual, outer);
+
+  int x = rng_below(w + 1), rows = 3 * h - 2;
+  uint32_t *transposed = expected + outer;
+  reference_transpose(transposed, expected, w, rows);
+  transpose_rows16(actual16, outer16, w, rows, 0, x);
+  transpose_rows16(actual16, outer16, w, rows, x, w);
+  widen(actual, actual16, outer);
+  same(c, CHECK_KERNELS, image, transposed, actual, outer);
+
+  free(narrow);
+  free(expected);
+  free(actual);
+  free(actual16);
+  free(outer16);
+}
+
+// recel_scanline reads one column on each side of the scanned ones: it is
+// run on the inner columns of each pair of rows
+static void check_scanline(checker_t *c, const char *image, int w, int h,
+                           const uint32_t *dist, const uint32_t *input)
+{
+  if (w < 3 || h < 2)
+    return;
+
+  uint32_t *expected = calloc(4 * w, sizeof(uint32_t));
+  uint32_t *actual = expected + 2 * w;
+  for (int y = 0; y + 1 < h; ++y)
+  {
+    const uint32_t *d = dist + (size_t)y * w + 1, *i = input + (size_t)y * w + 1;
+    reference_scanline(w - 1, d, d + w, i, i + w, expected, expected + w);
+    recel_scanline(w - 1, d, d + w, i, i + w, actual, actual + w);
+    if (!same(c, CHECK_SCANLINE, image, expected, actual, 2 * w))
+      break;
+  }
+  free(expected);
+}
+
+/* Views are regions of larger buffers filled with noise, which must be
+ * left as is */
+
+static uint32_t noise(size_t i)
+{
+  return (uint32_t)i * 2654435761u;
+}
+
+// Packed w * h pixels (or noise if NULL) at (1, 2) of a wider buffer, of
+// a random stride
+static recel_view_t padded(uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  uint32_t stride = w + 1 + rng_below(8);
+  recel_view_t buffer = { NULL, stride, h + 4, stride };
+  size_t n = (size_t)buffer.stride * buffer.h;
+  buffer.pixels = malloc(sizeof(uint32_t) * n);
+  for (size_t i = 0; i < n; ++i)
+    buffer.pixels[i] = noise(i);
+
+  recel_view_t v = recel_view_region(buffer, 1, 2, w, h);
+  for (uint32_t y = 0; pixels && y < h; ++y)
+    memcpy(&VIEW_PIX(v, 0, y), pixels + (size_t)y * w, sizeof(uint32_t) * w);
+  return v;
+}
+
+// Copy v to packed out, NULL if the noise around it changed, and free it
+static uint32_t *unpad(recel_view_t v, uint32_t *out)
+{
+  uint32_t *buffer = v.pixels - 2 * v.stride - 1;
+  for (uint32_t y = 0; y < v.h + 4; ++y)
+  {
+    for (uint32_t x = 0; x < v.stride; ++x)
+    {
+      size_t i = (size_t)y * v.stride + x;
+      bool inside = x >= 1 && x < v.w + 1 && y >= 2 && y < v.h + 2;
+      if (inside)
+        out[(size_t)(y - 2) * v.w + x - 1] = buffer[i];
+      else if (buffer[i] != noise(i))
+        out = NULL;
+    }
+  }
+  free(buffer);
+  return out;
+}
+
+// Distance map, scan and the stages in place on views
+static void check_views(checker_t *c, const char *image, int w, int h,
+                        const uint32_t *dist, const uint32_t *input)
+{
+  size_t inner = (size_t)w * (h > 1 ? 2 * h - 2 : 0);
+  size_t outer = (size_t)w * (3 * h - 2);
+  uint32_t *expected = malloc(sizeof(uint32_t) * (2 * outer + inner + 1));
+  uint32_t *actual = malloc(sizeof(uint32_t) * (outer + 1));
+  uint32_t *ref_inner = expected + 2 * outer;
+
+  recel_view_t vinput = padded(w, h, input), vdist = padded(w, h, NULL);
+  recel_distance_view(vinput, vdist, c->counter, NULL);
+  same(c, CHECK_VIEWS, image, dist, unpad(vdist, actual), (size_t)w * h);
+  vdist = padded(w, h, dist);
+
+  if (h > 1)
+  {
+    // As in check_scanline, on the inner columns; the last column of the
+    // outputs is not written
+    if (w >= 3)
+    {
+      recel_view_t d = recel_view_region(vdist, 1, 0, w - 1, h);
+      recel_view_t i = recel_view_region(vinput, 1, 0, w - 1, h);
+      size_t n = (size_t)(w - 1) * (h - 1);
+      memset(expected, 0, sizeof(uint32_t) * 2 * n);
+      recel_view_t dout = padded(w - 1, h - 1, expected);
+      recel_view_t iout = padded(w - 1, h - 1, expected);
+      for (int y = 0; y + 1 < h; ++y)
+        reference_scanline(w - 1, &VIEW_PIX(d, 0, y), &VIEW_PIX(d, 0, y + 1),
+                           &VIEW_PIX(i, 0, y), &VIEW_PIX(i, 0, y + 1),
+                           expected + (w - 1) * y, expected + n + (w - 1) * y);
+      recel_scan_view(d, i, dout, iout);
+      if (unpad(dout, actual) && unpad(iout, actual + n))
+        same(c, CHECK_VIEWS, image, expected, actual, 2 * n);
+      else
+        same(c, CHECK_VIEWS, image, expected, NULL, 2 * n);
+    }
+
+    int y = rng_below(h);
+    recel_view_t vinner = padded(w, 2 * h - 2, NULL);
+    reference_inflate(dist, input, w, h, ref_inner);
+    inflate_view(vdist, vinput, vinner, 0, y);
+    inflate_view(vdist, vinput, vinner, y, h - 1);
+    same(c, CHECK_VIEWS, image, ref_inner, unpad(vinner, actual), inner);
+
+    recel_view_t vouter = padded(w, 3 * h - 2, NULL);
+    vinner = padded(w, 2 * h - 2, ref_inner);
+    reference_interleave(expected, input, ref_inner, w, h);
+    interleave_view(vouter, vinput, vinner, 0, y);
+    interleave_view(vouter, vinput, vinner, y, h - 1);
+    unpad(vinner, actual);
+    same(c, CHECK_VIEWS, image, expected, unpad(vouter, actual), outer);
+
+    int x = rng_below(w + 1), rows = 3 * h - 2;
+    uint32_t *transposed = expected + outer;
+    recel_view_t vin = padded(w, rows, expected), vout = padded(rows, w, NULL);
+    reference_transpose(transposed, expected, w, rows);
+    transpose_view(vout, vin, 0, x);
+    transpose_view(vout, vin, x, w);
+    unpad(vin, actual);
+    same(c, CHECK_VIEWS, image, transposed, unpad(vout, actual), outer);
+  }
+
+  unpad(vinput, actual);
+  unpad(vdist, actual);
+  free(expected);
+  free(actual);
+}
+
+// Recolor a random rectangle, for incremental updates
+static uint32_t *mutate(const uint32_t *input, uint32_t w, uint32_t h,
+                        recel_rect_t *rect)
+{
+  uint32_t *frame = malloc(sizeof(uint32_t) * w * h);
+  memcpy(frame, input, sizeof(uint32_t) * w * h);
+  rect->x = rng_below(w);
+  rect->y = rng_below(h);
+  rect->w = 1 + rng_below(w - rect->x);
+  rect->h = 1 + rng_below(h - rect->y);
+  uint32_t color = rng_below(2) ? input[rng_below(w * h)] : rng();
+  for (uint32_t y = rect->y; y < rect->y + rect->h; ++y)
+    for (uint32_t x = rect->x; x < rect->x + rect->w; ++x)
+      frame[(size_t)y * w + x] = color;
+  return frame;
+}
+
+static void check_image(checker_t *c, const char *image,
+                        uint32_t w, uint32_t h, const uint32_t *input)
+{
+  if (w >= 32768 || h >= 32768)
+    return;
+  if (c->verbose)
+    printf("%s, %s: %u*%u\n", image, recel_isa_name(recel_isa()), w, h);
+
+  // Distance map
+  uint32_t *expected = malloc(sizeof(uint32_t) * w * h);
+  uint32_t *actual = malloc(sizeof(uint32_t) * w * h);
+  reference_distance(w, h, input, expected);
+  recel_distance_into(w, h, input, actual, c->counter, NULL);
+  same(c, CHECK_DISTANCE, image, expected, actual, (size_t)w * h);
+  memset(actual, 0, sizeof(uint32_t) * w * h);
+  bool done = recel_distance_out_of_core(w, h, input, actual, NULL,
+                                         NULL) == 0;
+  same(c, CHECK_OUT_OF_CORE, image, expected, done ? actual : NULL,
+       (size_t)w * h);
+
+  check_kernels(c, image, w, h, expected, input);
+  check_kernels16(c, image, w, h, expected, input);
+  check_scanline(c, image, w, h, expected, input);
+  check_views(c, image, w, h, expected, input);
+  free(expected);
+  free(actual);
+
+  // Whole upscale
+  uint32_t ow = 3 * w - 2, oh = 3 * h - 2;
+  size_t size = (size_t)ow * oh;
+  uint32_t *reference = reference_upscale(w, h, input);
+  if (!reference)
+  {
+    printf("%s: out of memory\n", image);
+    return;
+  }
+
+  // Threaded runs and plans also map large arenas in huge pages
+  recel_options_t options = {
+    .pool = c->pool, .pages = RECEL_PAGES_TRANSPARENT,
+  };
+  for (int check = CHECK_UPSCALE; check <= CHECK_THREADED; ++check)
+  {
+    uint32_t rw = w, rh = h;
+    uint32_t *result = recel_upscale(check == CHECK_THREADED ? &options : NULL,
+                                     &rw, &rh, input);
+    if (result && (rw != ow || rh != oh))
+    {
+      printf("%s: %s gives %u*%u instead of %u*%u\n", image,
+             check_names[check], rw, rh, ow, oh);
+      recel_free(result);
+      result = NULL;
+    }
+    same(c, check, image, reference, result, size);
+    recel_free(result);
+  }
+
+  // Threaded, into a region of a larger buffer
+  uint32_t *output = malloc(sizeof(uint32_t) * size);
+  recel_view_t region = padded(ow, oh, NULL);
+  done = recel_upscale_into(&options, w, h, input, region) == 0;
+  uint32_t *into = unpad(region, output);
+  same(c, CHECK_VIEWS, image, reference, done ? into : NULL, size);
+
+  if (w < 2 || h < 2)
+  {
+    free(output);
+    free(reference);
+    return;
+  }
+
+  // Plans: a full run, then updates from another frame, with and without
+  // the changed rectangle
+  recel_plan_t *plan = recel_plan_new(&options, w, h);
+  recel_plan_run(plan, input, output);
+  same(c, CHECK_PLAN, image, reference, output, size);
+
+  recel_rect_t rect;
+  uint32_t *other = mutate(input, w, h, &rect);
+  for (int hint = 0; hint < 2; ++hint)
+  {
+    recel_plan_run(plan, other, output);
+    recel_plan_update(plan, input, output, hint ? &rect : NULL);
+    same(c, CHECK_UPDATE, image, reference, output, size);
+  }
+
+  // Same into a region of a larger buffer
+  region = padded(ow, oh, NULL);
+  recel_plan_run_view(plan, other, region);
+  recel_plan_update_view(plan, input, region, &rect);
+  same(c, CHECK_VIEWS, image, reference, unpad(region, output), size);
+  recel_plan_delete(plan);
+  free(output);
+
+  // Animation of the other frame, then twice the image
+  const uint32_t *frames[3] = { other, input, input };
+  uint32_t *outputs[3], same_as[3];
+  if (recel_upscale_frames(&options, w, h, 3, frames, outputs, same_as,
+                           NULL) == 0)
+  {
+    same(c, CHECK_FRAMES, image, reference, outputs[same_as[2]], size);
+    for (int i = 0; i < 3; ++i)
+    {
+      if (same_as[i] == (uint32_t)i)
+        recel_free(outputs[i]);
+    }
+  }
+  else
+    same(c, CHECK_FRAMES, image, reference, NULL, size);
+
+  free(other);
+  free(reference);
+}
+
+static int check_file(checker_t *c, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    DIR *d = opendir(path);
+    if (!d)
+    {
+      perror(path);
+      return -1;
+    }
+    int status = 0;
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+      if (e->d_name[0] == '.' ||
+          recel_format_from_name(e->d_name) == RECEL_FORMAT_AUTO)
+        continue;
+      char *file = malloc(strlen(path) + strlen(e->d_name) + 2);
+      sprintf(file, "%s/%s", path, e->d_name);
+      if (check_file(c, file) != 0)
+        status = -1;
+      free(file);
+    }
+    closedir(d);
+    return status;
+  }
+
+  recel_image_t img;
+  if (recel_image_load(&img, path, RECEL_FORMAT_AUTO) != 0)
+  {
+    fprintf(stderr, "cannot load '%s'\n", path);
+    return -1;
+  }
+  check_image(c, path, img.w, img.h, img.pixels);
+  recel_image_release(&img);
+  return 0;
+}
+
+#define WIDE_SIZE 288
+
+int main(int argc, char **argv)
+{
+  uint32_t count = 500, seed = 1, max_size = 48;
+  int threads = 4, input_count = 0, first = 0, last = recel_isa_detect();
+  bool verbose = false;
+  char **inputs = malloc(sizeof(char*) * argc);
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      count = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      seed = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+      max_size = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+    {
+      recel_isa_t isa;
+      if (recel_isa_from_name(argv[++i], &isa) != 0 || (int)isa > last)
+      {
+        fprintf(stderr, "unsupported instruction set '%s'\n", argv[i]);
+        free(inputs);
+        return 1;
+      }
+      first = last = isa;
+    }
+    else if (strcmp(argv[i], "-v") == 0)
+      verbose = true;
+    else if (argv[i][0] == '-' || max_size == 0)
+    {
+      usage(argv[0]);
+      free(inputs);
+      return 1;
+    }
+    else
+      inputs[input_count++] = argv[i];
+  }
+  if (max_size == 0 || max_size >= 32768)
+  {
+    usage(argv[0]);
+    free(inputs);
+    return 1;
+  }
+  if (input_count == 0)
+    inputs[input_count++] = "bench/sprites";
+
+  checker_t c = {
+    .pool = threadpool_new(threads), .counter = colorcounter_new(),
+    .verbose = verbose,
+  };
+  int status = 0;
+
+  for (int isa = first; isa <= last; ++isa)
+  {
+    recel_set_isa(isa);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      char image[64];
+      uint32_t w, h;
+      snprintf(image, sizeof(image), "random %u", seed + i);
+      uint32_t *pixels = random_image(seed + i, max_size, &w, &h);
+      if (!pixels)
+      {
+        status = 1;
+        break;
+      }
+      check_image(&c, image, w, h, pixels);
+      free(pixels);
+    }
+
+    // Distances past 16 bits, as many as the pixels with distinct colors
+    uint32_t *wide = malloc(sizeof(uint32_t) * WIDE_SIZE * WIDE_SIZE);
+    for (uint32_t i = 0; i < WIDE_SIZE * WIDE_SIZE; ++i)
+      wide[i] = i * 2654435761u;
+    check_image(&c, "distinct colors", WIDE_SIZE, WIDE_SIZE, wide);
+    free(wide);
+
+    for (int i = 0; i < input_count; ++i)
+    {
+      if (check_file(&c, inputs[i]) != 0)
+        status = 1;
+    }
+  }
+
+  uint32_t failures = 0;
+  for (int i = 0; i < CHECK_COUNT; ++i)
+  {
+    printf("%-9s %6u checks, %u failed\n", check_names[i], c.runs[i],
+           c.failures[i]);
+    failures += c.failures[i];
+  }
+  if (failures)
+    status = 1;
+
+  colorcounter_delete(c.counter);
+  threadpool_delete(c.pool);
+  free(inputs);
+  return status;
+}
@@ -0,0 +1,407 @@
+#include "reference.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reference kernels */
+
+// Color counter: colors in order of first appearance, a linear probing
+// table from color to that order, and ranks by decreasing count with the
+// first seen first among equal counts
+
+typedef struct {
+  uint32_t *keys, *counts, *ranks;
+  uint32_t count, capacity;
+  uint32_t *slots; // index + 1, 0 when empty
+  uint32_t slot_mask;
+} counter_t;
+
+static void counter_init(counter_t *c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+static void counter_release(counter_t *c)
+{
+  free(c->keys);
+  free(c->counts);
+  free(c->ranks);
+  free(c->slots);
+}
+
+static uint32_t *counter_slot(const counter_t *c, uint32_t key)
+{
+  uint32_t i = key * 2654435761u;
+  while (c->slots[i & c->slot_mask] &&
+         c->keys[c->slots[i & c->slot_mask] - 1] != key)
+    i += 1;
+  return &c->slots[i & c->slot_mask];
+}
+
+static void counter_start(counter_t *c)
+{
+  c->count = 0;
+  if (c->slots)
+    memset(c->slots, 0, sizeof(uint32_t) * (c->slot_mask + 1));
+}
+
+static void counter_incr(counter_t *c, uint32_t key)
+{
+  if (!c->slots || 2 * (c->count + 1) > c->slot_mask + 1)
+  {
+    // Grow the table and the arrays, then put the colors back
+    uint32_t size = c->slots ? 2 * (c->slot_mask + 1) : 64;
+    free(c->slots);
+    c->slots = calloc(size, sizeof(uint32_t));
+    c->slot_mask = size - 1;
+    c->capacity = size / 2;
+    c->keys = realloc(c->keys, sizeof(uint32_t) * c->capacity);
+    c->counts = realloc(c->counts, sizeof(uint32_t) * c->capacity);
+    c->ranks = realloc(c->ranks, sizeof(uint32_t) * c->capacity);
+    for (uint32_t i = 0; i < c->count; ++i)
+      *counter_slot(c, c->keys[i]) = i + 1;
+  }
+
+  uint32_t *slot = counter_slot(c, key);
+  if (*slot)
+    c->counts[*slot - 1] += 1;
+  else
+  {
+    // Colors counted after the ranking rank after the others
+    c->keys[c->count] = key;
+    c->counts[c->count] = 1;
+    c->ranks[c->count] = c->count;
+    c->count += 1;
+    *slot = c->count;
+  }
+}
+
+static const counter_t *sorting;
+
+static int compare_counts(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  if (sorting->counts[x] != sorting->counts[y])
+    return sorting->counts[x] > sorting->counts[y] ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+static void counter_rank(counter_t *c)
+{
+  uint32_t *order = malloc(sizeof(uint32_t) * (c->count + 1));
+  for (uint32_t i = 0; i < c->count; ++i)
+    order[i] = i;
+  sorting = c;
+  qsort(order, c->count, sizeof(uint32_t), compare_counts);
+  for (uint32_t i = 0; i < c->count; ++i)
+    c->ranks[order[i]] = i;
+  free(order);
+}
+
+// Colors that were not counted since the last start rank as -1
+static uint32_t counter_get_rank(const counter_t *c, uint32_t key)
+{
+  if (!c->slots)
+    return -1;
+  uint32_t slot = *counter_slot(c, key);
+  return slot ? c->ranks[slot - 1] : (uint32_t)-1;
+}
+
+// Distance map: 0 for pixels not reached yet, worklists are linked
+// through the map as negative values
+
+#define PIX(img, x, y) (img[(size_t)(y) * w + (x)])
+#define LINK(x, y) (~(int32_t)((((1u << 15) | (x)) << 15) | (y)))
+#define LINK_X(d) ((~(d) >> 15) & 0x7FFF)
+#define LINK_Y(d) ((~(d)) & 0x7FFF)
+
+#define PUSH(list, x, y) \
+  do { \
+    PIX(distance, x, y) = list; \
+    counter_incr(&counter, PIX(input, x, y)); \
+    list = LINK(x, y); \
+  } while (0)
+
+static bool inside(uint32_t w, uint32_t h, uint32_t x, uint32_t y)
+{
+  // Neighbours of the first row or column wrap around to large values
+  return x < w && y < h;
+}
+
+void reference_distance(uint32_t w, uint32_t h, const uint32_t *input,
+                        uint32_t *output)
+{
+  int32_t *distance = (int32_t*)output;
+  counter_t counter;
+  counter_init(&counter);
+  memset(distance, 0, sizeof(int32_t) * w * h);
+
+  // Borders, a single row or column only once
+  int32_t worklist = -1;
+  counter_start(&counter);
+  for (uint32_t x = 0; x < w; ++x)
+  {
+    PUSH(worklist, x, 0);
+    if (h > 1)
+      PUSH(worklist, x, h - 1);
+  }
+  for (uint32_t y = 1; y + 1 < h; ++y)
+  {
+    PUSH(worklist, 0, y);
+    if (w > 1)
+      PUSH(worklist, w - 1, y);
+  }
+
+  int32_t level = 1;
+  while (worklist != -1)
+  {
+    level += counter.count;
+    counter_start(&counter);
+
+    // Flood each color of the level from the pixels pushed so far, newest
+    // pixels first, until no pixel is added
+    int32_t sentinel = -1;
+    while (worklist != sentinel)
+    {
+      int32_t first = worklist, cursor = worklist;
+      do
+      {
+        uint32_t x = LINK_X(cursor), y = LINK_Y(cursor);
+        uint32_t color = PIX(input, x, y);
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+          for (int dy = -1; dy <= 1; ++dy)
+          {
+            uint32_t nx = x + dx, ny = y + dy;
+            if ((dx || dy) && inside(w, h, nx, ny) &&
+                PIX(input, nx, ny) == color && PIX(distance, nx, ny) == 0)
+              PUSH(worklist, nx, ny);
+          }
+        }
+        cursor = PIX(distance, x, y);
+      } while (cursor != sentinel);
+      sentinel = first;
+    }
+
+    counter_rank(&counter);
+
+    // Number the level, and push its 4-neighbours for the next one
+    int32_t cursor = worklist;
+    worklist = -1;
+    while (cursor != -1)
+    {
+      static const int dx[4] = { 0, -1, 1, 0 }, dy[4] = { -1, 0, 0, 1 };
+      uint32_t x = LINK_X(cursor), y = LINK_Y(cursor);
+      for (int i = 0; i < 4; ++i)
+      {
+        uint32_t nx = x + dx[i], ny = y + dy[i];
+        if (inside(w, h, nx, ny) && PIX(distance, nx, ny) == 0)
+          PUSH(worklist, nx, ny);
+      }
+      cursor = PIX(distance, x, y);
+      PIX(distance, x, y) = level + counter_get_rank(&counter, PIX(input, x, y));
+    }
+  }
+
+  counter_release(&counter);
+}
+
+// Interpolate columns [x0, x1) of a row pair, d1 being the lower distance
+static void inflate_segment(const uint32_t *d1, const uint32_t *d2,
+                            const uint32_t *i1, const uint32_t *i2,
+                            uint32_t *o1, uint32_t *o2,
+                            int x0, int x1, int w)
+{
+  bool l = x0 > 0 && d1[x0 - 1] >= d2[x0];
+  bool r = x1 < w - 1 && d1[x1] >= d2[x1 - 1];
+
+  // Deep columns take the row of higher distance on both output rows
+  for (int x = x0; x < x1; ++x)
+  {
+    bool deep;
+    if (l && r)
+    {
+      int d = (x1 - x0 + 1) / 4;
+      deep = x < x0 + d || x >= x1 - d;
+    }
+    else if (l)
+      deep = x < x0 + (x1 - x0) / 2;
+    else if (r)
+      deep = x >= x0 + (x1 - x0 + 1) / 2;
+    else
+    {
+      int d = (x1 - x0 + 3) / 4;
+      deep = x >= x0 + d && x < x1 - d;
+    }
+
+    o1[x] = deep ? i2[x] : i1[x];
+    o2[x] = i2[x];
+  }
+}
+
+void reference_inflate(const uint32_t *dist, const uint32_t *imag,
+                       int w, int h, uint32_t *out)
+{
+  for (int y = 0; y + 1 < h; ++y)
+  {
+    int x0 = 0;
+    while (x0 < w)
+    {
+      const uint32_t *d1 = dist + (size_t)w * y, *d2 = d1 + w;
+      const uint32_t *i1 = imag + (size_t)w * y, *i2 = i1 + w;
+      uint32_t *o1 = out + (size_t)w * 2 * y, *o2 = o1 + w;
+
+      if (d1[x0] == d2[x0])
+      {
+        o1[x0] = i1[x0];
+        o2[x0] = i2[x0];
+        x0 += 1;
+        continue;
+      }
+
+      if (d1[x0] > d2[x0])
+      {
+        const uint32_t *t;
+        t = d1; d1 = d2; d2 = t;
+        t = i1; i1 = i2; i2 = t;
+        uint32_t *o = o1; o1 = o2; o2 = o;
+      }
+
+      // The segment goes on while the rows keep crossing each other
+      int x1 = x0 + 1;
+      while (x1 < w && d1[x1] < d2[x1 - 1] && d1[x1 - 1] < d2[x1])
+        x1 += 1;
+      inflate_segment(d1, d2, i1, i2, o1, o2, x0, x1, w);
+      x0 = x1;
+    }
+  }
+}
+
+void reference_interleave(uint32_t *out, const uint32_t *outer,
+                          const uint32_t *inner, int w, int h)
+{
+  size_t row = sizeof(uint32_t) * w;
+  memcpy(out, outer, row);
+  for (int y = 0; y + 1 < h; ++y)
+  {
+    memcpy(out + (size_t)w * (3 * y + 1), inner + (size_t)w * (2 * y), row);
+    memcpy(out + (size_t)w * (3 * y + 2), inner + (size_t)w * (2 * y + 1), row);
+    memcpy(out + (size_t)w * (3 * y + 3), outer + (size_t)w * (y + 1), row);
+  }
+}
+
+void reference_transpose(uint32_t *out, const uint32_t *in, int w, int h)
+{
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      out[(size_t)x * h + y] = in[(size_t)y * w + x];
+}
+
+void reference_scanline(uint32_t w,
+                        const uint32_t *dista, const uint32_t *distb,
+                        const uint32_t *linea, const uint32_t *lineb,
+                        uint32_t *disto, uint32_t *lineo)
+{
+  int i = 0;
+  while (i < (int)w - 1)
+  {
+    if (dista[i] == distb[i])
+    {
+      lineo[i] = linea[i];
+      disto[i] = dista[i];
+      i += 1;
+      continue;
+    }
+
+    bool a_lower = dista[i] < distb[i];
+    const uint32_t *dist1 = a_lower ? dista : distb;
+    const uint32_t *line1 = a_lower ? linea : lineb;
+    const uint32_t *dist2 = a_lower ? distb : dista;
+    const uint32_t *line2 = a_lower ? lineb : linea;
+
+    uint32_t k = dist1[i];
+    int j = i + 1;
+    while (j < (int)w - 1 && dist1[j] == k && dist2[j] > k)
+      j += 1;
+
+    bool stickleft = dist1[i - 1] >= dist2[i];
+    bool stickright = dist1[j] >= dist2[j - 1];
+
+    // Each column of [i, j) comes from one of the rows
+    for (int x = i; x < j; ++x)
+    {
+      bool second;
+      if (stickleft == stickright)
+      {
+        int d = (j - i) / 3;
+        bool curve = j - i > 6 && x >= i + d && x < j - d;
+        second = stickleft != curve;
+      }
+      else
+        second = (x < (j + i) / 2) == stickleft;
+      lineo[x] = second ? line2[x] : line1[x];
+      disto[x] = second ? dist2[x] : dist1[x];
+    }
+    i = j;
+  }
+}
+
+// One pass: inflate, interleave and transpose the distance map and the
+// image, into (3h-2) * w images
+static bool pass(int w, int h, const uint32_t *dist, const uint32_t *imag,
+                 uint32_t **tdist, uint32_t **timag)
+{
+  size_t inner = (size_t)w * (h > 1 ? 2 * h - 2 : 0);
+  size_t outer = (size_t)w * (3 * h - 2);
+  uint32_t *disti = malloc(sizeof(uint32_t) * (inner + 1));
+  uint32_t *imagi = malloc(sizeof(uint32_t) * (inner + 1));
+  uint32_t *distii = malloc(sizeof(uint32_t) * outer);
+  uint32_t *imagii = malloc(sizeof(uint32_t) * outer);
+  *tdist = malloc(sizeof(uint32_t) * outer);
+  *timag = malloc(sizeof(uint32_t) * outer);
+
+  bool ok = disti && imagi && distii && imagii && *tdist && *timag;
+  if (ok)
+  {
+    reference_inflate(dist, dist, w, h, disti);
+    reference_inflate(dist, imag, w, h, imagi);
+    reference_interleave(distii, dist, disti, w, h);
+    reference_interleave(imagii, imag, imagi, w, h);
+    reference_transpose(*tdist, distii, w, 3 * h - 2);
+    reference_transpose(*timag, imagii, w, 3 * h - 2);
+  }
+  else
+  {
+    free(*tdist);
+    free(*timag);
+  }
+
+  free(disti);
+  free(imagi);
+  free(distii);
+  free(imagii);
+  return ok;
+}
+
+uint32_t *reference_upscale(uint32_t w, uint32_t h, const uint32_t *input)
+{
+  uint32_t *dist = malloc(sizeof(uint32_t) * w * h);
+  if (!dist)
+    return NULL;
+  reference_distance(w, h, input, dist);
+
+  uint32_t *dist1, *imag1, *dist2, *imag2;
+  bool ok = pass(w, h, dist, input, &dist1, &imag1);
+  free(dist);
+  if (!ok)
+    return NULL;
+
+  ok = pass(3 * h - 2, w, dist1, imag1, &dist2, &imag2);
+  free(dist1);
+  free(imag1);
+  if (!ok)
+    return NULL;
+
+  free(dist2);
+  return imag2;
+}
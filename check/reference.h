@@ -0,0 +1,37 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stdint.h>
+
+/* Reference kernels.
+ * Plain scalar copies of the library stages as they were before any fast
+ * path, single-threaded, without blocking or shared buffers.  They are
+ * never optimized: faster variants must match them bit for bit.
+ */
+
+/* Distance map of a w * h image into output, with its own color counter. */
+void reference_distance(uint32_t w, uint32_t h, const uint32_t *input,
+                        uint32_t *output);
+
+/* Rows 0 to h-2 paired with the next, into out (w * 2h-2). */
+void reference_inflate(const uint32_t *dist, const uint32_t *imag,
+                       int w, int h, uint32_t *out);
+
+/* Rows of outer (w * h) and inner (w * 2h-2) into out (w * 3h-2). */
+void reference_interleave(uint32_t *out, const uint32_t *outer,
+                          const uint32_t *inner, int w, int h);
+
+/* w * h into h * w. */
+void reference_transpose(uint32_t *out, const uint32_t *in, int w, int h);
+
+void reference_scanline(uint32_t w,
+                        const uint32_t *dista, const uint32_t *distb,
+                        const uint32_t *linea, const uint32_t *lineb,
+                        uint32_t *disto, uint32_t *lineo);
+
+/* Whole upscale of a w * h image, (3w-2) * (3h-2), to be freed with
+ * free(3), or NULL if out of memory.
+ */
+uint32_t *reference_upscale(uint32_t w, uint32_t h, const uint32_t *input);
+
+#endif /*REFERENCE_H*/
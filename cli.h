@@ -0,0 +1,89 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include "recel.h"
+#include "threadpool.h"
+
+/* Command line modes */
+
+typedef struct {
+  recel_format_t format; /* output format */
+  const char *output;    /* output file, or output directory in batch mode */
+  int threads;           /* 0 for one per CPU */
+  int queue;             /* pipelined batch: images buffered between stages */
+  bool io_uring;         /* pipelined batch: read and write with io_uring */
+  int large_share;       /* batch and server: concurrent large jobs, 0 for half */
+  recel_cache_t *cache;  /* result cache, or NULL */
+  uint32_t tile;         /* single image: tile size for deduplication, or 0 */
+  uint32_t tile_border;  /* single image: context around each tile */
+  uint32_t cell_w, cell_h; /* single image: sprite sheet cell size, or 0 */
+  recel_pages_t pages;   /* pages of the upscale buffers */
+  uint32_t frame_budget_us; /* real-time: frame time to report misses against */
+  int repeat;            /* client: number of requests, latencies on stdout */
+  bool inline_pixels;    /* client: send pixels on the socket, not a memfd */
+  bool stats;            /* single image: print the time of each stage */
+  const char *stats_json; /* single image: same, as JSON to a file or '-' */
+} cli_options_t;
+
+typedef struct {
+  char **paths;
+  int count, capacity;
+} filelist_t;
+
+/* Expand inputs (files, directories, glob patterns or @manifest files
+ * listing one path per line) to a list of files.
+ * Returns -1 if some input could not be expanded, after reporting it.
+ */
+int filelist_collect(filelist_t *l, int count, char **inputs);
+void filelist_free(filelist_t *l);
+
+/* outdir/basename.ext, to be freed with free(3) */
+char *batch_output_path(const char *outdir, const char *input,
+                        recel_format_t format);
+
+/* Report every output path given twice, with the inputs that produce it
+ * if inputs is not NULL.  Returns 0 if they are all distinct, else -1.
+ */
+int batch_check_outputs(int count, char *const *outputs,
+                        char *const *inputs);
+
+/* Process every file named by inputs, see filelist_collect.
+ * Results are written to opt->output, one failing file does not stop the
+ * others.
+ * Returns the process exit status.
+ */
+int batch_main(const cli_options_t *opt, threadpool_t *pool,
+               int count, char **inputs);
+
+/* Same as batch_main, with decoding, processing and encoding running as
+ * three pipelined stages: decoding image N+1 and encoding image N-1 overlap
+ * with processing image N.
+ * At most opt->queue images wait between two stages.
+ */
+int pipeline_main(const cli_options_t *opt, threadpool_t *pool,
+                  int count, char **inputs);
+
+/* Upscale the frames of an animation, from GIF files or one image per
+ * frame, to opt->output.  Identical frames are upscaled once and written as
+ * hard links.
+ * Returns the process exit status.
+ */
+int frames_main(const cli_options_t *opt, threadpool_t *pool,
+                int count, char **inputs);
+
+/* Upscale raw w * h RGBA frames from stdin to stdout with a recel_plan_t,
+ * and report frame time percentiles.
+ */
+int realtime_main(const cli_options_t *opt, threadpool_t *pool,
+                  uint32_t w, uint32_t h);
+
+/* Serve upscaling requests on a Unix socket until SIGINT or SIGTERM,
+ * see server.h for the protocol.
+ */
+int server_main(const cli_options_t *opt, threadpool_t *pool,
+                const char *path);
+
+/* Send input to the server at path and save the result to opt->output. */
+int client_main(const cli_options_t *opt, const char *path, const char *input);
+
+#endif /*CLI_H*/
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "cli.h"
+#include "server.h"
+#include "trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Client of the local server */
+
+static int connect_to(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+  return sock;
+}
+
+static int input_memfd(const recel_image_t *img)
+{
+  size_t bytes = (size_t)img->w * img->h * 4;
+  int fd = memfd_create("recel-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, bytes) == 0)
+  {
+    void *map = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      memcpy(map, img->pixels, bytes);
+      munmap(map, bytes);
+      if (fcntl(fd, F_ADD_SEALS, MEMFD_SEALS) == 0)
+        return fd;
+    }
+  }
+
+  close(fd);
+  return -1;
+}
+
+// One round trip. On success, *result is malloc'ed (inline) or mapped.
+static int request(int sock, int fd, const recel_image_t *img, bool inline_pixels,
+                   reply_t *reply, uint32_t **result, size_t *mapped)
+{
+  request_t req = { REQUEST_MAGIC, img->w, img->h,
+                    inline_pixels ? REQUEST_INLINE : 0 };
+  size_t bytes = (size_t)img->w * img->h * 4;
+  int rfd;
+
+  *result = NULL;
+  *mapped = 0;
+
+  if (proto_send(sock, &req, sizeof(req), inline_pixels ? -1 : fd) != 0)
+    return -1;
+  if (inline_pixels && proto_write(sock, img->pixels, bytes) != 0)
+    return -1;
+  if (proto_recv(sock, reply, sizeof(*reply), &rfd) != 0 ||
+      reply->magic != REPLY_MAGIC)
+    return -1;
+  if (reply->status != 0)
+    return 0;
+
+  size_t rbytes = (size_t)reply->w * reply->h * 4;
+  if (inline_pixels)
+  {
+    *result = malloc(rbytes);
+    if (!*result || proto_read(sock, *result, rbytes) != 0)
+    {
+      free(*result);
+      *result = NULL;
+      return -1;
+    }
+  }
+  else
+  {
+    struct stat st;
+    if (rfd < 0)
+      return -1;
+    if (fstat(rfd, &st) != 0 || (size_t)st.st_size < rbytes ||
+        (fcntl(rfd, F_GET_SEALS) & MEMFD_SEALS) != MEMFD_SEALS)
+    {
+      close(rfd);
+      return -1;
+    }
+    void *map = mmap(NULL, rbytes, PROT_READ, MAP_SHARED, rfd, 0);
+    close(rfd);
+    if (map == MAP_FAILED)
+      return -1;
+    *result = map;
+    *mapped = rbytes;
+  }
+  return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int client_main(const cli_options_t *opt, const char *path, const char *input)
+{
+  recel_image_t img;
+  int repeat = opt->repeat > 0 ? opt->repeat : 1;
+
+  int result = strcmp(input, "-") == 0
+    ? recel_image_read(&img, STDIN_FILENO, RECEL_FORMAT_AUTO)
+    : recel_image_load(&img, input, RECEL_FORMAT_AUTO);
+  if (result != 0)
+  {
+    fprintf(stderr, "cannot load '%s'\n", input);
+    return 1;
+  }
+
+  int sock = connect_to(path);
+  if (sock < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    recel_image_release(&img);
+    return 1;
+  }
+
+  int fd = opt->inline_pixels ? -1 : input_memfd(&img);
+  if (!opt->inline_pixels && fd < 0)
+  {
+    fprintf(stderr, "memfd: %s\n", strerror(errno));
+    close(sock);
+    recel_image_release(&img);
+    return 1;
+  }
+
+  uint64_t *latency = malloc(sizeof(uint64_t) * repeat);
+  int status = 0;
+
+  for (int i = 0; i < repeat && status == 0; ++i)
+  {
+    reply_t reply;
+    uint32_t *pixels;
+    size_t mapped;
+
+    uint64_t t0 = trace_now();
+    if (request(sock, fd, &img, opt->inline_pixels, &reply, &pixels, &mapped) != 0)
+    {
+      fprintf(stderr, "%s: connection lost\n", path);
+      status = 1;
+      break;
+    }
+    latency[i] = trace_now() - t0;
+
+    if (reply.status != 0)
+    {
+      fprintf(stderr, "server: %s\n", strerror(reply.status));
+      status = 1;
+    }
+    else if (i == repeat - 1 && opt->output)
+    {
+      int r = strcmp(opt->output, "-") == 0
+        ? recel_image_write(STDOUT_FILENO, opt->format, reply.w, reply.h, pixels)
+        : recel_image_save(opt->output, opt->format, reply.w, reply.h, pixels);
+      if (r != 0)
+      {
+        fprintf(stderr, "cannot write '%s'\n", opt->output);
+        status = 1;
+      }
+    }
+
+    if (mapped)
+      munmap(pixels, mapped);
+    else
+      free(pixels);
+
+    // One sample per line, in microseconds, for load testing
+    if (opt->repeat > 0)
+      printf("%llu\n", (unsigned long long)(latency[i] / 1000));
+  }
+
+  if (opt->repeat > 1 && status == 0)
+  {
+    qsort(latency, repeat, sizeof(uint64_t), compare_u64);
+    fprintf(stderr, "%d requests, latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            repeat, latency[repeat / 2] / 1e6, latency[repeat * 99 / 100] / 1e6,
+            latency[repeat - 1] / 1e6);
+  }
+
+  free(latency);
+  if (fd >= 0)
+    close(fd);
+  close(sock);
+  recel_image_release(&img);
+  return status;
+}
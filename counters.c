@@ -0,0 +1,107 @@
+#include "counters.h"
+#include <string.h>
+
+/* Counters */
+
+#ifdef RECEL_COUNTERS
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct block {
+  struct block *next;
+  recel_counters_t counters;
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block *blocks;
+static __thread struct block *local;
+
+// Blocks of exited threads are kept, their counts still add up
+recel_counters_t *counters_local(void)
+{
+  if (!local)
+  {
+    static recel_counters_t sink;
+    struct block *b = calloc(1, sizeof(struct block));
+    if (!b)
+      return &sink;
+    pthread_mutex_lock(&blocks_lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&blocks_lock);
+    local = b;
+  }
+  return &local->counters;
+}
+
+void counters_probe(uint32_t probes)
+{
+  recel_counters_t *c = counters_local();
+  c->lookups += 1;
+  c->probes += probes;
+  if (probes > c->probe_max)
+    c->probe_max = probes;
+  c->probe_histogram[probes < RECEL_COUNTER_PROBES ? probes
+                                                   : RECEL_COUNTER_PROBES - 1] += 1;
+}
+
+static void add_max(uint64_t *to, uint64_t v)
+{
+  if (v > *to)
+    *to = v;
+}
+
+int recel_counters_get(recel_counters_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&blocks_lock);
+  for (struct block *b = blocks; b; b = b->next)
+  {
+    const recel_counters_t *c = &b->counters;
+    out->distances += c->distances;
+    out->levels += c->levels;
+    for (int i = 0; i < RECEL_COUNTER_LEVELS; ++i)
+    {
+      out->level_frontier[i] += c->level_frontier[i];
+      out->level_pixels[i] += c->level_pixels[i];
+      out->level_colors[i] += c->level_colors[i];
+    }
+    add_max(&out->frontier_max, c->frontier_max);
+    add_max(&out->colors_max, c->colors_max);
+    out->lookups += c->lookups;
+    out->probes += c->probes;
+    add_max(&out->probe_max, c->probe_max);
+    for (int i = 0; i < RECEL_COUNTER_PROBES; ++i)
+      out->probe_histogram[i] += c->probe_histogram[i];
+    out->table_resizes += c->table_resizes;
+    out->counter_grows += c->counter_grows;
+    out->sorts += c->sorts;
+    out->sorted += c->sorted;
+    add_max(&out->sort_max, c->sort_max);
+  }
+  pthread_mutex_unlock(&blocks_lock);
+  return 0;
+}
+
+void recel_counters_reset(void)
+{
+  pthread_mutex_lock(&blocks_lock);
+  for (struct block *b = blocks; b; b = b->next)
+    memset(&b->counters, 0, sizeof(b->counters));
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+#else
+
+int recel_counters_get(recel_counters_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  return -1;
+}
+
+void recel_counters_reset(void)
+{
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "recel.h"
+
+/* Hot-path counters, see recel_counters_get.
+ * Built with -DRECEL_COUNTERS (make COUNTERS=1), otherwise the macros
+ * expand to nothing and their arguments are not evaluated.
+ * Each thread counts in its own recel_counters_t.
+ */
+
+#ifdef RECEL_COUNTERS
+
+recel_counters_t *counters_local(void);
+void counters_probe(uint32_t probes);
+
+#define COUNTER_ADD(field, n) (counters_local()->field += (n))
+#define COUNTER_MAX(field, v) \
+  do { \
+    recel_counters_t *c_ = counters_local(); \
+    uint64_t v_ = (v); \
+    if (v_ > c_->field) \
+      c_->field = v_; \
+  } while (0)
+#define COUNTER_PROBES(n) counters_probe(n)
+
+#else
+
+#define COUNTER_ADD(field, n) ((void)0)
+#define COUNTER_MAX(field, v) ((void)0)
+#define COUNTER_PROBES(n) ((void)0)
+
+#endif
+
+#endif /*COUNTERS_H*/
@@ -0,0 +1,26 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernels compiled for several instruction sets, see recel_isa.
+ * Every variant gives the same result as the scalar one.
+ */
+
+typedef struct {
+  /* First column from x on where d1 and d2 differ, or w. */
+  int (*flat_end)(const uint32_t *d1, const uint32_t *d2, int x, int w);
+  /* transpose_rows, rows of out and in are os and is pixels apart */
+  void (*transpose)(uint32_t *out, size_t os, const uint32_t *in, size_t is,
+                    int h, int x0, int x1);
+  /* Same on compact distances */
+  int (*flat_end16)(const uint16_t *d1, const uint16_t *d2, int x, int w);
+  void (*transpose16)(uint16_t *out, size_t os, const uint16_t *in,
+                      size_t is, int h, int x0, int x1);
+} cpu_kernels_t;
+
+/* Kernels of the current instruction set. */
+const cpu_kernels_t *cpu_kernels(void);
+
+#endif /*CPU_H*/
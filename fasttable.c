@@ -1,5 +1,7 @@
 #include "fasttable.h"
 #include <stdlib.h>
+#include <string.h>
+#include "counters.h"
 
 struct cell_s {
   uint32_t key;
@@ -16,18 +18,25 @@ struct fasttable {
 
 fasttable_t *fasttable_new(void)
 {
-  fasttable_t *t = malloc(sizeof(fasttable_t));
+  fasttable_t *t = recel_malloc(sizeof(fasttable_t));
+  if (!t)
+    return NULL;
   t->capacity = 16;
   t->filled = 0;
   t->gen = 1;
-  t->cells = calloc(sizeof(struct cell_s), 16);
+  t->cells = recel_calloc(sizeof(struct cell_s), 16);
+  if (!t->cells)
+  {
+    recel_free(t);
+    return NULL;
+  }
   return t;
 }
 
 void fasttable_delete(fasttable_t *t)
 {
-  free(t->cells);
-  free(t);
+  recel_free(t->cells);
+  recel_free(t);
 }
 
 static uint32_t fasttable_index(uint32_t key)
@@ -35,14 +44,18 @@ static uint32_t fasttable_index(uint32_t key)
   return (key ^ 3087974849) * 2654435761;
 }
 
-static void fasttable_resize(fasttable_t *t)
+// Returns -1 with the table untouched if the new cells cannot be allocated
+static int fasttable_resize(fasttable_t *t)
 {
   int oldgen = t->gen;
   int oldsize = t->capacity;
   struct cell_s *oldcells = t->cells;
 
   int new_capacity = oldsize * 2, mask = new_capacity - 1;
-  struct cell_s *newcells = calloc(sizeof(struct cell_s), new_capacity);
+  struct cell_s *newcells = recel_calloc(sizeof(struct cell_s), new_capacity);
+  if (!newcells)
+    return -1;
+  COUNTER_ADD(table_resizes, 1);
 
   t->capacity = new_capacity;
   t->cells = newcells;
@@ -64,7 +77,8 @@ static void fasttable_resize(fasttable_t *t)
     }
   }
 
-  free(oldcells);
+  recel_free(oldcells);
+  return 0;
 }
 
 uint32_t *fasttable_cell(fasttable_t *t, uint32_t key)
@@ -76,10 +90,14 @@ uint32_t *fasttable_cell(fasttable_t *t, uint32_t key)
   while (cells[index & mask].gen == t->gen)
   {
     if (cells[index & mask].key == key)
+    {
+      COUNTER_PROBES((uint32_t)index - fasttable_index(key));
       return &cells[index & mask].value;
+    }
     index += 1;
   }
 
+  COUNTER_PROBES((uint32_t)index - fasttable_index(key));
   t->filled += 1;
 
   struct cell_s *cell = &cells[index & mask];
@@ -110,9 +128,25 @@ void fasttable_flush(fasttable_t *t)
   {
     t->gen += 1;
     t->filled = 0;
+
+    // Long-lived tables: clear the cells before generations repeat
+    if (t->gen == 0)
+    {
+      memset(t->cells, 0, sizeof(struct cell_s) * t->capacity);
+      t->gen = 1;
+    }
   }
 }
 
+int fasttable_reserve(fasttable_t *t, uint32_t count)
+{
+  // Keep below the 3/4 load that triggers a resize
+  while ((uint64_t)count * 4 >= (uint64_t)t->capacity * 3)
+    if (fasttable_resize(t) != 0)
+      return -1;
+  return 0;
+}
+
 struct colorcell_s {
   uint32_t key;
   uint32_t value;
@@ -120,6 +154,7 @@ struct colorcell_s {
 
 struct colorcounter {
   struct colorcell_s *cells;
+  struct colorcell_s *scratch; // for sorting, same capacity as cells
   int filled;
   int capacity;
   fasttable_t *table;
@@ -127,19 +162,50 @@ struct colorcounter {
 
 colorcounter_t *colorcounter_new(void)
 {
-  colorcounter_t *t = malloc(sizeof(colorcounter_t));
+  colorcounter_t *t = recel_malloc(sizeof(colorcounter_t));
+  if (!t)
+    return NULL;
   t->capacity = 16;
   t->filled = 0;
-  t->cells = calloc(sizeof(struct colorcell_s), 16);
+  t->cells = recel_calloc(sizeof(struct colorcell_s), 16);
+  t->scratch = recel_calloc(sizeof(struct colorcell_s), 16);
   t->table = fasttable_new();
+  if (!t->cells || !t->scratch || !t->table)
+  {
+    colorcounter_delete(t);
+    return NULL;
+  }
   return t;
 }
 
 void colorcounter_delete(colorcounter_t *t)
 {
-  fasttable_delete(t->table);
-  free(t->cells);
-  free(t);
+  if (!t)
+    return;
+  if (t->table)
+    fasttable_delete(t->table);
+  recel_free(t->cells);
+  recel_free(t->scratch);
+  recel_free(t);
+}
+
+int colorcounter_reserve(colorcounter_t *t, uint32_t count)
+{
+  if ((uint32_t)t->capacity <= count)
+  {
+    // capacity only grows once both buffers have
+    size_t bytes = ((size_t)count + 1) * sizeof(struct colorcell_s);
+    struct colorcell_s *cells = recel_realloc(t->cells, bytes);
+    if (!cells)
+      return -1;
+    t->cells = cells;
+    struct colorcell_s *scratch = recel_realloc(t->scratch, bytes);
+    if (!scratch)
+      return -1;
+    t->scratch = scratch;
+    t->capacity = count + 1;
+  }
+  return fasttable_reserve(t->table, count);
 }
 
 void colorcounter_start(colorcounter_t *t)
@@ -157,8 +223,10 @@ void colorcounter_incr(colorcounter_t *t, uint32_t value)
     t->filled += 1;
     if (t->filled >= t->capacity)
     {
+      COUNTER_ADD(counter_grows, 1);
       t->capacity = t->filled * 2;
-      t->cells = realloc(t->cells, t->capacity * sizeof(struct colorcell_s));
+      t->cells = recel_realloc(t->cells, t->capacity * sizeof(struct colorcell_s));
+      t->scratch = recel_realloc(t->scratch, t->capacity * sizeof(struct colorcell_s));
     }
     t->cells[*index].key = value;
     t->cells[*index].value = 1;
@@ -172,15 +240,60 @@ uint32_t colorcounter_distinct_count(colorcounter_t *t)
   return t->filled;
 }
 
-static int colorcell_compar(const void *a, const void *b)
+// Stable sort by decreasing count, colors seen first come first among
+// equal counts.  Merge sort in the scratch buffer: unlike qsort, it does not
+// allocate and its order does not depend on the C library.
+static void colorcounter_sort(colorcounter_t *t)
 {
-  const struct colorcell_s *ca = a, *cb = b;
-  return (long int)cb->value - (long int)ca->value;
+  enum { RUN = 16 };
+  struct colorcell_s *a = t->cells, *b = t->scratch;
+  int n = t->filled;
+
+  for (int lo = 0; lo < n; lo += RUN)
+  {
+    int hi = lo + RUN < n ? lo + RUN : n;
+    for (int i = lo + 1; i < hi; ++i)
+    {
+      struct colorcell_s cell = a[i];
+      int j = i;
+      for (; j > lo && a[j - 1].value < cell.value; --j)
+        a[j] = a[j - 1];
+      a[j] = cell;
+    }
+  }
+
+  for (int width = RUN; width < n; width *= 2)
+  {
+    for (int lo = 0; lo < n; lo += 2 * width)
+    {
+      int mid = lo + width < n ? lo + width : n;
+      int hi = lo + 2 * width < n ? lo + 2 * width : n;
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi)
+        b[k++] = a[j].value > a[i].value ? a[j++] : a[i++];
+      while (i < mid)
+        b[k++] = a[i++];
+      while (j < hi)
+        b[k++] = a[j++];
+    }
+    struct colorcell_s *tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  if (a != t->cells)
+  {
+    for (int i = 0; i < n; ++i)
+      t->cells[i] = a[i];
+  }
 }
 
 void colorcounter_rank(colorcounter_t *t)
 {
-  qsort(t->cells, t->filled, sizeof(struct colorcell_s), colorcell_compar);
+  COUNTER_ADD(sorts, 1);
+  COUNTER_ADD(sorted, t->filled);
+  COUNTER_MAX(sort_max, t->filled);
+  colorcounter_sort(t);
   for (int i = 0; i < t->filled; ++i)
   {
     *fasttable_cell(t->table, t->cells[i].key) = i;
@@ -10,11 +10,22 @@ void fasttable_delete(fasttable_t *t);
 uint32_t *fasttable_cell(fasttable_t *t, uint32_t value);
 void fasttable_flush(fasttable_t *t);
 
+/* Grow so that count keys fit without allocating.
+ * Returns 0, or -1 if the memory cannot be allocated.
+ */
+int fasttable_reserve(fasttable_t *t, uint32_t count);
+
 typedef struct colorcounter colorcounter_t;
 
+/* NULL if the memory cannot be allocated. */
 colorcounter_t *colorcounter_new(void);
 void colorcounter_delete(colorcounter_t *t);
 
+/* Grow so that count distinct colors fit without allocating.
+ * Returns 0, or -1 if the memory cannot be allocated.
+ */
+int colorcounter_reserve(colorcounter_t *t, uint32_t count);
+
 void colorcounter_start(colorcounter_t *t);
 void colorcounter_incr(colorcounter_t *t, uint32_t value);
 uint32_t colorcounter_distinct_count(colorcounter_t *t);
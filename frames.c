@@ -0,0 +1,183 @@
+#include "cli.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Animations: GIF files or sequences of numbered images */
+
+typedef struct {
+  const cli_options_t *opt;
+  filelist_t *files;
+  recel_image_t *images;
+  uint32_t *counts;
+
+  uint32_t w, h, count;
+  uint32_t **outputs;
+  char **paths;
+  uint32_t *same;
+  atomic_int failed;
+} animation_t;
+
+static void load_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  animation_t *a = ctx;
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    if (recel_image_load_frames(&a->images[i], a->files->paths[i],
+                                &a->counts[i]) != 0)
+    {
+      fprintf(stderr, "cannot load '%s'\n", a->files->paths[i]);
+      atomic_fetch_add(&a->failed, 1);
+    }
+  }
+}
+
+static void save_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  animation_t *a = ctx;
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    if (a->same[i] == i &&
+        recel_image_save(a->paths[i], a->opt->format, 3 * a->w - 2,
+                         3 * a->h - 2, a->outputs[i]) != 0)
+    {
+      fprintf(stderr, "cannot write '%s'\n", a->paths[i]);
+      atomic_fetch_add(&a->failed, 1);
+    }
+  }
+}
+
+// outdir/base_NNNN.ext for frame n of a file holding several frames
+static char *frame_output_path(const char *outdir, const char *input,
+                               uint32_t n, recel_format_t format)
+{
+  char *path = batch_output_path(outdir, input, format);
+  char *dot = strrchr(path, '.');
+  char *framed = malloc(strlen(path) + 12);
+  sprintf(framed, "%.*s_%04u%s", (int)(dot - path), path, n, dot);
+  free(path);
+  return framed;
+}
+
+int frames_main(const cli_options_t *opt, threadpool_t *pool,
+                int count, char **inputs)
+{
+  filelist_t files;
+  if (filelist_collect(&files, count, inputs) != 0 || files.count == 0)
+  {
+    filelist_free(&files);
+    return 1;
+  }
+
+  if (mkdir(opt->output, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "%s: %s\n", opt->output, strerror(errno));
+    filelist_free(&files);
+    return 1;
+  }
+
+  animation_t a = { .opt = opt, .files = &files };
+  a.images = calloc(files.count, sizeof(recel_image_t));
+  a.counts = calloc(files.count, sizeof(uint32_t));
+  atomic_init(&a.failed, 0);
+  threadpool_parallel_for(pool, files.count, 1, load_task, &a);
+
+  // Every frame must have the size of the first one
+  int status = atomic_load(&a.failed) != 0;
+  for (int i = 0; i < files.count && !status; ++i)
+  {
+    if (i == 0)
+    {
+      a.w = a.images[0].w;
+      a.h = a.images[0].h;
+    }
+    if (a.images[i].w != a.w || a.images[i].h != a.h)
+    {
+      fprintf(stderr, "%s: %u*%u frames, expected %u*%u\n", files.paths[i],
+              a.images[i].w, a.images[i].h, a.w, a.h);
+      status = 1;
+    }
+    a.count += a.counts[i];
+  }
+
+  const uint32_t **frames = NULL;
+  if (!status)
+  {
+    frames = malloc(sizeof(uint32_t*) * a.count);
+    a.outputs = malloc(sizeof(uint32_t*) * a.count);
+    a.paths = malloc(sizeof(char*) * a.count);
+    a.same = malloc(sizeof(uint32_t) * a.count);
+
+    uint32_t n = 0;
+    for (int i = 0; i < files.count; ++i)
+    {
+      for (uint32_t j = 0; j < a.counts[i]; ++j, ++n)
+      {
+        frames[n] = a.images[i].pixels + (size_t)j * a.w * a.h;
+        a.paths[n] = a.counts[i] == 1
+          ? batch_output_path(opt->output, files.paths[i], opt->format)
+          : frame_output_path(opt->output, files.paths[i], j, opt->format);
+      }
+    }
+
+    recel_options_t options = {
+      .pool = pool, .cache = opt->cache, .pages = opt->pages,
+    };
+    recel_frame_stats_t stats;
+    if (batch_check_outputs(a.count, a.paths, NULL) != 0)
+      status = 1;
+    else if (recel_upscale_frames(&options, a.w, a.h, a.count, frames,
+                                  a.outputs, a.same, &stats) != 0)
+    {
+      fprintf(stderr, "cannot upscale %u*%u frames\n", a.w, a.h);
+      status = 1;
+    }
+    else
+      fprintf(stderr, "%u frames of %u*%u, %u unique, %u partly redone, "
+              "upscaled in %.1f ms\n", stats.frames, a.w, a.h, stats.unique,
+              stats.partial, stats.upscale_ns / 1e6);
+  }
+
+  for (int i = 0; i < files.count; ++i)
+    recel_image_release(&a.images[i]);
+
+  if (!status)
+  {
+    threadpool_parallel_for(pool, a.count, 1, save_task, &a);
+
+    // Duplicates are links to the file of the same frame
+    for (uint32_t i = 0; i < a.count; ++i)
+    {
+      if (a.same[i] == i)
+        continue;
+      unlink(a.paths[i]);
+      if (link(a.paths[a.same[i]], a.paths[i]) != 0 &&
+          recel_image_save(a.paths[i], opt->format, 3 * a.w - 2, 3 * a.h - 2,
+                           a.outputs[a.same[i]]) != 0)
+      {
+        fprintf(stderr, "cannot write '%s'\n", a.paths[i]);
+        atomic_fetch_add(&a.failed, 1);
+      }
+    }
+    status = atomic_load(&a.failed) != 0;
+
+    for (uint32_t i = 0; i < a.count; ++i)
+      recel_free(a.outputs[i]);
+  }
+
+  for (uint32_t i = 0; a.paths && i < a.count; ++i)
+    free(a.paths[i]);
+
+  free(frames);
+  free(a.outputs);
+  free(a.paths);
+  free(a.same);
+  free(a.images);
+  free(a.counts);
+  filelist_free(&files);
+  return status;
+}
@@ -0,0 +1,154 @@
+/* Template of inflate_rows, included by recel_upscale.c once per width of
+ * the distances and of the pixels, with:
+ *   DIST_T   type of the distances
+ *   PIX_T    type of the interpolated pixels
+ *   FLAT_END member of cpu_kernels_t comparing two rows of distances
+ *   NAME(x)  name of the functions
+ */
+
+static void NAME(inflate_segment)(const DIST_T *d1, const DIST_T *d2,
+                                  const PIX_T *i1, const PIX_T *i2,
+                                  PIX_T *o1, PIX_T *o2,
+                                  int x0, int x1, int w)
+{
+  // Classify corners
+  int l = (x0 > 0) ? d1[x0-1] >= d2[x0] : 0;
+  int r = (x1 < w-1) ? d1[x1] >= d2[x1-1] : 0;
+
+  // Interpolate
+  if (l && r)
+  {
+    int x = x0;
+    int d = (x1 - x0 + 1) / 4;
+
+    for (; x < x0 + d; x++)
+    {
+      o1[x] = o2[x] = i2[x];
+    }
+
+    for (; x < x1 - d; x++)
+    {
+      o1[x] = i1[x];
+      o2[x] = i2[x];
+    }
+
+    for (; x < x1; x++)
+    {
+      o1[x] = o2[x] = i2[x];
+    }
+  }
+  else if (l)
+  {
+    int x = x0;
+    int d = (x1 - x0) / 2;
+
+    for (; x < x0 + d; x++)
+      o1[x] = o2[x] = i2[x];
+
+    for (; x < x1; x++)
+    {
+      o1[x] = i1[x];
+      o2[x] = i2[x];
+    }
+  }
+  else if (r)
+  {
+    int x = x0;
+    int d = (x1 - x0 + 1) / 2;
+
+    for (; x < x0 + d; x++)
+    {
+      o1[x] = i1[x];
+      o2[x] = i2[x];
+    }
+
+    for (; x < x1; x++)
+      o1[x] = o2[x] = i2[x];
+  }
+  else
+  {
+    int x = x0;
+    int d = (x1 - x0 + 3) / 4;
+
+    for (; x < x0 + d; x++)
+    {
+      o1[x] = i1[x];
+      o2[x] = i2[x];
+    }
+
+    for (; x < x1 - d; x++)
+    {
+      o1[x] = o2[x] = i2[x];
+    }
+
+    for (; x < x1; x++)
+    {
+      o1[x] = i1[x];
+      o2[x] = i2[x];
+    }
+  }
+}
+
+static int NAME(segment_bound)(const DIST_T *d1, const DIST_T *d2, int x, int w)
+{
+  // Length of the segment: x1-x0
+  do x += 1;
+  while (x < w && d1[x] < d2[x - 1] && d1[x - 1] < d2[x]);
+  return x;
+}
+
+// Rows of dist, imag and out are ds, is and os elements apart
+static void NAME(inflate_rows)(const DIST_T *dist, size_t ds,
+                               const PIX_T *imag, size_t is,
+                               int w, int h, PIX_T *out, size_t os,
+                               int y0, int y1)
+{
+  if (w == 0)
+    return;
+
+  if (y1 > h - 1)
+    y1 = h - 1;
+
+  const cpu_kernels_t *k = cpu_kernels();
+  for (int y = y0; y < y1; y++)
+  {
+    int x0 = 0;
+
+    while (x0 < w)
+    {
+      const DIST_T *pd1 = dist + ds * (y + 0);
+      const DIST_T *pd2 = dist + ds * (y + 1);
+      const PIX_T *pi1 = imag + is * (y + 0);
+      const PIX_T *pi2 = imag + is * (y + 1);
+      PIX_T *po1 = out + os * (2 * y + 0);
+      PIX_T *po2 = out + os * (2 * y + 1);
+
+      if (pd1[x0] == pd2[x0])
+      { // Flat area, up to the next column where the rows differ
+        int x1 = k->FLAT_END(pd1, pd2, x0 + 1, w);
+        for (; x0 < x1; x0++)
+        {
+          po1[x0] = pi1[x0];
+          po2[x0] = pi2[x0];
+        }
+        continue;
+      }
+
+      // Make pd1 the lower distance, then interpolate the whole segment
+      if (pd1[x0] > pd2[x0])
+      {
+        const DIST_T *pd = pd1; pd1 = pd2; pd2 = pd;
+        const PIX_T *pi = pi1; pi1 = pi2; pi2 = pi;
+        PIX_T *po = po1; po1 = po2; po2 = po;
+      }
+      int x1 = NAME(segment_bound)(pd1, pd2, x0, w);
+      NAME(inflate_segment)(pd1, pd2, pi1, pi2, po1, po2, x0, x1, w);
+      x0 = x1;
+    }
+  }
+}
+
+#undef DIST_T
+#undef PIX_T
+#undef FLAT_END
+#undef NAME
@@ -1,285 +1,547 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "recel.h"
-#include "stb_image.h"
-#include "stb_image_write.h"
-
-typedef struct {
-  int length;
-  bool l, r;
-} segment_t;
-
-void inflate_segment(const uint32_t *d1, const uint32_t *d2,
-                     const uint32_t *i1, const uint32_t *i2,
-                     uint32_t *o1, uint32_t *o2,
-                     int x0, int w, int w0, int w1)
-{
-  // Classify corners
-  int l = (x0 > 0) ? d1[x0-1] >= d2[x0] : 0;
-  int r = (x1 < w-1) ? d1[x1] >= d2[x1-1] : 0;
-  
-  // Interpolate
-  if (l && r)
-  {
-    int x = x0;
-    int d = (x1 - x0 + 1) / 4;
-
-    for (; x < x0 + d; x++)
-    {
-      o1[x] = o2[x] = i2[x];
-    }
-
-    for (; x < x1 - d; x++)
-    {
-      o1[x] = i1[x];
-      o2[x] = i2[x];
-    }
-
-    for (; x < x1; x++)
-    {
-      o1[x] = o2[x] = i2[x];
-    }
-  }
-  else if (l)
-  {
-    int x = x0;
-    int d = (x1 - x0) / 2;
-
-    for (; x < x0 + d; x++)
-      o1[x] = o2[x] = i2[x];
-
-    for (; x < x1; x++)
-    {
-      o1[x] = i1[x];
-      o2[x] = i2[x];
-    }
-  }
-  else if (r)
-  {
-    int x = x0;
-    int d = (x1 - x0 + 1) / 2;
-
-    for (; x < x0 + d; x++)
-    {
-      o1[x] = i1[x];
-      o2[x] = i2[x];
-    }
-
-    for (; x < x1; x++)
-      o1[x] = o2[x] = i2[x];
-  }
-  else 
-  {
-    int x = x0;
-    int d = (x1 - x0 + 3) / 4;
-
-    for (; x < x0 + d; x++)
-    {
-      o1[x] = i1[x];
-      o2[x] = i2[x];
-    }
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cli.h"
+#include "memory.h"
+#include "trace.h"
 
-    for (; x < x1 - d; x++)
-    {
-      o1[x] = o2[x] = i2[x];
-    }
-
-    for (; x < x1; x++)
-    {
-      o1[x] = i1[x];
-      o2[x] = i2[x];
-    }
-  }
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+      "Usage: %s [-f png|raw|pam|qoi] [-j threads] [-o output] input\n"
+      "          [--cache dir [--cache-size MiB]] (also with -b and --serve)\n"
+      "          [--tiles size [--tile-border n] | --cells WxH]\n"
+      "          [--stats] [--stats-json file] [--trace file] [--counters]\n"
+      "          [--isa scalar|sse2|avx2|avx512] [--huge-pages thp|hugetlb]\n"
+      "          (with every mode)\n"
+      "       %s [-f png|raw|pam|qoi] [-j threads] -b outdir inputs...\n"
+      "          [--large-share n] [--pipeline [--queue n] [--io-uring]]\n"
+      "       %s [-f png|raw|pam|qoi] [-j threads] --frames outdir inputs...\n"
+      "       %s [-j threads] --estimate inputs...\n"
+      "       %s [-j threads] [--budget ms] --realtime WxH < frames > frames\n"
+      "       %s [-j threads] [--large-share n] --serve socket\n"
+      "       %s [-f png|raw|pam|qoi] [-o output] [--repeat n] [--inline]\n"
+      "          --client socket input\n"
+      "  input and output can be '-' for stdin and stdout.\n"
+      "  Without -o, the result is saved to outi.<format> in the current\n"
+      "  directory, together with intermediate images.\n"
+      "  With -b, inputs are files, directories, glob patterns or @manifest\n"
+      "  files, and results are written to outdir under the name of their\n"
+      "  input; inputs whose results would have the same name are refused.\n"
+      "  Small images are processed first in batch and server modes, and at\n"
+      "  most n (default half the threads) large images run at once.\n"
+      "  --pipeline overlaps decoding, processing and encoding of successive\n"
+      "  images, with at most n (default 2) images queued between stages,\n"
+      "  and reports how busy each stage was.\n"
+      "  --serve processes images sent to a Unix socket by --client, which\n"
+      "  passes pixels as memfd (or inline on the socket with --inline).\n"
+      "  With --repeat, the client sends n requests and prints the latency\n"
+      "  of each one in microseconds.\n"
+      "  --cache dir reuses results of identical images across runs, keeping\n"
+      "  at most --cache-size MiB (default 1024) of recently used results.\n"
+      "  --tiles upscales each distinct size*size tile once, with n (default 4)\n"
+      "  pixels of context around it.\n"
+      "  --cells upscales each cell of a sprite sheet as a separate image.\n"
+      "  --frames upscales the frames of an animation (GIF files, or one\n"
+      "  image per frame in order) to outdir; identical frames are upscaled\n"
+      "  once, and frames are only partly redone where they repeat the\n"
+      "  previous one.\n"
+      "  --stats prints the time, throughput and memory traffic of each stage,\n"
+      "  --stats-json writes them as JSON to a file ('-' for stdout).\n"
+      "  --trace writes a Chrome trace-event timeline of the threads, in\n"
+      "  builds made with 'make TRACE=1'.\n"
+      "  --counters prints the work done in the distance maps and their hash\n"
+      "  tables, in builds made with 'make COUNTERS=1'.\n"
+      "  --isa forces the instruction set of the kernels, the best one of\n"
+      "  the CPU by default (also set by the RECEL_ISA environment variable).\n"
+      "  --huge-pages maps the buffers of each upscale in 2 MiB pages,\n"
+      "  transparent ones or those reserved with vm.nr_hugepages.\n"
+      "  --estimate prints the predicted peak memory and time of each input\n"
+      "  without processing it.\n"
+      "  --realtime upscales a stream of raw RGBA frames (no header) of the\n"
+      "  given size, and reports frame times against a budget (default\n"
+      "  16.667 ms).\n",
+      argv0, argv0, argv0, argv0, argv0, argv0, argv0);
 }
 
-static void swap(uint32_t **x, uint32_t **y)
+// WxH, or a single size for a square; returns -1 if invalid
+static int parse_size(const char *arg, uint32_t *w, uint32_t *h)
 {
-  uint32_t *t = *x;
-  *x = *y;
-  *y = t;
+  char *end;
+  *w = *h = strtoul(arg, &end, 10);
+  if (*end == 'x')
+    *h = strtoul(end + 1, &end, 10);
+  return *end == 0 && *w > 0 && *h > 0 ? 0 : -1;
 }
 
-static void swapc(const uint32_t **x, const uint32_t **y)
+static uint64_t peak_bytes(const recel_stats_t *stats)
 {
-  const uint32_t *t = *x;
-  *x = *y;
-  *y = t;
+  uint64_t peak = 0;
+  for (int i = 0; i < RECEL_STAGE_COUNT; ++i)
+  {
+    if (stats->stage[i].peak_bytes > peak)
+      peak = stats->stage[i].peak_bytes;
+  }
+  return peak;
 }
 
-int segment_bound(const uint32_t *d1, const uint32_t *d2, int x, int w)
+static void print_stats(FILE *f, const recel_stats_t *stats, uint64_t total)
 {
-  // Length of the segment: x1-x0
-  do x += 1;
-  while (x < w && d1[x] < d2[x - 1] && d1[x - 1] < d2[x]);
-  return x;
+  fprintf(f, "%-16s %11s %6s %10s %9s %7s %10s\n",
+          "stage", "time", "share", "Mitems/s", "GB/s", "allocs", "peak MiB");
+  for (int i = 0; i < RECEL_STAGE_COUNT; ++i)
+  {
+    const recel_stage_stats_t *s = &stats->stage[i];
+    double seconds = s->ns / 1e9;
+    fprintf(f, "%-16s %8.3f ms %5.1f%% %10.1f %9.2f %7llu %10.1f\n",
+            recel_stage_name(i), s->ns / 1e6,
+            total ? 100.0 * s->ns / total : 0.0,
+            seconds > 0 ? s->items / seconds / 1e6 : 0.0,
+            seconds > 0 ? s->bytes / seconds / 1e9 : 0.0,
+            (unsigned long long)s->allocs, s->peak_bytes / 1048576.0);
+  }
+  fprintf(f, "%-16s %8.3f ms, peak heap %.1f MiB\n", "total", total / 1e6,
+          peak_bytes(stats) / 1048576.0);
+  fprintf(f, "%u levels, %u colors, %s kernels, %llu page faults "
+          "(%llu major)\n", stats->levels, stats->colors,
+          recel_isa_name(recel_isa()),
+          (unsigned long long)(stats->minor_faults + stats->major_faults),
+          (unsigned long long)stats->major_faults);
 }
 
-static void order(const uint32_t **pd1, const uint32_t **pd2,
-                  const uint32_t **pi1, const uint32_t **pi2,
-                  uint32_t **po1, uint32_t **po2,
-                  int x)
+static void print_stats_json(FILE *f, const char *input, uint32_t w, uint32_t h,
+                             const recel_stats_t *stats, uint64_t total)
 {
-  if ((*pd1)[x] > (*pd2)[x])
+  fprintf(f, "{\"input\": \"");
+  for (const char *c = input; *c; ++c)
   {
-    swapc(pd1, pd2);
-    swapc(pi1, pi2);
-    swap(po1, po2);
+    if (*c == '"' || *c == '\\')
+      fputc('\\', f);
+    if ((unsigned char)*c >= 0x20)
+      fputc(*c, f);
   }
+  fprintf(f, "\", \"width\": %u, \"height\": %u, \"levels\": %u, "
+          "\"colors\": %u, \"isa\": \"%s\", \"total_ns\": %llu, "
+          "\"peak_bytes\": %llu, \"minor_faults\": %llu, "
+          "\"major_faults\": %llu, \"stages\": {", w, h, stats->levels,
+          stats->colors, recel_isa_name(recel_isa()),
+          (unsigned long long)total, (unsigned long long)peak_bytes(stats),
+          (unsigned long long)stats->minor_faults,
+          (unsigned long long)stats->major_faults);
+  for (int i = 0; i < RECEL_STAGE_COUNT; ++i)
+  {
+    const recel_stage_stats_t *s = &stats->stage[i];
+    double seconds = s->ns / 1e9;
+    fprintf(f, "%s\"%s\": {\"ns\": %llu, \"items\": %llu, \"bytes\": %llu, "
+            "\"items_per_second\": %.0f, \"bytes_per_second\": %.0f, "
+            "\"allocs\": %llu, \"peak_bytes\": %llu}",
+            i ? ", " : "", recel_stage_name(i), (unsigned long long)s->ns,
+            (unsigned long long)s->items, (unsigned long long)s->bytes,
+            seconds > 0 ? s->items / seconds : 0.0,
+            seconds > 0 ? s->bytes / seconds : 0.0,
+            (unsigned long long)s->allocs, (unsigned long long)s->peak_bytes);
+  }
+  fprintf(f, "}}\n");
 }
 
-void inflate(const uint32_t *dist,
-             const uint32_t *imag,
-             int w, int h,
-             uint32_t *out)
+static void print_counters(FILE *f, const recel_counters_t *c)
 {
-  if (w == 0)
-    return;
-
-  for (int y = 0; y < h-1; y++)
+  fprintf(f, "%llu distance maps, %llu levels\n",
+          (unsigned long long)c->distances, (unsigned long long)c->levels);
+  fprintf(f, "%6s %12s %12s %10s\n", "level", "frontier", "pixels", "colors");
+  for (int i = 0; i < RECEL_COUNTER_LEVELS; ++i)
   {
-    const uint32_t *pd1 = dist + w * (y + 0), *nd1;
-    const uint32_t *pd2 = dist + w * (y + 1), *nd2;
-    const uint32_t *pi1 = imag + w * (y + 0), *ni1;
-    const uint32_t *pi2 = imag + w * (y + 1), *ni2;
-    uint32_t *po1 = out + w * (2 * y + 0), *no1;
-    uint32_t *po2 = out + w * (2 * y + 1), *no2;
-
-    int px = 0;
-    order(&pd1, &pd2, &pi1, &pi2, &po1, &po2, px);
-    int x0 = segment_bound(pd1, pd2, px, w);
-
-    do
-    {
-      nd1 = pd1, nd2 = pd2;
-      ni1 = pi1, ni2 = pi2;
-      no1 = po1, no2 = po2;
-
-
-    }
-    while (x0 < w);
+    if (c->level_pixels[i] == 0)
+      continue;
+    fprintf(f, "%5d%s %12llu %12llu %10llu\n", i,
+            i == RECEL_COUNTER_LEVELS - 1 ? "+" : " ",
+            (unsigned long long)c->level_frontier[i],
+            (unsigned long long)c->level_pixels[i],
+            (unsigned long long)c->level_colors[i]);
+  }
+  fprintf(f, "largest frontier %llu pixels, most colors in a level %llu\n",
+          (unsigned long long)c->frontier_max,
+          (unsigned long long)c->colors_max);
+  fprintf(f, "hash lookups %llu, %.3f cells skipped on average, %llu at most,"
+          " %llu resizes, %llu counter grows\n",
+          (unsigned long long)c->lookups,
+          c->lookups ? (double)c->probes / c->lookups : 0.0,
+          (unsigned long long)c->probe_max,
+          (unsigned long long)c->table_resizes,
+          (unsigned long long)c->counter_grows);
+  fprintf(f, "skipped:");
+  for (int i = 0; i < RECEL_COUNTER_PROBES; ++i)
+    fprintf(f, " %d%s:%llu", i, i == RECEL_COUNTER_PROBES - 1 ? "+" : "",
+            (unsigned long long)c->probe_histogram[i]);
+  fprintf(f, "\nranking: %llu sorts, %llu colors, %llu at most\n",
+          (unsigned long long)c->sorts, (unsigned long long)c->sorted,
+          (unsigned long long)c->sort_max);
+}
 
-      if (pd1[x0] == pd2[x0])
-      {
-        po1[x0] = pi1[x0];
-        po2[x0] = pi2[x0];
-        x0++;
-        continue;
-      }
+static int single_main(const cli_options_t *opt, threadpool_t *pool,
+                       const char *input)
+{
+  recel_image_t source;
+  const char *output = opt->output;
+  recel_stats_t stats = {0};
+  uint64_t start = trace_now(), mark = memory_mark();
+
+  int result;
+  if (strcmp(input, "-") == 0)
+    result = recel_image_read(&source, STDIN_FILENO, RECEL_FORMAT_AUTO);
+  else
+    result = recel_image_load(&source, input, RECEL_FORMAT_AUTO);
+
+  if (result != 0)
+  {
+    fprintf(stderr, "cannot load '%s'\n", input);
+    return 1;
+  }
 
-      int x1 = x0 + 1;
+  uint32_t w = source.w, h = source.h, source_w = w, source_h = h;
+  fprintf(stderr, "loaded '%s', %u*%u\n", input, w, h);
+
+  // Decoding reads the file and writes the pixels
+  struct stat st;
+  recel_stage_stats_t *decode = &stats.stage[RECEL_STAGE_DECODE];
+  decode->ns = trace_now() - start;
+  memory_stage(decode, &mark);
+  decode->items = (uint64_t)w * h;
+  decode->bytes = decode->items * 4;
+  if (strcmp(input, "-") != 0 && stat(input, &st) == 0)
+    decode->bytes += st.st_size;
+
+  bool want_stats = opt->stats || opt->stats_json;
+  recel_options_t options = {
+    .pool = pool, .dump = output == NULL, .cache = opt->cache,
+    .stats = want_stats ? &stats : NULL, .pages = opt->pages,
+  };
+  uint32_t *imag;
+  if (opt->tile || opt->cell_w)
+  {
+    recel_tile_stats_t stats;
+    if (opt->tile)
+      imag = recel_upscale_tiles(&options, opt->tile, opt->tile_border,
+                                 &w, &h, source.pixels, &stats);
+    else
+      imag = recel_upscale_cells(&options, opt->cell_w, opt->cell_h,
+                                 &w, &h, source.pixels, &stats);
+    if (imag)
+      fprintf(stderr, "%u %s, %u unique (%.1fx), upscaled in %.1f ms, "
+              "~%.1f ms saved\n", stats.tiles, opt->tile ? "tiles" : "cells",
+              stats.unique,
+              (double)stats.tiles / stats.unique, stats.upscale_ns / 1e6,
+              stats.saved_ns / 1e6);
+  }
+  else
+    imag = recel_upscale(&options, &w, &h, source.pixels);
+  recel_image_release(&source);
 
-      // Length of the segment: x1-x0
-      while (x1 < w && pd1[x1] < pd2[x1 - 1] && pd1[x1 - 1] < pd2[x1])
-        x1 += 1;
+  if (!imag)
+  {
+    fprintf(stderr, "cannot upscale '%s'\n", input);
+    return 1;
+  }
 
-      if (pd1[x0] < pd2[x0])
-        x0 = inflate_line(pd1, pd2, pi1, pi2, po1, po2, x0, w);
-      else if (pd1[x0] > pd2[x0])
-        x0 = inflate_line(pd2, pd1, pi2, pi1, po2, po1, x0, w);
-    }
+  char outi[16];
+  if (!output)
+  {
+    snprintf(outi, sizeof(outi), "outi.%s", recel_format_extension(opt->format));
+    output = outi;
   }
-}
 
-void fliph(uint32_t *image, int w, int h)
-{
-  for (int y = 0; y < h - 1; y++)
+  uint64_t encode_start = trace_now();
+  mark = memory_mark();
+  if (strcmp(output, "-") == 0)
+    result = recel_image_write(STDOUT_FILENO, opt->format, w, h, imag);
+  else
+    result = recel_image_save(output, opt->format, w, h, imag);
+
+  if (result != 0)
+    fprintf(stderr, "cannot write '%s'\n", output);
+
+  recel_stage_stats_t *encode = &stats.stage[RECEL_STAGE_ENCODE];
+  memory_stage(encode, &mark);
+  recel_free(imag);
+
+  encode->ns = trace_now() - encode_start;
+  encode->items = (uint64_t)w * h;
+  encode->bytes = encode->items * 4;
+  if (strcmp(output, "-") != 0 && stat(output, &st) == 0)
+    encode->bytes += st.st_size;
+
+  uint64_t total = trace_now() - start;
+  if (result == 0 && opt->stats)
+    print_stats(stderr, &stats, total);
+  if (result == 0 && opt->stats_json)
   {
-    uint32_t *p = image + w * y;
-    for (int x = 0; x < w / 2; x++)
+    bool to_stdout = strcmp(opt->stats_json, "-") == 0;
+    FILE *f = to_stdout ? stdout : fopen(opt->stats_json, "w");
+    if (f)
     {
-      uint32_t v = p[x];
-      p[x] = p[w - 1 - x];
-      p[w - 1 - x] = v;
+      print_stats_json(f, input, source_w, source_h, &stats, total);
+      if (!to_stdout)
+        fclose(f);
     }
+    else
+      perror(opt->stats_json);
   }
+
+  return result == 0 ? 0 : 1;
 }
 
-void interleave(uint32_t *out, const uint32_t *outer, const uint32_t *inner, int w, int h)
+static int estimate_main(threadpool_t *pool, int count, char **inputs)
 {
-  memcpy(out, outer, sizeof(uint32_t)*w);
-  for (int y = 0; y < h - 1; y++)
+  recel_options_t options = { .pool = pool };
+  int status = 0;
+
+  for (int i = 0; i < count; ++i)
   {
-    memcpy(out + w * (3 * y + 1), inner + w * (2 * y + 0), sizeof(uint32_t)*w);
-    memcpy(out + w * (3 * y + 2), inner + w * (2 * y + 1), sizeof(uint32_t)*w);
-    memcpy(out + w * (3 * y + 3), outer + w * (y + 1), sizeof(uint32_t)*w);
+    recel_image_t img;
+    int result = strcmp(inputs[i], "-") == 0
+      ? recel_image_read(&img, STDIN_FILENO, RECEL_FORMAT_AUTO)
+      : recel_image_load(&img, inputs[i], RECEL_FORMAT_AUTO);
+    if (result != 0)
+    {
+      fprintf(stderr, "cannot load '%s'\n", inputs[i]);
+      status = 1;
+      continue;
+    }
+
+    recel_estimate_t est;
+    uint32_t colors = recel_count_colors(img.w, img.h, img.pixels, 65536);
+    recel_estimate(&options, img.w, img.h, colors, &est);
+    printf("%s: %u*%u, %u colors, peak %.1f MiB, output %.1f MiB, ~%.1f ms\n",
+           inputs[i], img.w, img.h, colors, est.peak_bytes / 1048576.0,
+           est.output_bytes / 1048576.0, est.nanoseconds / 1e6);
+    recel_image_release(&img);
   }
-}
 
-uint32_t *transpose(const uint32_t *in, int w, int h)
-{
-  uint32_t *result = NEW_IMAGE(uint32_t, h, w);
-  for (int y = 0; y < h; y++)
-    for (int x = 0; x < w; x++)
-      result[x * h + y] = in[y * w + x];
-  return result;
+  return status;
 }
 
 int main(int argc, char **argv)
 {
-  int w, h, n;
-  uint32_t *imag, *dist, *disti, *imagi, *distii, *imagii;
-
+  cli_options_t opt = {
+    .format = RECEL_FORMAT_AUTO, .tile_border = 4, .frame_budget_us = 16667,
+  };
   bool do_fliph = 0;
   bool do_flipv = 0;
-  char *input = 0;
+  bool batch = 0;
+  bool pipeline = 0;
+  bool estimate = 0;
+  bool frames = 0;
+  const char *serve = 0;
+  const char *client = 0;
+  const char *cache = 0;
+  const char *trace = 0;
+  bool counters = 0;
+  uint32_t frame_w = 0, frame_h = 0;
+  uint64_t cache_size = 1024;
+  char **inputs = malloc(sizeof(char*) * argc);
+  int count = 0;
 
   for (int i = 1; i < argc; i++)
   {
     if (strcmp(argv[i], "-h") == 0)
       do_fliph = 1;
-    if (strcmp(argv[i], "-v") == 0)
+    else if (strcmp(argv[i], "-v") == 0)
       do_flipv = 1;
+    else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      opt.format = recel_format_from_name(argv[++i]);
+      if (opt.format == RECEL_FORMAT_AUTO)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      opt.output = argv[++i];
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+    {
+      opt.output = argv[++i];
+      batch = 1;
+    }
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+    {
+      opt.output = argv[++i];
+      frames = 1;
+    }
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      opt.threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--large-share") == 0 && i + 1 < argc)
+      opt.large_share = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      cache = argv[++i];
+    else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc)
+      cache_size = strtoull(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc)
+      opt.tile = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--tile-border") == 0 && i + 1 < argc)
+      opt.tile_border = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--cells") == 0 && i + 1 < argc)
+    {
+      if (parse_size(argv[++i], &opt.cell_w, &opt.cell_h) != 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--realtime") == 0 && i + 1 < argc)
+    {
+      if (parse_size(argv[++i], &frame_w, &frame_h) != 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+      opt.frame_budget_us = strtod(argv[++i], NULL) * 1000;
+    else if (strcmp(argv[i], "--stats") == 0)
+      opt.stats = 1;
+    else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+      opt.stats_json = argv[++i];
+    else if (strcmp(argv[i], "--counters") == 0)
+      counters = 1;
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      trace = argv[++i];
+    else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+    {
+      recel_isa_t isa;
+      if (recel_isa_from_name(argv[++i], &isa) != 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      if (recel_set_isa(isa) != 0)
+      {
+        fprintf(stderr, "%s is not supported by this CPU\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--huge-pages") == 0 && i + 1 < argc)
+    {
+      const char *pages = argv[++i];
+      if (strcmp(pages, "thp") == 0)
+        opt.pages = RECEL_PAGES_TRANSPARENT;
+      else if (strcmp(pages, "hugetlb") == 0)
+        opt.pages = RECEL_PAGES_HUGETLB;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--estimate") == 0)
+      estimate = 1;
+    else if (strcmp(argv[i], "--pipeline") == 0)
+      pipeline = 1;
+    else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+      opt.queue = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--io-uring") == 0)
+      opt.io_uring = 1;
+    else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      serve = argv[++i];
+    else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+      client = argv[++i];
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      opt.repeat = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--inline") == 0)
+      opt.inline_pixels = 1;
+    else
+      inputs[count++] = argv[i];
   }
 
+  if (serve && count != 0)
+  {
+    fprintf(stderr, "--serve takes no input files\n");
+    return 1;
+  }
+  if (frame_w && count != 0)
+  {
+    fprintf(stderr, "--realtime reads frames from stdin, not from files\n");
+    return 1;
+  }
+  if (!serve && !frame_w && count == 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (count > 1 && !batch && !frames && !estimate)
+  {
+    fprintf(stderr, "several inputs need -b, --frames or --estimate\n");
+    return 1;
+  }
+  if (client && opt.repeat > 0 && opt.output && strcmp(opt.output, "-") == 0)
+  {
+    fprintf(stderr, "--repeat cannot write to stdout\n");
+    return 1;
+  }
 
-  imag = (uint32_t*)stbi_load(argv[1], &w, &h, &n, 4);
-  printf("loaded '%s', %d*%d*%d\n", argv[1], w, h, n);
+  if (opt.format == RECEL_FORMAT_AUTO && !batch && !frames &&
+      opt.output && strcmp(opt.output, "-") != 0)
+    opt.format = recel_format_from_name(opt.output);
+  if (opt.format == RECEL_FORMAT_AUTO)
+    opt.format = RECEL_FORMAT_PNG;
 
-  dist = recel_distance(w, h, imag);
-  recel_save_dist("dist.png", w, h, dist);
+  if (client)
+  {
+    int status = client_main(&opt, client, inputs[0]);
+    free(inputs);
+    return status;
+  }
 
-  for (int i = 0; i < 2; i++)
+  if (cache && !(opt.cache = recel_cache_open(cache, cache_size << 20)))
   {
-    disti = NEW_IMAGE(uint32_t, w, 2*h-1);
-    imagi = NEW_IMAGE(uint32_t, w, 2*h-1);
-    inflate(dist, dist, w, h, disti);
-    inflate(dist, imag, w, h, imagi);
-
-    distii = NEW_IMAGE(uint32_t, w, 3*h-1);
-    imagii = NEW_IMAGE(uint32_t, w, 3*h-1);
-    interleave(distii, dist, disti, w, h);
-    interleave(imagii, imag, imagi, w, h);
-    if (i == 0)
-      stbi_write_png("outh.png", w, 3*h-1, 4, imagii, 0);
-    h = h * 3 - 1;
-
-    free(imag);
-    free(dist);
-    free(disti);
-    free(imagi);
-
-    char fdist[] = "dist-_.png";
-    char fimag[] = "imag-_.png";
-    fdist[5] = fimag[5] = '0' + i;
-
-    stbi_write_png(fimag, w, h, 4, imagii, 0);
-    recel_save_dist(fdist, w, h, distii);
-
-    imag = transpose(imagii, w, h);
-    dist = transpose(distii, w, h);
-    free(imagii);
-    free(distii);
-
-    int t = w;
-    w = h;
-    h = t;
+    perror(cache);
+    free(inputs);
+    return 1;
   }
 
-  stbi_write_png("outi.png", w, h, 4, imag, 0);
-  recel_save_dist("outd.png", w, h, dist);
+  threadpool_t *pool = threadpool_new(opt.threads);
+
+  int status;
+  if (serve)
+    status = server_main(&opt, pool, serve);
+  else if (frame_w)
+    status = realtime_main(&opt, pool, frame_w, frame_h);
+  else if (estimate)
+    status = estimate_main(pool, count, inputs);
+  else if (frames)
+    status = frames_main(&opt, pool, count, inputs);
+  else if (batch && pipeline)
+    status = pipeline_main(&opt, pool, count, inputs);
+  else if (batch)
+    status = batch_main(&opt, pool, count, inputs);
+  else
+    status = single_main(&opt, pool, inputs[0]);
+
+  threadpool_delete(pool);
+  free(inputs);
+
+  if (trace && recel_trace_save(trace) != 0)
+    fprintf(stderr, "cannot write trace '%s' (built without TRACE=1?)\n", trace);
+
+  if (counters)
+  {
+    recel_counters_t c;
+    if (recel_counters_get(&c) == 0)
+      print_counters(stderr, &c);
+    else
+      fprintf(stderr, "counters are not built in (make COUNTERS=1)\n");
+  }
 
-  free(dist);
-  free(imag);
+  if (opt.cache)
+  {
+    uint64_t hits, misses, bytes;
+    recel_cache_stats(opt.cache, &hits, &misses, &bytes);
+    fprintf(stderr, "cache: %llu hits, %llu misses, %.1f MiB\n",
+            (unsigned long long)hits, (unsigned long long)misses, bytes / 1048576.0);
+    recel_cache_close(opt.cache);
+  }
 
-  return 0;
+  return status;
 }
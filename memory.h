@@ -0,0 +1,42 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "recel.h"
+
+/* Per-stage heap accounting for recel_stats_t.
+ * memory_mark starts a stage: the peak restarts from the heap in use.
+ * memory_stage ends it: the allocations since mark and the peak are added
+ * to stage, and the next stage starts.
+ * The heap is process-wide: stages of images processed at the same time
+ * see each other's buffers.
+ */
+uint64_t memory_mark(void);
+void memory_stage(recel_stage_stats_t *stage, uint64_t *mark);
+
+/* One block carved into the buffers of a whole upscale or plan, accounted
+ * as a single allocation.  Large arenas are mapped directly, with huge
+ * pages if asked (see recel_pages_t), small ones come from recel_malloc.
+ */
+typedef struct {
+  void *base;
+  size_t size;
+  bool mapped;
+} memory_arena_t;
+
+/* Returns 0 on success, -1 if out of memory. */
+int memory_arena_new(memory_arena_t *arena, size_t size, recel_pages_t pages);
+void memory_arena_delete(memory_arena_t *arena);
+
+/* Next buffer of n pixels at *offset, aligned on a cache line. */
+uint32_t *memory_arena_take(memory_arena_t *arena, size_t *offset, size_t n);
+
+/* Bytes of an arena holding buffers of the given pixel counts. */
+size_t memory_arena_bytes(const size_t *pixels, int count);
+
+/* Arena of recel_upscale for a w * h input, without dump. */
+size_t upscale_arena_bytes(uint32_t w, uint32_t h);
+
+/* Page faults of the process so far. */
+void memory_faults(uint64_t *minor, uint64_t *major);
+
+#endif /*MEMORY_H*/
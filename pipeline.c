@@ -0,0 +1,312 @@
+#include "cli.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "uring.h"
+
+/* Pipelined batch mode: decode -> process -> encode */
+
+typedef struct {
+  const char *input;
+  char *output;
+  recel_image_t image;
+  uint32_t w, h;
+  uint32_t *result;
+  const char *error;
+} item_t;
+
+// Bounded queue between two stages, a NULL item marks the end
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+  item_t **items;
+  int capacity, head, count;
+} queue_t;
+
+typedef struct {
+  const char *name;
+  uint64_t busy;    // working on an item
+  uint64_t starved; // waiting for an input item
+  uint64_t blocked; // waiting for room in the output queue
+  int items;
+} stage_t;
+
+typedef struct {
+  const cli_options_t *opt;
+  threadpool_t *pool;
+  filelist_t files;
+  queue_t decoded, processed;
+  stage_t decode, process, encode;
+  int failed;
+} pipeline_t;
+
+static void queue_init(queue_t *q, int capacity)
+{
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  q->items = malloc(sizeof(item_t*) * capacity);
+  q->capacity = capacity;
+  q->head = q->count = 0;
+}
+
+static void queue_destroy(queue_t *q)
+{
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q->items);
+}
+
+static void queue_push(queue_t *q, item_t *item, uint64_t *blocked)
+{
+  uint64_t t0 = trace_now();
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  q->items[(q->head + q->count) % q->capacity] = item;
+  q->count += 1;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  *blocked += trace_now() - t0;
+}
+
+static item_t *queue_pop(queue_t *q, uint64_t *starved)
+{
+  uint64_t t0 = trace_now();
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  item_t *item = q->items[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count -= 1;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  *starved += trace_now() - t0;
+  return item;
+}
+
+static uring_t *stage_ring(const pipeline_t *p)
+{
+  if (!p->opt->io_uring)
+    return NULL;
+
+  uring_t *ring = uring_new(8);
+  if (!ring)
+    fprintf(stderr, "io_uring not available, using read/write\n");
+  return ring;
+}
+
+// After a failed transfer: drop the ring if the kernel does not support
+// the operation on it, the file is then transferred with read/write
+static bool ring_unsupported(uring_t **ring)
+{
+  if (errno != EINVAL && errno != EOPNOTSUPP)
+    return false;
+  fprintf(stderr, "io_uring transfers not supported, using read/write\n");
+  uring_delete(*ring);
+  *ring = NULL;
+  return true;
+}
+
+static void *decode_main(void *arg)
+{
+  pipeline_t *p = arg;
+  stage_t *s = &p->decode;
+  uring_t *ring = stage_ring(p);
+
+  for (int i = 0; i < p->files.count; ++i)
+  {
+    uint64_t t0 = trace_now();
+    item_t *item = calloc(1, sizeof(item_t));
+    item->input = p->files.paths[i];
+    item->output = batch_output_path(p->opt->output, item->input, p->opt->format);
+
+    int result = -1;
+    bool fallback = !ring;
+    if (ring)
+    {
+      size_t size;
+      void *data = uring_read_file(ring, item->input, &size);
+      if (data)
+        result = recel_image_decode(&item->image, data, size,
+                                    RECEL_FORMAT_AUTO);
+      else
+        fallback = ring_unsupported(&ring);
+      free(data);
+    }
+    if (fallback)
+      result = recel_image_load(&item->image, item->input, RECEL_FORMAT_AUTO);
+
+    if (result != 0)
+      item->error = "cannot load";
+
+    s->busy += trace_now() - t0;
+    s->items += 1;
+    queue_push(&p->decoded, item, &s->blocked);
+  }
+
+  queue_push(&p->decoded, NULL, &s->blocked);
+  if (ring)
+    uring_delete(ring);
+  return NULL;
+}
+
+static void process_main(pipeline_t *p)
+{
+  stage_t *s = &p->process;
+  recel_options_t options = {
+    .pool = p->pool, .cache = p->opt->cache, .pages = p->opt->pages,
+  };
+  item_t *item;
+
+  while ((item = queue_pop(&p->decoded, &s->starved)))
+  {
+    uint64_t t0 = trace_now();
+    if (!item->error)
+    {
+      item->w = item->image.w;
+      item->h = item->image.h;
+      item->result = recel_upscale(&options, &item->w, &item->h,
+                                   item->image.pixels);
+      if (!item->result)
+        item->error = "cannot upscale (out of memory or image too large)";
+    }
+    recel_image_release(&item->image);
+
+    s->busy += trace_now() - t0;
+    s->items += 1;
+    queue_push(&p->processed, item, &s->blocked);
+  }
+
+  queue_push(&p->processed, NULL, &s->blocked);
+}
+
+static void *encode_main(void *arg)
+{
+  pipeline_t *p = arg;
+  stage_t *s = &p->encode;
+  uring_t *ring = stage_ring(p);
+  item_t *item;
+
+  while ((item = queue_pop(&p->processed, &s->starved)))
+  {
+    uint64_t t0 = trace_now();
+    if (!item->error)
+    {
+      int result = -1;
+      bool fallback = !ring;
+      if (ring)
+      {
+        size_t size;
+        void *data = recel_image_encode(p->opt->format, item->w, item->h,
+                                        item->result, &size);
+        if (data)
+          result = uring_write_file(ring, item->output, data, size);
+        if (data && result != 0)
+          fallback = ring_unsupported(&ring);
+        recel_free(data);
+      }
+      if (fallback)
+        result = recel_image_save(item->output, p->opt->format,
+                                  item->w, item->h, item->result);
+      if (result != 0)
+        item->error = "cannot write";
+    }
+
+    if (item->error)
+    {
+      fprintf(stderr, "%s: %s\n", item->input, item->error);
+      p->failed += 1;
+    }
+
+    recel_free(item->result);
+    free(item->output);
+    free(item);
+
+    s->busy += trace_now() - t0;
+    s->items += 1;
+  }
+
+  if (ring)
+    uring_delete(ring);
+  return NULL;
+}
+
+static void stage_report(const stage_t *s, uint64_t wall)
+{
+  double scale = wall ? 100.0 / wall : 0;
+  fprintf(stderr, "  %-8s busy %5.1f%%  starved %5.1f%%  blocked %5.1f%%  "
+          "%.2f ms/image\n",
+          s->name, s->busy * scale, s->starved * scale, s->blocked * scale,
+          s->items ? s->busy / 1e6 / s->items : 0.0);
+}
+
+int pipeline_main(const cli_options_t *opt, threadpool_t *pool,
+                  int count, char **inputs)
+{
+  pipeline_t p = {
+    .opt = opt,
+    .pool = pool,
+    .decode = { .name = "decode" },
+    .process = { .name = "process" },
+    .encode = { .name = "encode" },
+  };
+  int status = filelist_collect(&p.files, count, inputs) != 0;
+
+  if (mkdir(opt->output, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "%s: %s\n", opt->output, strerror(errno));
+    filelist_free(&p.files);
+    return 1;
+  }
+
+  // Inputs of the same name would overwrite each other's result
+  char **outputs = malloc(sizeof(char*) * (p.files.count ? p.files.count : 1));
+  for (int i = 0; i < p.files.count; ++i)
+    outputs[i] = batch_output_path(opt->output, p.files.paths[i], opt->format);
+  int distinct = batch_check_outputs(p.files.count, outputs, p.files.paths);
+  for (int i = 0; i < p.files.count; ++i)
+    free(outputs[i]);
+  free(outputs);
+  if (distinct != 0)
+  {
+    filelist_free(&p.files);
+    return 1;
+  }
+
+  int capacity = opt->queue > 0 ? opt->queue : 2;
+  queue_init(&p.decoded, capacity);
+  queue_init(&p.processed, capacity);
+
+  uint64_t t0 = trace_now();
+  pthread_t decoder, encoder;
+  pthread_create(&decoder, NULL, decode_main, &p);
+  pthread_create(&encoder, NULL, encode_main, &p);
+  process_main(&p);
+  pthread_join(decoder, NULL);
+  pthread_join(encoder, NULL);
+  uint64_t wall = trace_now() - t0;
+
+  fprintf(stderr, "%d files processed, %d failed, %.3f s\n",
+          p.files.count, p.failed, wall / 1e9);
+  stage_report(&p.decode, wall);
+  stage_report(&p.process, wall);
+  stage_report(&p.encode, wall);
+
+  const stage_t *bottleneck = &p.decode;
+  if (p.process.busy > bottleneck->busy)
+    bottleneck = &p.process;
+  if (p.encode.busy > bottleneck->busy)
+    bottleneck = &p.encode;
+  fprintf(stderr, "  bottleneck: %s\n", bottleneck->name);
+
+  queue_destroy(&p.decoded);
+  queue_destroy(&p.processed);
+  filelist_free(&p.files);
+  return status || p.failed ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+#include "cli.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+/* Real-time mode: a stream of raw frames of one size */
+
+// Returns 1 for a full frame, 0 at the end of the stream, -1 on error
+static int read_frame(int fd, void *data, size_t size)
+{
+  char *p = data;
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t n = read(fd, p + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      return done == 0 ? 0 : -1;
+    done += n;
+  }
+  return 1;
+}
+
+static int write_frame(int fd, const void *data, size_t size)
+{
+  const char *p = data;
+  while (size > 0)
+  {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int realtime_main(const cli_options_t *opt, threadpool_t *pool,
+                  uint32_t w, uint32_t h)
+{
+  recel_options_t options = { .pool = pool, .pages = opt->pages };
+  recel_plan_t *plan = recel_plan_new(&options, w, h);
+  if (!plan)
+  {
+    fprintf(stderr, "cannot plan %u*%u frames\n", w, h);
+    return 1;
+  }
+
+  size_t in_bytes = (size_t)w * h * 4;
+  size_t out_bytes = (size_t)(3 * w - 2) * (3 * h - 2) * 4;
+  uint32_t *frame = malloc(in_bytes), *output = malloc(out_bytes);
+  uint64_t *samples = NULL;
+  size_t count = 0, capacity = 0;
+  int status = 0, result;
+  if (!frame || !output)
+  {
+    fprintf(stderr, "cannot allocate %u*%u frames\n", w, h);
+    free(frame);
+    free(output);
+    recel_plan_delete(plan);
+    return 1;
+  }
+
+  while ((result = read_frame(STDIN_FILENO, frame, in_bytes)) > 0)
+  {
+    uint64_t start = trace_now();
+    // Consecutive frames mostly repeat, only their differences are redone
+    recel_plan_update(plan, frame, output, NULL);
+    uint64_t elapsed = trace_now() - start;
+
+    if (count == capacity)
+    {
+      size_t grown = capacity ? capacity * 2 : 1024;
+      uint64_t *more = realloc(samples, sizeof(uint64_t) * grown);
+      if (!more)
+      {
+        fprintf(stderr, "cannot record frame times after %zu frames\n",
+                count);
+        status = 1;
+        break;
+      }
+      samples = more;
+      capacity = grown;
+    }
+    samples[count++] = elapsed;
+
+    if (write_frame(STDOUT_FILENO, output, out_bytes) != 0)
+    {
+      perror("write");
+      status = 1;
+      break;
+    }
+  }
+
+  if (result < 0)
+  {
+    fprintf(stderr, "truncated frame after %zu frames\n", count);
+    status = 1;
+  }
+
+  if (count > 0)
+  {
+    uint64_t budget = (uint64_t)opt->frame_budget_us * 1000, missed = 0;
+    for (size_t i = 0; i < count; ++i)
+      missed += samples[i] > budget;
+
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    fprintf(stderr, "%zu frames of %u*%u, p50 %.3f ms, p99 %.3f ms, "
+            "max %.3f ms, %llu over %.3f ms\n", count, w, h,
+            samples[count / 2] / 1e6, samples[count * 99 / 100] / 1e6,
+            samples[count - 1] / 1e6, (unsigned long long)missed,
+            budget / 1e6);
+  }
+
+  free(samples);
+  free(frame);
+  free(output);
+  recel_plan_delete(plan);
+  return status;
+}
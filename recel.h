@@ -1,21 +1,83 @@
 #ifndef _RECEL_H__
 #define _RECEL_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #define PIX(img,x,y) (img[(y) * w + (x)])
 
-#define NEW_IMAGE(t,w,h) ((t*)malloc((w) * (h) * sizeof(t)))
+#define NEW_IMAGE(t,w,h) ((t*)recel_malloc((w) * (h) * sizeof(t)))
+
+/* A w * h image whose rows are stride pixels apart (stride >= w): a tile,
+ * a region or a padded framebuffer, used in place.  Functions taking views
+ * only read their input views.
+ */
+typedef struct {
+  uint32_t *pixels;
+  uint32_t w, h, stride;
+} recel_view_t;
+
+#define VIEW_PIX(v,x,y) ((v).pixels[(size_t)(y) * (v).stride + (x)])
+
+/* View of a packed w * h image */
+recel_view_t recel_view(const uint32_t *pixels, uint32_t w, uint32_t h);
+
+/* w * h region of v at (x, y), clipped to v */
+recel_view_t recel_view_region(recel_view_t v, uint32_t x, uint32_t y,
+                               uint32_t w, uint32_t h);
 
 /* 1. Distance map */
 
 /* Returns a (w * h) array of uint32_t representing the distance map computed
- * from input.
- * Array has to be freed with free(3).
+ * from input, or NULL if allocation failed or the image is too large (w and h
+ * must be below 32768).
+ * Array has to be freed with recel_free.
  */
 uint32_t *recel_distance(uint32_t w, uint32_t h, uint32_t *input);
 
+/* Same, into a caller buffer of w * h, with a color counter from
+ * colorcounter_new (fasttable.h) kept between calls.  Allocates only when
+ * the counter has to grow, see colorcounter_reserve.
+ * The time of each step and the number of levels are added to stats if it
+ * is not NULL.
+ * Returns 0 on success, -1 if the image is too large.
+ */
+struct colorcounter;
+struct recel_stats;
+int recel_distance_into(uint32_t w, uint32_t h, const uint32_t *input,
+                        uint32_t *distance, struct colorcounter *counter,
+                        struct recel_stats *stats);
+
+/* Same on views: the distance map of input goes to the first input.w *
+ * input.h pixels of distance.  Returns -1 as well if distance is smaller.
+ */
+int recel_distance_view(recel_view_t input, recel_view_t distance,
+                        struct colorcounter *counter,
+                        struct recel_stats *stats);
+
+/* Same result as recel_distance_into, for images larger than memory: the
+ * input and the distance map are copied into tiles of an unlinked temp file
+ * in dir ($TMPDIR or /tmp if NULL), which holds the worklists as well, and
+ * are worked on tile by tile.  input and output are only read and written
+ * in order, so they can be mapped files.  The file takes about 72 bytes
+ * per pixel.  Each level is searched in rounds, a tile being searched until
+ * the frontier leaves it: a tile is paged in at most c + 5 times per level,
+ * c being the most tile borders a shortest path from its first generation
+ * has to cross, however many generations it has.
+ * Returns 0 on success, -1 if the image is too large, the temp file
+ * cannot be created or memory runs out.
+ */
+int recel_distance_out_of_core(uint32_t w, uint32_t h, const uint32_t *input,
+                               uint32_t *output, const char *dir,
+                               struct recel_stats *stats);
+
+/* Store a w * h distance map on 16 bits, in place: the first w * h
+ * uint16_t of distance.  Returns 0 on success, -1 with the map untouched if
+ * a distance does not fit.
+ */
+int recel_distance_narrow(uint32_t w, uint32_t h, uint32_t *distance);
+
 /*uint8_t *recel_dist_to_u8(uint32_t w, uint32_t h, uint32_t *distance);*/
 void recel_save_dist(const char *name, uint32_t w, uint32_t h, uint32_t *dist);
 
@@ -32,4 +94,446 @@ void recel_scan(
     uint32_t *disto, uint32_t *lineo
     );
 
+/* recel_scan on views of the same size, writing h-1 rows of disto and lineo */
+void recel_scan_view(recel_view_t dist, recel_view_t line,
+                     recel_view_t disto, recel_view_t lineo);
+
+/* 2. Upscaling */
+
+struct threadpool;
+typedef struct recel_cache recel_cache_t;
+
+typedef enum {
+  RECEL_STAGE_DECODE,         /* not timed by the library */
+  RECEL_STAGE_DIST_INIT,      /* recel_distance steps */
+  RECEL_STAGE_DIST_PROPAGATE,
+  RECEL_STAGE_DIST_RANK,
+  RECEL_STAGE_DIST_NEXTLEVEL,
+  RECEL_STAGE_INFLATE,        /* both passes */
+  RECEL_STAGE_INTERLEAVE,
+  RECEL_STAGE_TRANSPOSE,
+  RECEL_STAGE_ENCODE,         /* not timed by the library */
+  RECEL_STAGE_COUNT
+} recel_stage_t;
+
+typedef struct {
+  uint64_t ns;     /* wall time */
+  uint64_t items;  /* pixels processed, or colors ranked */
+  uint64_t bytes;  /* memory read and written, estimated from the work done */
+  uint64_t allocs; /* heap allocations */
+  uint64_t peak_bytes; /* heap in use at the highest point, see section 10 */
+} recel_stage_stats_t;
+
+typedef struct recel_stats {
+  recel_stage_stats_t stage[RECEL_STAGE_COUNT];
+  uint32_t levels; /* levels of the distance map */
+  uint32_t colors; /* distinct colors of the input */
+  uint64_t minor_faults, major_faults; /* page faults of the whole process
+                                        * during recel_upscale */
+} recel_stats_t;
+
+/* Lower-case name of a stage ("decode", "dist_init"...) */
+const char *recel_stage_name(recel_stage_t stage);
+
+/* Pages of the buffers of recel_upscale and plans, which are carved from a
+ * single block.  With huge pages, blocks of 2 MiB and more are mapped
+ * directly, in 2 MiB pages when the kernel has them.
+ */
+typedef enum {
+  RECEL_PAGES_DEFAULT,     /* recel_malloc */
+  RECEL_PAGES_TRANSPARENT, /* madvise(MADV_HUGEPAGE) */
+  RECEL_PAGES_HUGETLB,     /* MAP_HUGETLB, transparent if none are reserved */
+} recel_pages_t;
+
+typedef struct {
+  struct threadpool *pool; /* run stages in parallel, can be NULL */
+  bool dump; /* save intermediate images in the current directory */
+  recel_cache_t *cache; /* reuse results of identical inputs, can be NULL */
+  recel_stats_t *stats; /* recel_upscale adds its work here, can be NULL */
+  recel_pages_t pages;
+} recel_options_t;
+
+/* Upscale a w * h image, updating w and h to the output size:
+ * (3w-2) * (3h-2).
+ * Returns the output, to be freed with recel_free, or NULL on failure.
+ * opt can be NULL for the default options.
+ */
+uint32_t *recel_upscale(const recel_options_t *opt,
+                        uint32_t *w, uint32_t *h, const uint32_t *input);
+
+/* Same into the top-left (3w-2) * (3h-2) pixels of output, such as a
+ * region of an upload buffer: the last pass writes there directly.  Results of the
+ * cache are copied in, and only packed outputs are stored in it.
+ * Returns 0 on success, -1 on failure or if output is too small.
+ */
+int recel_upscale_into(const recel_options_t *opt, uint32_t w, uint32_t h,
+                       const uint32_t *input, recel_view_t output);
+
+/* Plans upscale frames of a fixed size, for real-time use.
+ * All the buffers are allocated by recel_plan_new, recel_plan_run does not
+ * allocate.  Only opt->pool and opt->pages are used.
+ * Returns NULL on failure, or if w or h is below 2.
+ */
+typedef struct recel_plan recel_plan_t;
+
+recel_plan_t *recel_plan_new(const recel_options_t *opt, uint32_t w, uint32_t h);
+void recel_plan_delete(recel_plan_t *plan);
+
+/* Upscale a w * h frame into output, (3w-2) * (3h-2) pixels, or into the
+ * top-left of a larger view.
+ * Frames of one plan must be upscaled one at a time.
+ */
+void recel_plan_run(recel_plan_t *plan, const uint32_t *input, uint32_t *output);
+void recel_plan_run_view(recel_plan_t *plan, const uint32_t *input,
+                         recel_view_t output);
+
+/* Upscale a frame that differs from the last one of the plan only inside
+ * changed (NULL to compare whole frames): only the pixels of changed are
+ * compared with the last frame.  The distance map depends on the whole
+ * frame and is still recomputed.  output must hold the result of the last
+ * frame; only its parts that depend on changed pixels are rewritten.
+ * The result is identical to recel_plan_run.
+ * The first frame of a plan is fully upscaled.
+ * Returns true if only parts of the output were redone, false if most of
+ * the frame changed and it was fully upscaled.
+ */
+typedef struct {
+  uint32_t x, y, w, h;
+} recel_rect_t;
+
+bool recel_plan_update(recel_plan_t *plan, const uint32_t *input,
+                       uint32_t *output, const recel_rect_t *changed);
+bool recel_plan_update_view(recel_plan_t *plan, const uint32_t *input,
+                            recel_view_t output, const recel_rect_t *changed);
+
+/* Stages of recel_upscale, on rows [y0, y1) or columns [x0, x1) */
+
+/* Interpolate each pair of rows of imag into two new rows of out,
+ * (w * 2h-2), following dist.
+ */
+void inflate(const uint32_t *dist, const uint32_t *imag, int w, int h,
+             uint32_t *out);
+void inflate_rows(const uint32_t *dist, const uint32_t *imag, int w, int h,
+                  uint32_t *out, int y0, int y1);
+
+/* Interleave rows of outer (w * h) and inner (w * 2h-2) into out
+ * (w * 3h-2).
+ */
+void interleave(uint32_t *out, const uint32_t *outer, const uint32_t *inner,
+                int w, int h);
+void interleave_rows(uint32_t *out, const uint32_t *outer,
+                     const uint32_t *inner, int w, int h, int y0, int y1);
+
+/* Same on views: dist, imag and outer are w * h, out of inflate_view and
+ * inner w * (2h-2), out of interleave_view w * (3h-2), with w and h those
+ * of dist or outer.
+ */
+void inflate_view(recel_view_t dist, recel_view_t imag, recel_view_t out,
+                  int y0, int y1);
+void interleave_view(recel_view_t out, recel_view_t outer,
+                     recel_view_t inner, int y0, int y1);
+
+uint32_t *transpose(const uint32_t *in, int w, int h);
+void transpose_rows(uint32_t *out, const uint32_t *in, int w, int h,
+                    int x0, int x1);
+/* Columns [x0, x1) of in, of w and h those of in, into rows of out */
+void transpose_view(recel_view_t out, recel_view_t in, int x0, int x1);
+
+/* Same stages with distances narrowed by recel_distance_narrow.
+ * inflate_dist16 inflates the distances themselves.
+ */
+void inflate_rows16(const uint16_t *dist, const uint32_t *imag, int w, int h,
+                    uint32_t *out, int y0, int y1);
+void inflate_dist16(const uint16_t *dist, int w, int h, uint16_t *out,
+                    int y0, int y1);
+void interleave_rows16(uint16_t *out, const uint16_t *outer,
+                       const uint16_t *inner, int w, int h, int y0, int y1);
+void transpose_rows16(uint16_t *out, const uint16_t *in, int w, int h,
+                      int x0, int x1);
+
+/* 3. Image I/O */
+
+typedef enum {
+  RECEL_FORMAT_AUTO, // Detect from content when loading, from name when saving
+  RECEL_FORMAT_PNG,  // Any format stb_image can load, PNG when saving
+  RECEL_FORMAT_RAW,  // 16 bytes header ("RECL", w, h, 4) + RGBA pixels
+  RECEL_FORMAT_PAM,  // netpbm P7
+  RECEL_FORMAT_QOI,  // Quite OK Image format
+} recel_format_t;
+
+typedef struct {
+  uint32_t w, h;
+  uint32_t *pixels; /* w * h RGBA pixels */
+
+  /* private */
+  int kind;
+  void *base;
+  size_t size;
+} recel_image_t;
+
+/* File name extension for a format, without the dot */
+const char *recel_format_extension(recel_format_t format);
+
+/* Guess format from a file name extension, or from a bare format name
+ * ("raw", "pam", "qoi", "png").
+ */
+recel_format_t recel_format_from_name(const char *name);
+
+/* Load an image file.
+ * Raw and 4-channel PAM files are memory-mapped and used in place: pixels
+ * are then read-only.
+ * Returns 0 on success, -1 on failure.
+ * Image has to be released with recel_image_release.
+ */
+int recel_image_load(recel_image_t *img, const char *path, recel_format_t format);
+
+/* Same as recel_image_load, from an open file descriptor.
+ * Regular files are mapped, pipes and sockets are read until end of file.
+ */
+int recel_image_read(recel_image_t *img, int fd, recel_format_t format);
+
+/* Same as recel_image_load, from a memory buffer. Pixels are always copied. */
+int recel_image_decode(recel_image_t *img, const void *data, size_t size,
+                       recel_format_t format);
+
+void recel_image_release(recel_image_t *img);
+
+/* Load every frame of an animated GIF, one after the other: img->pixels
+ * holds *count frames of img->w * img->h pixels.  Other files are loaded
+ * as a single frame.
+ */
+int recel_image_load_frames(recel_image_t *img, const char *path,
+                            uint32_t *count);
+
+/* Read only the size of an image file. Returns 0 on success, -1 on failure. */
+int recel_image_info(const char *path, uint32_t *w, uint32_t *h);
+
+/* Write w * h RGBA pixels to a file descriptor or a path.
+ * Raw and PAM are written with a single writev(2).
+ * Returns 0 on success, -1 on failure.
+ */
+int recel_image_write(int fd, recel_format_t format,
+                      uint32_t w, uint32_t h, const uint32_t *pixels);
+int recel_image_save(const char *path, recel_format_t format,
+                     uint32_t w, uint32_t h, const uint32_t *pixels);
+
+/* Encode to a memory buffer, to be freed with recel_free.
+ * Returns NULL on failure.
+ */
+void *recel_image_encode(recel_format_t format, uint32_t w, uint32_t h,
+                         const uint32_t *pixels, size_t *size);
+
+/* 4. Cost estimation */
+
+/* Number of distinct colors among at most max_samples pixels spread over the
+ * image (all pixels if max_samples is 0).
+ */
+uint32_t recel_count_colors(uint32_t w, uint32_t h, const uint32_t *pixels,
+                            uint32_t max_samples);
+
+typedef struct {
+  uint64_t peak_bytes;   /* heap in use at the worst point, output included */
+  uint64_t output_bytes;
+  uint64_t nanoseconds;  /* approximate wall time */
+} recel_estimate_t;
+
+/* Predict the resources recel_upscale needs for a w * h image with the given
+ * number of colors (0 if unknown).  The input buffer and the dump files are
+ * not counted.  With opt->pool, the parallel stages are divided among the
+ * workers; the distance maps are computed on one thread.
+ * Time is calibrated for a ~3GHz core and only meant to compare jobs.
+ */
+void recel_estimate(const recel_options_t *opt, uint32_t w, uint32_t h,
+                    uint32_t colors, recel_estimate_t *est);
+
+/* Single-threaded time estimate, in nanoseconds, to rank jobs by cost. */
+uint64_t recel_cost(uint32_t w, uint32_t h, uint32_t colors);
+
+/* 5. Result cache */
+
+/* 128-bit hash of w, h and the pixels, and of the version of the upscaler.
+ * Fast, not cryptographic.
+ */
+typedef struct {
+  uint64_t h[2];
+} recel_hash_t;
+
+recel_hash_t recel_hash_pixels(uint32_t w, uint32_t h, const uint32_t *pixels);
+
+/* On-disk cache of results, one raw image file per input hash in dir.
+ * When the files exceed max_bytes, the least recently used ones are removed.
+ * The directory can be shared by several processes.
+ * Returns NULL if dir cannot be created.
+ */
+recel_cache_t *recel_cache_open(const char *dir, uint64_t max_bytes);
+void recel_cache_close(recel_cache_t *cache);
+
+/* Result stored for key, to be freed with recel_free, or NULL on a miss. */
+uint32_t *recel_cache_get(recel_cache_t *cache, const recel_hash_t *key,
+                          uint32_t *w, uint32_t *h);
+
+/* Returns 0 on success, -1 on failure. */
+int recel_cache_put(recel_cache_t *cache, const recel_hash_t *key,
+                    uint32_t w, uint32_t h, const uint32_t *pixels);
+
+/* Lookups of this process, and bytes in the cache directory. */
+void recel_cache_stats(recel_cache_t *cache, uint64_t *hits, uint64_t *misses,
+                       uint64_t *bytes);
+
+/* 6. Tiles and sprite sheets */
+
+typedef struct {
+  uint32_t tiles, unique;
+  uint64_t upscale_ns; /* spent upscaling unique tiles, summed over threads */
+  uint64_t saved_ns;   /* estimated time the duplicates would have taken */
+} recel_tile_stats_t;
+
+/* Upscale a w * h image split in size * size tiles.  Each tile is upscaled
+ * together with border pixels of context (at least 1) and identical
+ * (tile, context) pairs are upscaled once.  The result approaches that of
+ * recel_upscale as the border grows.
+ * Returns NULL on failure, or if w or h is below 2.  stats can be NULL.
+ */
+uint32_t *recel_upscale_tiles(const recel_options_t *opt,
+                              uint32_t size, uint32_t border,
+                              uint32_t *w, uint32_t *h,
+                              const uint32_t *input, recel_tile_stats_t *stats);
+
+/* Upscale a sprite sheet of cw * ch cells, each cell as its own image.
+ * Every cell becomes a 3cw * 3ch cell of the output, (3w * 3h): its
+ * (3cw-2) * (3ch-2) result followed by two copies of its last column and
+ * row.  Identical cells are upscaled once, and go through opt->cache.
+ * Returns NULL on failure.  stats can be NULL.
+ */
+uint32_t *recel_upscale_cells(const recel_options_t *opt,
+                              uint32_t cw, uint32_t ch,
+                              uint32_t *w, uint32_t *h,
+                              const uint32_t *input, recel_tile_stats_t *stats);
+
+/* 7. Animations */
+
+typedef struct {
+  uint32_t frames, unique;
+  uint32_t partial;    /* unique frames only partly redone, see below */
+  uint64_t upscale_ns; /* spent upscaling unique frames, summed over threads */
+} recel_frame_stats_t;
+
+/* Upscale count frames of w * h pixels.
+ * Identical frames are upscaled once: same[i] is the first frame with the
+ * content of frame i, and outputs[i] is NULL unless same[i] == i.  Others
+ * get a (3w-2) * (3h-2) result, to be freed with recel_free.
+ * Distinct frames are split in runs that are upscaled in parallel; within a
+ * run, a frame only redoes the parts that differ from the previous one (see
+ * recel_plan_update).  Frames found in opt->cache are not upscaled.
+ * Returns 0 on success, -1 on failure or if w or h is below 2, with every
+ * output NULL.  stats can be NULL.
+ */
+int recel_upscale_frames(const recel_options_t *opt, uint32_t w, uint32_t h,
+                         uint32_t count, const uint32_t *const *frames,
+                         uint32_t **outputs, uint32_t *same,
+                         recel_frame_stats_t *stats);
+
+/* 8. Tracing */
+
+/* Write the timeline of the last stages, passes, tiles, frames and levels
+ * of the distance map run on each thread as Chrome trace-event JSON, to
+ * load in chrome://tracing or Perfetto.  Events are only recorded when the
+ * library is built with RECEL_TRACE defined (make TRACE=1).  No traced work
+ * must be running.
+ * Returns 0 on success, -1 on failure or if tracing is not built in.
+ */
+int recel_trace_save(const char *path);
+
+/* 9. Counters */
+
+#define RECEL_COUNTER_LEVELS 32
+#define RECEL_COUNTER_PROBES 16
+
+/* Work done inside the distance map and its hash tables, to explain why
+ * images of the same size take different times.  Counted only when the
+ * library is built with RECEL_COUNTERS defined (make COUNTERS=1).
+ * Per-level arrays are indexed by level, the last entry adds up all the
+ * levels after it.
+ */
+typedef struct {
+  uint64_t distances;  /* distance maps computed */
+  uint64_t levels;
+  uint64_t level_frontier[RECEL_COUNTER_LEVELS]; /* pixels starting a level */
+  uint64_t level_pixels[RECEL_COUNTER_LEVELS];   /* pixels of a level */
+  uint64_t level_colors[RECEL_COUNTER_LEVELS];   /* distinct colors ranked */
+  uint64_t frontier_max, colors_max;
+
+  uint64_t lookups, probes; /* hash table lookups, and cells skipped */
+  uint64_t probe_max;
+  uint64_t probe_histogram[RECEL_COUNTER_PROBES]; /* lookups by cells skipped */
+  uint64_t table_resizes;   /* hash table doubled */
+  uint64_t counter_grows;   /* color counter arrays reallocated */
+
+  uint64_t sorts, sorted, sort_max; /* colorcounter_rank calls and sizes */
+} recel_counters_t;
+
+/* Sum of the counters of every thread since the start or the last reset.
+ * No counted work must be running.
+ * Returns 0, or -1 with zeroed counters if they are not built in.
+ */
+int recel_counters_get(recel_counters_t *counters);
+void recel_counters_reset(void);
+
+/* 10. Memory */
+
+/* Every buffer of the library, stb_image included, comes from these.
+ * Results of the library must be released with recel_free: free(3) would
+ * leave their bytes counted as live.
+ */
+void *recel_malloc(size_t size);
+void *recel_calloc(size_t count, size_t size);
+void *recel_realloc(void *p, size_t size);
+void recel_free(void *p);
+
+typedef struct {
+  uint64_t live_bytes, peak_bytes; /* in use now, and at most */
+  uint64_t allocs, alloc_bytes;    /* allocations so far, and their size */
+} recel_memory_t;
+
+/* Heap of the whole process that went through recel_malloc. */
+void recel_memory_get(recel_memory_t *memory);
+
+/* Restart the peak from the heap in use now.  recel_upscale does it at
+ * each stage when opt->stats is set.
+ */
+void recel_memory_reset_peak(void);
+
+/* 11. Instruction sets */
+
+/* Hot kernels (flat runs of inflate, transpose) are compiled for each
+ * level and picked at startup from CPUID.  All levels give identical
+ * results.
+ */
+typedef enum {
+  RECEL_ISA_SCALAR,
+  RECEL_ISA_SSE2,
+  RECEL_ISA_AVX2,
+  RECEL_ISA_AVX512, /* AVX-512F and BW */
+  RECEL_ISA_COUNT
+} recel_isa_t;
+
+/* Best level of this CPU. */
+recel_isa_t recel_isa_detect(void);
+
+/* Level in use: the best one, or the RECEL_ISA environment variable
+ * ("scalar", "sse2", "avx2" or "avx512") if lower, or the last
+ * recel_set_isa.
+ */
+recel_isa_t recel_isa(void);
+
+/* Force a level, for testing and benchmarking.  Returns 0 on success, -1
+ * if the CPU does not support it.  Not to be called during an upscale.
+ */
+int recel_set_isa(recel_isa_t isa);
+
+const char *recel_isa_name(recel_isa_t isa);
+
+/* Returns 0 and sets isa on success, -1 for an unknown name. */
+int recel_isa_from_name(const char *name, recel_isa_t *isa);
+
 #endif /*!_RECEL_H__*/
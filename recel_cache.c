@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include "recel.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Result cache */
+
+// Bump when the output of recel_upscale changes for the same input
+#define CACHE_VERSION 1
+
+#define HEADER_SIZE 16
+
+struct recel_cache {
+  char *dir;
+  uint64_t max_bytes;
+
+  pthread_mutex_t lock;
+  uint64_t bytes; // approximate when the directory is shared
+  uint64_t hits, misses;
+};
+
+static uint64_t rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+recel_hash_t recel_hash_pixels(uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  uint64_t n = (uint64_t)w * h;
+  uint64_t a = 0x9e3779b97f4a7c15ull ^ CACHE_VERSION;
+  uint64_t b = 0x6a09e667f3bcc909ull ^ ((uint64_t)w << 32 | h);
+  uint64_t i = 0;
+
+  // Two pixels per lane and per step, the lanes are independent
+  for (; i + 4 <= n; i += 4)
+  {
+    uint64_t u, v;
+    memcpy(&u, pixels + i, 8);
+    memcpy(&v, pixels + i + 2, 8);
+    a = rotl(a ^ (u * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+    b = rotl(b ^ (v * 0x4cf5ad432745937full), 33) * 0x87c37b91114253d5ull;
+  }
+  for (; i < n; ++i)
+    a = rotl(a ^ (pixels[i] * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+
+  recel_hash_t hash;
+  a ^= n;
+  b ^= n;
+  a += b;
+  b += a;
+  hash.h[0] = fmix(a);
+  hash.h[1] = fmix(b);
+  hash.h[0] += hash.h[1];
+  hash.h[1] += hash.h[0];
+  return hash;
+}
+
+static void entry_path(const recel_cache_t *c, const recel_hash_t *key,
+                       char *path, size_t size)
+{
+  snprintf(path, size, "%s/%016llx%016llx.raw", c->dir,
+           (unsigned long long)key->h[0], (unsigned long long)key->h[1]);
+}
+
+static int read_all(int fd, void *data, size_t size)
+{
+  char *p = data;
+  while (size > 0)
+  {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static bool is_entry(const char *name)
+{
+  size_t len = strlen(name);
+  return len == 36 && strcmp(name + 32, ".raw") == 0;
+}
+
+struct victim {
+  char name[40];
+  struct timespec mtime;
+  uint64_t size;
+};
+
+static int compare_victims(const void *a, const void *b)
+{
+  const struct timespec *x = &((const struct victim*)a)->mtime;
+  const struct timespec *y = &((const struct victim*)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// List the entries, oldest first. Returns the total size.
+static uint64_t scan(const recel_cache_t *c, struct victim **victims,
+                     size_t *count)
+{
+  DIR *dir = opendir(c->dir);
+  uint64_t total = 0;
+  size_t capacity = 0;
+
+  *victims = NULL;
+  *count = 0;
+  if (!dir)
+    return 0;
+
+  struct dirent *e;
+  while ((e = readdir(dir)))
+  {
+    struct stat st;
+    if (!is_entry(e->d_name) ||
+        fstatat(dirfd(dir), e->d_name, &st, 0) != 0)
+      continue;
+
+    total += st.st_size;
+    if (*count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      *victims = recel_realloc(*victims, sizeof(struct victim) * capacity);
+    }
+    struct victim *v = &(*victims)[(*count)++];
+    strcpy(v->name, e->d_name);
+    v->mtime = st.st_mtim;
+    v->size = st.st_size;
+  }
+  closedir(dir);
+
+  qsort(*victims, *count, sizeof(struct victim), compare_victims);
+  return total;
+}
+
+// Remove least recently used entries until the cache is below 90% of its
+// limit. Called with the lock held.
+static void evict(recel_cache_t *c)
+{
+  struct victim *victims;
+  size_t count;
+  uint64_t total = scan(c, &victims, &count);
+  uint64_t target = c->max_bytes / 10 * 9;
+
+  for (size_t i = 0; i < count && total > target; ++i)
+  {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, victims[i].name);
+    if (unlink(path) == 0 || errno == ENOENT)
+      total -= victims[i].size;
+  }
+
+  c->bytes = total;
+  recel_free(victims);
+}
+
+recel_cache_t *recel_cache_open(const char *dir, uint64_t max_bytes)
+{
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    return NULL;
+
+  // Through recel_malloc, as every buffer released with recel_free
+  size_t len = strlen(dir) + 1;
+  recel_cache_t *c = recel_calloc(1, sizeof(recel_cache_t));
+  char *copy = recel_malloc(len);
+  if (!c || !copy)
+  {
+    recel_free(c);
+    recel_free(copy);
+    return NULL;
+  }
+  c->dir = memcpy(copy, dir, len);
+  c->max_bytes = max_bytes;
+  pthread_mutex_init(&c->lock, NULL);
+
+  struct victim *victims;
+  size_t count;
+  c->bytes = scan(c, &victims, &count);
+  recel_free(victims);
+  if (c->bytes > c->max_bytes)
+    evict(c);
+
+  return c;
+}
+
+void recel_cache_close(recel_cache_t *c)
+{
+  if (!c)
+    return;
+  pthread_mutex_destroy(&c->lock);
+  recel_free(c->dir);
+  recel_free(c);
+}
+
+uint32_t *recel_cache_get(recel_cache_t *c, const recel_hash_t *key,
+                          uint32_t *w, uint32_t *h)
+{
+  char path[4096];
+  uint32_t *pixels = NULL;
+  entry_path(c, key, path, sizeof(path));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    uint8_t header[HEADER_SIZE];
+    struct stat st;
+    if (read_all(fd, header, HEADER_SIZE) == 0 && fstat(fd, &st) == 0 &&
+        memcmp(header, "RECL", 4) == 0)
+    {
+      uint32_t hw, hh;
+      memcpy(&hw, header + 4, 4);
+      memcpy(&hh, header + 8, 4);
+      size_t bytes = (size_t)hw * hh * 4;
+      if ((uint64_t)st.st_size == HEADER_SIZE + bytes &&
+          (pixels = recel_malloc(bytes)) && read_all(fd, pixels, bytes) == 0)
+      {
+        *w = hw;
+        *h = hh;
+        // The modification time orders entries for eviction
+        futimens(fd, NULL);
+      }
+      else
+      {
+        recel_free(pixels);
+        pixels = NULL;
+      }
+    }
+    close(fd);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  if (pixels)
+    c->hits += 1;
+  else
+    c->misses += 1;
+  pthread_mutex_unlock(&c->lock);
+
+  return pixels;
+}
+
+int recel_cache_put(recel_cache_t *c, const recel_hash_t *key,
+                    uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  uint64_t size = HEADER_SIZE + (uint64_t)w * h * 4;
+  if (size > c->max_bytes)
+    return -1;
+
+  // Write aside and rename, readers never see a partial entry
+  char path[4096], tmp[4096];
+  entry_path(c, key, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", c->dir);
+
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  int result = fchmod(fd, 0644);
+  if (result == 0)
+    result = recel_image_write(fd, RECEL_FORMAT_RAW, w, h, pixels);
+  if (close(fd) != 0)
+    result = -1;
+  if (result == 0)
+    result = rename(tmp, path);
+  if (result != 0)
+  {
+    unlink(tmp);
+    return -1;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->bytes += size;
+  if (c->bytes > c->max_bytes)
+    evict(c);
+  pthread_mutex_unlock(&c->lock);
+  return 0;
+}
+
+void recel_cache_stats(recel_cache_t *c, uint64_t *hits, uint64_t *misses,
+                       uint64_t *bytes)
+{
+  pthread_mutex_lock(&c->lock);
+  *hits = c->hits;
+  *misses = c->misses;
+  *bytes = c->bytes;
+  pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,455 @@
+#include "recel.h"
+#include <immintrin.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+/* Instruction sets */
+
+static const char *const isa_names[RECEL_ISA_COUNT] = {
+  "scalar", "sse2", "avx2", "avx512",
+};
+
+// Scalar kernels
+
+static int flat_end_scalar(const uint32_t *d1, const uint32_t *d2, int x, int w)
+{
+  while (x < w && d1[x] == d2[x])
+    x += 1;
+  return x;
+}
+
+static int flat_end16_scalar(const uint16_t *d1, const uint16_t *d2,
+                             int x, int w)
+{
+  while (x < w && d1[x] == d2[x])
+    x += 1;
+  return x;
+}
+
+// Columns [xb, xe) of rows [yb, ye), rows of out and in are os and is
+// pixels apart
+static void transpose_block(uint32_t *out, size_t os, const uint32_t *in,
+                            size_t is, int xb, int xe, int yb, int ye)
+{
+  for (int x = xb; x < xe; x++)
+    for (int y = yb; y < ye; y++)
+      out[(size_t)x * os + y] = in[(size_t)y * is + x];
+}
+
+static void transpose_block16(uint16_t *out, size_t os, const uint16_t *in,
+                              size_t is, int xb, int xe, int yb, int ye)
+{
+  for (int x = xb; x < xe; x++)
+    for (int y = yb; y < ye; y++)
+      out[(size_t)x * os + y] = in[(size_t)y * is + x];
+}
+
+// Transpose by blocks to stay in cache, each block by tiles of n * n
+// pixels, the edges of the block pixel by pixel
+#define TRANSPOSE_TILED(n, tile, block) \
+  enum { B = 32 }; \
+  for (int yb = 0; yb < h; yb += B) \
+  { \
+    int ye = yb + B < h ? yb + B : h; \
+    for (int xb = x0; xb < x1; xb += B) \
+    { \
+      int xe = xb + B < x1 ? xb + B : x1; \
+      int xt = xb + (xe - xb) / n * n, yt = yb + (ye - yb) / n * n; \
+      for (int x = xb; x < xt; x += n) \
+        for (int y = yb; y < yt; y += n) \
+          tile(out + (size_t)x * os + y, os, in + (size_t)y * is + x, is); \
+      block(out, os, in, is, xt, xe, yb, ye); \
+      block(out, os, in, is, xb, xt, yt, ye); \
+    } \
+  }
+
+static void transpose_scalar(uint32_t *out, size_t os, const uint32_t *in,
+                             size_t is, int h, int x0, int x1)
+{
+  enum { B = 32 };
+  for (int yb = 0; yb < h; yb += B)
+  {
+    int ye = yb + B < h ? yb + B : h;
+    for (int xb = x0; xb < x1; xb += B)
+      transpose_block(out, os, in, is, xb, xb + B < x1 ? xb + B : x1, yb, ye);
+  }
+}
+
+static void transpose16_scalar(uint16_t *out, size_t os, const uint16_t *in,
+                               size_t is, int h, int x0, int x1)
+{
+  enum { B = 32 };
+  for (int yb = 0; yb < h; yb += B)
+  {
+    int ye = yb + B < h ? yb + B : h;
+    for (int xb = x0; xb < x1; xb += B)
+      transpose_block16(out, os, in, is, xb, xb + B < x1 ? xb + B : x1, yb,
+                        ye);
+  }
+}
+
+// SSE2
+
+__attribute__((target("sse2")))
+static int flat_end_sse2(const uint32_t *d1, const uint32_t *d2, int x, int w)
+{
+  for (; x + 4 <= w; x += 4)
+  {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(d1 + x)),
+                                 _mm_loadu_si128((const __m128i*)(d2 + x)));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    if (mask != 0xF)
+      return x + __builtin_ctz(~mask);
+  }
+  return flat_end_scalar(d1, d2, x, w);
+}
+
+__attribute__((target("sse2")))
+static void tile4_sse2(uint32_t *out, size_t os, const uint32_t *in, size_t is)
+{
+  __m128i r0 = _mm_loadu_si128((const __m128i*)(in + 0 * is));
+  __m128i r1 = _mm_loadu_si128((const __m128i*)(in + 1 * is));
+  __m128i r2 = _mm_loadu_si128((const __m128i*)(in + 2 * is));
+  __m128i r3 = _mm_loadu_si128((const __m128i*)(in + 3 * is));
+  __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpackhi_epi32(r0, r1);
+  __m128i t2 = _mm_unpacklo_epi32(r2, r3), t3 = _mm_unpackhi_epi32(r2, r3);
+  _mm_storeu_si128((__m128i*)(out + 0 * os), _mm_unpacklo_epi64(t0, t2));
+  _mm_storeu_si128((__m128i*)(out + 1 * os), _mm_unpackhi_epi64(t0, t2));
+  _mm_storeu_si128((__m128i*)(out + 2 * os), _mm_unpacklo_epi64(t1, t3));
+  _mm_storeu_si128((__m128i*)(out + 3 * os), _mm_unpackhi_epi64(t1, t3));
+}
+
+__attribute__((target("sse2")))
+static void transpose_sse2(uint32_t *out, size_t os, const uint32_t *in,
+                           size_t is, int h, int x0, int x1)
+{
+  TRANSPOSE_TILED(4, tile4_sse2, transpose_block)
+}
+
+// Two bits of the byte mask per 16-bit lane
+__attribute__((target("sse2")))
+static int flat_end16_sse2(const uint16_t *d1, const uint16_t *d2, int x, int w)
+{
+  for (; x + 8 <= w; x += 8)
+  {
+    __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(d1 + x)),
+                                 _mm_loadu_si128((const __m128i*)(d2 + x)));
+    int mask = _mm_movemask_epi8(eq);
+    if (mask != 0xFFFF)
+      return x + __builtin_ctz(~mask) / 2;
+  }
+  return flat_end16_scalar(d1, d2, x, w);
+}
+
+__attribute__((target("sse2")))
+static void tile8x16_sse2(uint16_t *out, size_t os, const uint16_t *in,
+                          size_t is)
+{
+#define ROW(i) _mm_loadu_si128((const __m128i*)(in + (i) * is))
+  __m128i r0 = ROW(0), r1 = ROW(1), r2 = ROW(2), r3 = ROW(3);
+  __m128i r4 = ROW(4), r5 = ROW(5), r6 = ROW(6), r7 = ROW(7);
+#undef ROW
+
+  // Pairs of rows, quads, then whole columns
+  __m128i t0 = _mm_unpacklo_epi16(r0, r1), t1 = _mm_unpackhi_epi16(r0, r1);
+  __m128i t2 = _mm_unpacklo_epi16(r2, r3), t3 = _mm_unpackhi_epi16(r2, r3);
+  __m128i t4 = _mm_unpacklo_epi16(r4, r5), t5 = _mm_unpackhi_epi16(r4, r5);
+  __m128i t6 = _mm_unpacklo_epi16(r6, r7), t7 = _mm_unpackhi_epi16(r6, r7);
+  __m128i u0 = _mm_unpacklo_epi32(t0, t2), u1 = _mm_unpackhi_epi32(t0, t2);
+  __m128i u2 = _mm_unpacklo_epi32(t1, t3), u3 = _mm_unpackhi_epi32(t1, t3);
+  __m128i u4 = _mm_unpacklo_epi32(t4, t6), u5 = _mm_unpackhi_epi32(t4, t6);
+  __m128i u6 = _mm_unpacklo_epi32(t5, t7), u7 = _mm_unpackhi_epi32(t5, t7);
+
+#define COL(i, v) _mm_storeu_si128((__m128i*)(out + (i) * os), v)
+  COL(0, _mm_unpacklo_epi64(u0, u4));
+  COL(1, _mm_unpackhi_epi64(u0, u4));
+  COL(2, _mm_unpacklo_epi64(u1, u5));
+  COL(3, _mm_unpackhi_epi64(u1, u5));
+  COL(4, _mm_unpacklo_epi64(u2, u6));
+  COL(5, _mm_unpackhi_epi64(u2, u6));
+  COL(6, _mm_unpacklo_epi64(u3, u7));
+  COL(7, _mm_unpackhi_epi64(u3, u7));
+#undef COL
+}
+
+__attribute__((target("sse2")))
+static void transpose16_sse2(uint16_t *out, size_t os, const uint16_t *in,
+                             size_t is, int h, int x0, int x1)
+{
+  TRANSPOSE_TILED(8, tile8x16_sse2, transpose_block16)
+}
+
+// AVX2
+
+__attribute__((target("avx2")))
+static int flat_end_avx2(const uint32_t *d1, const uint32_t *d2, int x, int w)
+{
+  for (; x + 8 <= w; x += 8)
+  {
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(d1 + x)),
+                                    _mm256_loadu_si256((const __m256i*)(d2 + x)));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+    if (mask != 0xFF)
+      return x + __builtin_ctz(~mask);
+  }
+  return flat_end_sse2(d1, d2, x, w);
+}
+
+__attribute__((target("avx2")))
+static void tile8_avx2(uint32_t *out, size_t os, const uint32_t *in, size_t is)
+{
+#define ROW(i) _mm256_loadu_si256((const __m256i*)(in + (i) * is))
+  __m256i r0 = ROW(0), r1 = ROW(1), r2 = ROW(2), r3 = ROW(3);
+  __m256i r4 = ROW(4), r5 = ROW(5), r6 = ROW(6), r7 = ROW(7);
+#undef ROW
+
+  // Pairs of rows, then quads, within each 128-bit lane
+  __m256i t0 = _mm256_unpacklo_epi32(r0, r1), t1 = _mm256_unpackhi_epi32(r0, r1);
+  __m256i t2 = _mm256_unpacklo_epi32(r2, r3), t3 = _mm256_unpackhi_epi32(r2, r3);
+  __m256i t4 = _mm256_unpacklo_epi32(r4, r5), t5 = _mm256_unpackhi_epi32(r4, r5);
+  __m256i t6 = _mm256_unpacklo_epi32(r6, r7), t7 = _mm256_unpackhi_epi32(r6, r7);
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+
+  // Low lanes of the quads are the first four columns, high lanes the last
+#define COL(i, v) _mm256_storeu_si256((__m256i*)(out + (i) * os), v)
+  COL(0, _mm256_permute2x128_si256(u0, u4, 0x20));
+  COL(1, _mm256_permute2x128_si256(u1, u5, 0x20));
+  COL(2, _mm256_permute2x128_si256(u2, u6, 0x20));
+  COL(3, _mm256_permute2x128_si256(u3, u7, 0x20));
+  COL(4, _mm256_permute2x128_si256(u0, u4, 0x31));
+  COL(5, _mm256_permute2x128_si256(u1, u5, 0x31));
+  COL(6, _mm256_permute2x128_si256(u2, u6, 0x31));
+  COL(7, _mm256_permute2x128_si256(u3, u7, 0x31));
+#undef COL
+}
+
+__attribute__((target("avx2")))
+static void transpose_avx2(uint32_t *out, size_t os, const uint32_t *in,
+                           size_t is, int h, int x0, int x1)
+{
+  TRANSPOSE_TILED(8, tile8_avx2, transpose_block)
+}
+
+__attribute__((target("avx2")))
+static int flat_end16_avx2(const uint16_t *d1, const uint16_t *d2, int x, int w)
+{
+  for (; x + 16 <= w; x += 16)
+  {
+    __m256i eq = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(d1 + x)),
+                                    _mm256_loadu_si256((const __m256i*)(d2 + x)));
+    unsigned mask = _mm256_movemask_epi8(eq);
+    if (mask != 0xFFFFFFFF)
+      return x + __builtin_ctz(~mask) / 2;
+  }
+  return flat_end16_sse2(d1, d2, x, w);
+}
+
+// As tile8x16_sse2 within each 128-bit lane, which holds 8 of the 16
+// columns, then the lanes of the top and bottom halves are paired.  The
+// loops are unrolled so that the arrays stay in registers
+__attribute__((target("avx2")))
+static void tile16x16_avx2(uint16_t *out, size_t os, const uint16_t *in,
+                           size_t is)
+{
+  __m256i r[16], t[16], u[16], v[8], x[8];
+  #pragma GCC unroll 16
+  for (int i = 0; i < 16; ++i)
+    r[i] = _mm256_loadu_si256((const __m256i*)(in + i * is));
+
+  // Pairs of rows, then quads: u[4g + j] holds columns 2j and 2j + 1 of
+  // rows 4g to 4g + 3, as 64-bit columns
+  #pragma GCC unroll 16
+  for (int i = 0; i < 16; i += 2)
+  {
+    t[i] = _mm256_unpacklo_epi16(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi16(r[i], r[i + 1]);
+  }
+  #pragma GCC unroll 16
+  for (int g = 0; g < 16; g += 4)
+  {
+    u[g] = _mm256_unpacklo_epi32(t[g], t[g + 2]);
+    u[g + 1] = _mm256_unpackhi_epi32(t[g], t[g + 2]);
+    u[g + 2] = _mm256_unpacklo_epi32(t[g + 1], t[g + 3]);
+    u[g + 3] = _mm256_unpackhi_epi32(t[g + 1], t[g + 3]);
+  }
+
+  // Octets: v[m] is column m of rows 0 to 7, x[m] of rows 8 to 15
+  #pragma GCC unroll 16
+  for (int j = 0; j < 4; ++j)
+  {
+    v[2 * j] = _mm256_unpacklo_epi64(u[j], u[4 + j]);
+    v[2 * j + 1] = _mm256_unpackhi_epi64(u[j], u[4 + j]);
+    x[2 * j] = _mm256_unpacklo_epi64(u[8 + j], u[12 + j]);
+    x[2 * j + 1] = _mm256_unpackhi_epi64(u[8 + j], u[12 + j]);
+  }
+
+  #pragma GCC unroll 16
+  for (int m = 0; m < 8; ++m)
+  {
+    _mm256_storeu_si256((__m256i*)(out + m * os),
+                        _mm256_permute2x128_si256(v[m], x[m], 0x20));
+    _mm256_storeu_si256((__m256i*)(out + (8 + m) * os),
+                        _mm256_permute2x128_si256(v[m], x[m], 0x31));
+  }
+}
+
+__attribute__((target("avx2")))
+static void transpose16_avx2(uint16_t *out, size_t os, const uint16_t *in,
+                             size_t is, int h, int x0, int x1)
+{
+  TRANSPOSE_TILED(16, tile16x16_avx2, transpose_block16)
+}
+
+// AVX-512: 16 columns per 32-bit comparison and 32 per 16-bit one (BW),
+// transposition by 16 * 16 tiles
+
+__attribute__((target("avx512f")))
+static int flat_end_avx512(const uint32_t *d1, const uint32_t *d2, int x, int w)
+{
+  for (; x + 16 <= w; x += 16)
+  {
+    __mmask16 ne = _mm512_cmpneq_epu32_mask(_mm512_loadu_si512(d1 + x),
+                                            _mm512_loadu_si512(d2 + x));
+    if (ne)
+      return x + __builtin_ctz(ne);
+  }
+  return flat_end_avx2(d1, d2, x, w);
+}
+
+__attribute__((target("avx512bw")))
+static int flat_end16_avx512(const uint16_t *d1, const uint16_t *d2,
+                             int x, int w)
+{
+  for (; x + 32 <= w; x += 32)
+  {
+    __mmask32 ne = _mm512_cmpneq_epu16_mask(_mm512_loadu_si512(d1 + x),
+                                            _mm512_loadu_si512(d2 + x));
+    if (ne)
+      return x + __builtin_ctz(ne);
+  }
+  return flat_end16_avx2(d1, d2, x, w);
+}
+
+// As tile8_avx2 within each 128-bit lane, then two rounds of lane shuffles
+// gather the four lanes of each column, unrolled as in tile16x16_avx2
+__attribute__((target("avx512f")))
+static void tile16_avx512(uint32_t *out, size_t os, const uint32_t *in,
+                          size_t is)
+{
+  __m512i r[16], t[16], u[16];
+  #pragma GCC unroll 16
+  for (int i = 0; i < 16; ++i)
+    r[i] = _mm512_loadu_si512(in + i * is);
+
+  // u[4g + k] lane L holds column 4L + k of rows 4g to 4g + 3
+  #pragma GCC unroll 16
+  for (int i = 0; i < 16; i += 2)
+  {
+    t[i] = _mm512_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm512_unpackhi_epi32(r[i], r[i + 1]);
+  }
+  #pragma GCC unroll 16
+  for (int g = 0; g < 16; g += 4)
+  {
+    u[g] = _mm512_unpacklo_epi64(t[g], t[g + 2]);
+    u[g + 1] = _mm512_unpackhi_epi64(t[g], t[g + 2]);
+    u[g + 2] = _mm512_unpacklo_epi64(t[g + 1], t[g + 3]);
+    u[g + 3] = _mm512_unpackhi_epi64(t[g + 1], t[g + 3]);
+  }
+
+  #pragma GCC unroll 16
+
+  for (int k = 0; k < 4; ++k)
+  {
+    // Even and odd lanes of the row groups 0-1 and 2-3
+    __m512i a0 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0x88);
+    __m512i a1 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0xDD);
+    __m512i b0 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0x88);
+    __m512i b1 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0xDD);
+    _mm512_storeu_si512(out + k * os, _mm512_shuffle_i32x4(a0, b0, 0x88));
+    _mm512_storeu_si512(out + (4 + k) * os, _mm512_shuffle_i32x4(a1, b1, 0x88));
+    _mm512_storeu_si512(out + (8 + k) * os, _mm512_shuffle_i32x4(a0, b0, 0xDD));
+    _mm512_storeu_si512(out + (12 + k) * os, _mm512_shuffle_i32x4(a1, b1, 0xDD));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void transpose_avx512(uint32_t *out, size_t os, const uint32_t *in,
+                             size_t is, int h, int x0, int x1)
+{
+  TRANSPOSE_TILED(16, tile16_avx512, transpose_block)
+}
+
+static const cpu_kernels_t kernels[RECEL_ISA_COUNT] = {
+  { flat_end_scalar, transpose_scalar, flat_end16_scalar, transpose16_scalar },
+  { flat_end_sse2, transpose_sse2, flat_end16_sse2, transpose16_sse2 },
+  { flat_end_avx2, transpose_avx2, flat_end16_avx2, transpose16_avx2 },
+  { flat_end_avx512, transpose_avx512, flat_end16_avx512, transpose16_avx2 },
+};
+
+/* Selection */
+
+static atomic_int current = -1;
+
+recel_isa_t recel_isa_detect(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return RECEL_ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return RECEL_ISA_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return RECEL_ISA_SSE2;
+  return RECEL_ISA_SCALAR;
+}
+
+recel_isa_t recel_isa(void)
+{
+  int cached = atomic_load(&current);
+  if (cached >= 0)
+    return cached;
+
+  // RECEL_ISA can only lower the level
+  recel_isa_t isa = recel_isa_detect(), forced;
+  const char *env = getenv("RECEL_ISA");
+  if (env && recel_isa_from_name(env, &forced) == 0 && forced < isa)
+    isa = forced;
+  atomic_store(&current, isa);
+  return isa;
+}
+
+int recel_set_isa(recel_isa_t isa)
+{
+  if (isa < 0 || isa >= RECEL_ISA_COUNT || isa > recel_isa_detect())
+    return -1;
+  atomic_store(&current, isa);
+  return 0;
+}
+
+const char *recel_isa_name(recel_isa_t isa)
+{
+  return isa >= 0 && isa < RECEL_ISA_COUNT ? isa_names[isa] : "unknown";
+}
+
+int recel_isa_from_name(const char *name, recel_isa_t *isa)
+{
+  for (int i = 0; i < RECEL_ISA_COUNT; ++i)
+  {
+    if (strcmp(name, isa_names[i]) == 0)
+    {
+      *isa = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const cpu_kernels_t *cpu_kernels(void)
+{
+  return &kernels[recel_isa()];
+}
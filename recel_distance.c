@@ -1,8 +1,35 @@
 #include "recel.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "stb_image_write.h"
+#include "counters.h"
 #include "fasttable.h"
+#include "memory.h"
+#include "trace.h"
+
+/* Views */
+
+recel_view_t recel_view(const uint32_t *pixels, uint32_t w, uint32_t h)
+{
+  recel_view_t v = { (uint32_t*)pixels, w, h, w };
+  return v;
+}
+
+recel_view_t recel_view_region(recel_view_t v, uint32_t x, uint32_t y,
+                               uint32_t w, uint32_t h)
+{
+  if (x > v.w)
+    x = v.w;
+  if (y > v.h)
+    y = v.h;
+  if (w > v.w - x)
+    w = v.w - x;
+  if (h > v.h - y)
+    h = v.h - y;
+  recel_view_t r = { &VIEW_PIX(v, x, y), w, h, v.stride };
+  return r;
+}
 
 /* Distance map */
 
@@ -22,38 +49,47 @@ static int32_t encode(uint32_t x, uint32_t y)
 #define DECODE_X(d) ((~(d) >> 15) & 0x7FFF)
 #define DECODE_Y(d) ((~(d)) & 0x7FFF)
 
+// Pixels of the input and of the distance map, whose rows are is and ds
+// pixels apart
+#define IN(x, y) (input[(size_t)(y) * is + (x)])
+#define DIST(x, y) (distance[(size_t)(y) * ds + (x)])
+
 #define PUSH(list, x, y) \
   do { \
-    assert (PIX(distance, x, y) == 0); \
-    PIX(distance, x, y) = list; \
-    colorcounter_incr(counter, PIX(input, x, y)); \
+    assert (DIST(x, y) == 0); \
+    DIST(x, y) = list; \
+    colorcounter_incr(counter, IN(x, y)); \
     list = encode(x, y); \
   } while (0)
 
 // Compute distance map
 
-static int32_t distance_init(uint32_t w, uint32_t h, colorcounter_t *counter,  const uint32_t *input, int32_t *distance)
+static int32_t distance_init(uint32_t w, uint32_t h, colorcounter_t *counter,
+    const uint32_t *input, size_t is, int32_t *distance, size_t ds)
 {
   // Fill with 0
-  for (uint32_t i = 0, last = w * h - 1 ; i <= last; ++i)
-    distance[i] = 0;
+  for (uint32_t y = 0; y < h; ++y)
+    memset(&DIST(0, y), 0, sizeof(int32_t) * w);
 
   int32_t worklist = -1;
 
   colorcounter_start(counter);
 
-  // Fill worklist with borders (horizontal)
+  // Fill worklist with borders (horizontal), a single row or column is
+  // pushed once
   for (uint32_t i = 0, j = h - 1, last = w - 1; i <= last; ++i)
   {
     PUSH(worklist, i, 0);
-    PUSH(worklist, i, j);
+    if (j > 0)
+      PUSH(worklist, i, j);
   }
 
   // Initialize border with 1 (vertical)
-  for (uint32_t j = 1, i = w - 1, last = h - 2; j <= last; ++j)
+  for (uint32_t j = 1, i = w - 1; j + 1 < h; ++j)
   {
     PUSH(worklist, 0, j);
-    PUSH(worklist, i, j);
+    if (i > 0)
+      PUSH(worklist, i, j);
   }
 
   return worklist;
@@ -63,7 +99,7 @@ static int32_t distance_init(uint32_t w, uint32_t h, colorcounter_t *counter,  c
   do { \
     uint32_t tmp_x = (x), tmp_y = (y); \
     if (tmp_x >= 0 && tmp_y >= 0 && tmp_x < w && tmp_y < h && \
-        PIX(input, tmp_x, tmp_y) == col && PIX(distance, tmp_x, tmp_y) == 0) \
+        IN(tmp_x, tmp_y) == col && DIST(tmp_x, tmp_y) == 0) \
       PUSH(worklist, tmp_x, tmp_y); \
   } while (0)
 
@@ -71,7 +107,8 @@ static int32_t distance_init(uint32_t w, uint32_t h, colorcounter_t *counter,  c
 
 static int32_t distance_propagate(uint32_t w, uint32_t h,
     colorcounter_t *counter,
-    const uint32_t *input, int32_t *distance, int32_t worklist)
+    const uint32_t *input, size_t is, int32_t *distance, size_t ds,
+    int32_t worklist)
 {
   int32_t sentinel = -1;
 
@@ -80,7 +117,7 @@ static int32_t distance_propagate(uint32_t w, uint32_t h,
     int32_t sentinel1 = worklist, cursor = worklist;
     do {
       uint32_t x = DECODE_X(cursor), y = DECODE_Y(cursor);
-      uint32_t col = PIX(input, x, y);
+      uint32_t col = IN(x, y);
 
       PROPAGATE(worklist, col, x - 1, y - 1);
       PROPAGATE(worklist, col, x - 1, y + 0);
@@ -91,7 +128,7 @@ static int32_t distance_propagate(uint32_t w, uint32_t h,
       PROPAGATE(worklist, col, x + 1, y + 0);
       PROPAGATE(worklist, col, x + 1, y + 1);
 
-      cursor = PIX(distance, x, y);
+      cursor = DIST(x, y);
     } while (cursor != sentinel);
     sentinel = sentinel1;
   }
@@ -104,13 +141,13 @@ static int32_t distance_propagate(uint32_t w, uint32_t h,
     uint32_t tmp_x = (x), tmp_y = (y); \
     if (tmp_x >= 0 && tmp_y >= 0 && \
         tmp_x < w && tmp_y < h && \
-        PIX(distance, tmp_x, tmp_y) == 0) \
+        DIST(tmp_x, tmp_y) == 0) \
       PUSH(worklist, tmp_x, tmp_y);  \
   } while (0)
 
 static int32_t distance_nextlevel(uint32_t w, uint32_t h,
     colorcounter_t *counter,
-    const uint32_t *input, int32_t *distance,
+    const uint32_t *input, size_t is, int32_t *distance, size_t ds,
     int32_t level, int32_t worklist)
 {
   int32_t cursor = worklist;
@@ -125,34 +162,164 @@ static int32_t distance_nextlevel(uint32_t w, uint32_t h,
     PUSHNEXT(worklist, x + 1, y + 0);
     PUSHNEXT(worklist, x + 0, y + 1);
 
-    cursor = PIX(distance, x, y);
+    cursor = DIST(x, y);
 
-    PIX(distance, x, y) = level +
-      colorcounter_get_rank(counter, PIX(input, x, y));
+    DIST(x, y) = level + colorcounter_get_rank(counter, IN(x, y));
   }
 
   return worklist;
 }
 
-uint32_t *recel_distance(uint32_t w, uint32_t h, uint32_t *input)
+#ifdef RECEL_COUNTERS
+// Pixels linked from list
+static uint64_t list_length(const int32_t *distance, size_t ds, int32_t list)
 {
-  int32_t *distance = NEW_IMAGE(int32_t, w, h);
-  colorcounter_t *counter = colorcounter_new();
-  int32_t worklist = distance_init(w, h, counter, input, distance);
+  uint64_t n = 0;
+  for (; list != -1; list = DIST(DECODE_X(list), DECODE_Y(list)))
+    n += 1;
+  return n;
+}
+#endif
+
+// Time spent since *t in a step, restarting the clock
+static void account(recel_stats_t *stats, recel_stage_t stage, uint64_t *t,
+                    uint64_t *mark)
+{
+  uint64_t now = trace_now();
+  stats->stage[stage].ns += now - *t;
+  memory_stage(&stats->stage[stage], mark);
+  *t = now;
+}
+
+int recel_distance_view(recel_view_t in, recel_view_t out,
+                        struct colorcounter *counter, recel_stats_t *stats)
+{
+  // Worklist links encode coordinates on 15 bits
+  uint32_t w = in.w, h = in.h;
+  if (w == 0 || h == 0 || w >= 32768 || h >= 32768 || out.w < w || out.h < h)
+    return -1;
+
+  const uint32_t *input = in.pixels;
+  size_t is = in.stride, ds = out.stride;
+
+  uint64_t t = stats ? trace_now() : 0, ranked = 0;
+  uint64_t mark = stats ? memory_mark() : 0;
+  uint32_t levels = 0;
+  TRACE_BEGIN(whole);
+
+  int32_t *distance = (int32_t*)out.pixels;
+  int32_t worklist = distance_init(w, h, counter, input, is, distance, ds);
   int32_t level = 1;
+  if (stats)
+    account(stats, RECEL_STAGE_DIST_INIT, &t, &mark);
 
+  // Levels are traced with their index
   while (worklist != -1)
   {
+    TRACE_BEGIN(step);
     level += colorcounter_distinct_count(counter);
+    levels += 1;
+
+#ifdef RECEL_COUNTERS
+    uint32_t slot = levels <= RECEL_COUNTER_LEVELS ? levels - 1
+                                                   : RECEL_COUNTER_LEVELS - 1;
+    uint64_t frontier = list_length(distance, ds, worklist);
+    COUNTER_ADD(level_frontier[slot], frontier);
+    COUNTER_MAX(frontier_max, frontier);
+#endif
 
     colorcounter_start(counter);
-    worklist = distance_propagate(w, h, counter, input, distance, worklist);
+    worklist = distance_propagate(w, h, counter, input, is, distance, ds,
+                                  worklist);
+    if (stats)
+    {
+      account(stats, RECEL_STAGE_DIST_PROPAGATE, &t, &mark);
+      ranked += colorcounter_distinct_count(counter);
+    }
+    TRACE_END(step, "propagate", levels);
+
+#ifdef RECEL_COUNTERS
+    COUNTER_ADD(level_pixels[slot], list_length(distance, ds, worklist));
+    COUNTER_ADD(level_colors[slot], colorcounter_distinct_count(counter));
+    COUNTER_MAX(colors_max, colorcounter_distinct_count(counter));
+#endif
 
+    TRACE_BEGIN(rank);
     colorcounter_rank(counter);
-    worklist = distance_nextlevel(w, h, counter, input, distance, level, worklist);
+    if (stats)
+      account(stats, RECEL_STAGE_DIST_RANK, &t, &mark);
+    TRACE_END(rank, "rank", levels);
+
+    TRACE_BEGIN(next);
+    worklist = distance_nextlevel(w, h, counter, input, is, distance, ds,
+                                  level, worklist);
+    if (stats)
+      account(stats, RECEL_STAGE_DIST_NEXTLEVEL, &t, &mark);
+    TRACE_END(next, "nextlevel", levels);
+  }
+  TRACE_END(whole, "distance", levels);
+  COUNTER_ADD(distances, 1);
+  COUNTER_ADD(levels, levels);
+
+  if (stats)
+  {
+    // Every pixel is pushed, propagated (8 neighbours, input and distance)
+    // and numbered (4 neighbours, then its rank) once
+    uint64_t pixels = (uint64_t)w * h;
+    stats->levels += levels;
+    stats->stage[RECEL_STAGE_DIST_INIT].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_INIT].bytes += pixels * 4;
+    stats->stage[RECEL_STAGE_DIST_PROPAGATE].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_PROPAGATE].bytes += pixels * (8 * 8 + 12);
+    stats->stage[RECEL_STAGE_DIST_RANK].items += ranked;
+    stats->stage[RECEL_STAGE_DIST_RANK].bytes += ranked * 16;
+    stats->stage[RECEL_STAGE_DIST_NEXTLEVEL].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_NEXTLEVEL].bytes += pixels * (4 * 4 + 12);
   }
 
-  return (uint32_t*)distance;
+  return 0;
+}
+
+int recel_distance_into(uint32_t w, uint32_t h, const uint32_t *input,
+                        uint32_t *output, struct colorcounter *counter,
+                        recel_stats_t *stats)
+{
+  return recel_distance_view(recel_view(input, w, h), recel_view(output, w, h),
+                             counter, stats);
+}
+
+uint32_t *recel_distance(uint32_t w, uint32_t h, uint32_t *input)
+{
+  if (w == 0 || h == 0 || w >= 32768 || h >= 32768)
+    return NULL;
+
+  uint32_t *distance = NEW_IMAGE(uint32_t, w, h);
+  if (!distance)
+    return NULL;
+  colorcounter_t *counter = colorcounter_new();
+  recel_distance_into(w, h, input, distance, counter, NULL);
+  colorcounter_delete(counter);
+  return distance;
+}
+
+int recel_distance_narrow(uint32_t w, uint32_t h, uint32_t *distance)
+{
+  size_t n = (size_t)w * h;
+  uint32_t max = 0;
+  for (size_t i = 0; i < n; ++i)
+    max |= distance[i];
+  if (max > UINT16_MAX)
+    return -1;
+
+  // narrow[i] lands in distance[i/2], already read; memcpy because both
+  // types alias the same memory
+  char *narrow = (char*)distance;
+  for (size_t i = 0; i < n; ++i)
+  {
+    uint16_t d = distance[i];
+    memcpy(narrow + sizeof(d) * i, &d, sizeof(d));
+  }
+  return 0;
 }
 
 uint8_t *recel_dist_to_u8(uint32_t w, uint32_t h, uint32_t *input)
@@ -183,5 +350,5 @@ void recel_save_dist(const char *name, uint32_t w, uint32_t h, uint32_t *dist)
 {
   uint8_t *out = recel_dist_to_u8(w, h, dist);
   stbi_write_png(name, w, h, 1, out, 0);
-  free(out);
+  recel_free(out);
 }
@@ -0,0 +1,76 @@
+#include "recel.h"
+#include <math.h>
+#include "fasttable.h"
+#include "memory.h"
+#include "threadpool.h"
+
+/* Cost estimation */
+
+uint32_t recel_count_colors(uint32_t w, uint32_t h, const uint32_t *pixels,
+                            uint32_t max_samples)
+{
+  uint64_t n = (uint64_t)w * h;
+  if (n == 0)
+    return 0;
+
+  // Odd step, so that samples do not line up with columns
+  uint64_t step = 1;
+  if (max_samples > 0 && n > max_samples)
+    step = (n / max_samples) | 1;
+
+  fasttable_t *table = fasttable_new();
+  uint32_t count = 0;
+
+  for (uint64_t i = 0; i < n; i += step)
+  {
+    uint32_t *cell = fasttable_cell(table, pixels[i]);
+    if (*cell == (uint32_t)-1)
+    {
+      *cell = 0;
+      count += 1;
+    }
+  }
+
+  fasttable_delete(table);
+  return count;
+}
+
+// Fraction of the time spent computing distance maps, which is sequential
+#define DISTANCE_SHARE 0.75
+
+void recel_estimate(const recel_options_t *opt, uint32_t w, uint32_t h,
+                    uint32_t colors, recel_estimate_t *est)
+{
+  uint64_t pixels = (uint64_t)w * h;
+  uint64_t ow = w > 0 ? 3 * (uint64_t)w - 2 : 0;
+  uint64_t oh = h > 0 ? 3 * (uint64_t)h - 2 : 0;
+
+  // The buffers of both passes are allocated at once, see upscale_buffers,
+  // and the output next to them
+  uint64_t peak = upscale_arena_bytes(w, h) + ow * oh * 4;
+
+  // Color tables of the distance computation: a count cell and a hash cell
+  // per color, with room to grow
+  peak += (uint64_t)colors * 48;
+
+  est->peak_bytes = peak;
+  est->output_bytes = ow * oh * 4;
+
+  // Measured: about 230ns per input pixel on small images, growing as the
+  // buffers fall out of caches, plus hashing many colors
+  double ns = 230;
+  if (pixels > 4096)
+    ns += 30 * log2(pixels / 4096.0);
+  ns += 3 * log2(1.0 + colors);
+  ns *= pixels;
+
+  int workers = opt && opt->pool ? threadpool_size(opt->pool) : 1;
+  est->nanoseconds = ns * (DISTANCE_SHARE + (1 - DISTANCE_SHARE) / workers);
+}
+
+uint64_t recel_cost(uint32_t w, uint32_t h, uint32_t colors)
+{
+  recel_estimate_t est;
+  recel_estimate(NULL, w, h, colors, &est);
+  return est.nanoseconds;
+}
@@ -0,0 +1,174 @@
+#include "recel.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threadpool.h"
+#include "trace.h"
+
+/* Animations */
+
+typedef struct {
+  recel_hash_t key;
+  uint32_t index;
+} frame_key_t;
+
+struct animation {
+  const recel_options_t *opt;
+  uint32_t w, h;
+  const uint32_t *const *frames;
+  uint32_t **outputs;
+  const recel_hash_t *keys;
+  uint32_t *unique; // first frame of each distinct content, in order
+  uint32_t unique_count, runs;
+  atomic_bool failed;
+  atomic_uint partial;
+  atomic_ullong upscale_ns;
+};
+
+static int compare_keys(const void *a, const void *b)
+{
+  const frame_key_t *x = a, *y = b;
+  for (int i = 0; i < 2; ++i)
+  {
+    if (x->key.h[i] != y->key.h[i])
+      return x->key.h[i] < y->key.h[i] ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Upscale a run of consecutive distinct frames with one plan, each frame
+// starting from the result of the previous one
+static void run_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  struct animation *a = ctx;
+  recel_cache_t *cache = a->opt ? a->opt->cache : NULL;
+  size_t size = (size_t)(3 * a->w - 2) * (3 * a->h - 2);
+
+  for (uint32_t r = begin; r < end; ++r)
+  {
+    recel_plan_t *plan = recel_plan_new(a->opt, a->w, a->h);
+    if (!plan)
+    {
+      atomic_store(&a->failed, true);
+      return;
+    }
+
+    const uint32_t *last = NULL;
+    uint32_t first = (uint64_t)a->unique_count * r / a->runs;
+    uint32_t limit = (uint64_t)a->unique_count * (r + 1) / a->runs;
+    for (uint32_t k = first; k < limit && !atomic_load(&a->failed); ++k)
+    {
+      uint32_t i = a->unique[k];
+      uint32_t cw, ch;
+      if (cache &&
+          (a->outputs[i] = recel_cache_get(cache, &a->keys[i], &cw, &ch)))
+        continue;
+
+      uint32_t *output = a->outputs[i] = NEW_IMAGE(uint32_t, size, 1);
+      if (!output)
+      {
+        atomic_store(&a->failed, true);
+        break;
+      }
+
+      TRACE_BEGIN(frame);
+      uint64_t start = trace_now();
+      if (last)
+      {
+        memcpy(output, last, sizeof(uint32_t) * size);
+        if (recel_plan_update(plan, a->frames[i], output, NULL))
+          atomic_fetch_add(&a->partial, 1);
+      }
+      else
+        recel_plan_run(plan, a->frames[i], output);
+      atomic_fetch_add(&a->upscale_ns, trace_now() - start);
+      TRACE_END(frame, "frame", i);
+      last = output;
+
+      if (cache)
+        recel_cache_put(cache, &a->keys[i], 3 * a->w - 2, 3 * a->h - 2, output);
+    }
+
+    recel_plan_delete(plan);
+  }
+}
+
+int recel_upscale_frames(const recel_options_t *opt, uint32_t w, uint32_t h,
+                         uint32_t count, const uint32_t *const *frames,
+                         uint32_t **outputs, uint32_t *same,
+                         recel_frame_stats_t *stats)
+{
+  memset(outputs, 0, sizeof(uint32_t*) * count);
+  if (w < 2 || h < 2 || count == 0)
+    return -1;
+
+  struct animation a = {
+    .opt = opt, .w = w, .h = h, .frames = frames, .outputs = outputs,
+  };
+  recel_hash_t *keys = recel_malloc(sizeof(recel_hash_t) * count);
+  frame_key_t *sorted = recel_malloc(sizeof(frame_key_t) * count);
+  a.unique = recel_malloc(sizeof(uint32_t) * count);
+  atomic_init(&a.failed, false);
+  atomic_init(&a.partial, 0);
+  atomic_init(&a.upscale_ns, 0);
+  if (!keys || !sorted || !a.unique)
+  {
+    recel_free(keys);
+    recel_free(sorted);
+    recel_free(a.unique);
+    return -1;
+  }
+
+  // Group identical frames under the first of them
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    keys[i] = recel_hash_pixels(w, h, frames[i]);
+    sorted[i].key = keys[i];
+    sorted[i].index = i;
+  }
+  qsort(sorted, count, sizeof(frame_key_t), compare_keys);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (i == 0 || memcmp(&sorted[i].key, &sorted[i - 1].key,
+                         sizeof(recel_hash_t)) != 0)
+      same[sorted[i].index] = sorted[i].index;
+    else
+      same[sorted[i].index] = same[sorted[i - 1].index];
+  }
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (same[i] == i)
+      a.unique[a.unique_count++] = i;
+  }
+  recel_free(sorted);
+
+  // One run per worker: more runs use more threads, fewer runs let more
+  // frames start from the previous one
+  threadpool_t *pool = opt ? opt->pool : NULL;
+  a.keys = keys;
+  a.runs = pool ? threadpool_size(pool) : 1;
+  if (a.runs > a.unique_count)
+    a.runs = a.unique_count;
+  threadpool_parallel_for(pool, a.runs, 1, run_task, &a);
+  recel_free(keys);
+  recel_free(a.unique);
+
+  if (atomic_load(&a.failed))
+  {
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      recel_free(outputs[i]);
+      outputs[i] = NULL;
+    }
+    return -1;
+  }
+
+  if (stats)
+  {
+    stats->frames = count;
+    stats->unique = a.unique_count;
+    stats->partial = atomic_load(&a.partial);
+    stats->upscale_ns = atomic_load(&a.upscale_ns);
+  }
+  return 0;
+}
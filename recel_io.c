@@ -0,0 +1,873 @@
+#include "recel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// stb.c
+unsigned char *stb_load_gif_frames(const unsigned char *data, int size,
+                                   int *w, int *h, int *count);
+
+/* Image I/O */
+
+// Storage behind recel_image_t.pixels
+enum {
+  IMAGE_NONE,
+  IMAGE_MALLOC, // pixels owned, release with recel_free
+  IMAGE_MAPPED, // pixels point into a read-only mapping of the file
+};
+
+#define RAW_HEADER_SIZE 16
+#define QOI_HEADER_SIZE 14
+
+static const uint8_t qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+const char *recel_format_extension(recel_format_t format)
+{
+  switch (format)
+  {
+    case RECEL_FORMAT_RAW: return "raw";
+    case RECEL_FORMAT_PAM: return "pam";
+    case RECEL_FORMAT_QOI: return "qoi";
+    default: return "png";
+  }
+}
+
+recel_format_t recel_format_from_name(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  ext = ext ? ext + 1 : name;
+
+  if (strcasecmp(ext, "raw") == 0 || strcasecmp(ext, "rgba") == 0)
+    return RECEL_FORMAT_RAW;
+  if (strcasecmp(ext, "pam") == 0)
+    return RECEL_FORMAT_PAM;
+  if (strcasecmp(ext, "qoi") == 0)
+    return RECEL_FORMAT_QOI;
+  if (strcasecmp(ext, "png") == 0)
+    return RECEL_FORMAT_PNG;
+  return RECEL_FORMAT_AUTO;
+}
+
+static recel_format_t format_sniff(const uint8_t *data, size_t size)
+{
+  if (size >= RAW_HEADER_SIZE && memcmp(data, "RECL", 4) == 0)
+    return RECEL_FORMAT_RAW;
+  if (size >= 3 && data[0] == 'P' && data[1] == '7' &&
+      (data[2] == '\n' || data[2] == ' ' || data[2] == '\r'))
+    return RECEL_FORMAT_PAM;
+  if (size >= QOI_HEADER_SIZE && memcmp(data, "qoif", 4) == 0)
+    return RECEL_FORMAT_QOI;
+  return RECEL_FORMAT_PNG;
+}
+
+static bool image_size_ok(uint32_t w, uint32_t h)
+{
+  return w > 0 && h > 0 && (uint64_t)w * h <= (SIZE_MAX / 4);
+}
+
+// Raw RGBA: "RECL", width, height, channels (=4), all little-endian,
+// followed by w * h RGBA pixels.  The header keeps pixels 16-byte aligned so
+// a mapping of the file can be used in place.
+
+static int raw_decode(recel_image_t *img, const uint8_t *data, size_t size,
+                      bool in_place)
+{
+  uint32_t w = get_le32(data + 4), h = get_le32(data + 8);
+  if (get_le32(data + 12) != 4 || !image_size_ok(w, h) ||
+      size - RAW_HEADER_SIZE < (size_t)w * h * 4)
+    return -1;
+
+  img->w = w;
+  img->h = h;
+  if (in_place)
+    img->pixels = (uint32_t*)(data + RAW_HEADER_SIZE);
+  else
+  {
+    img->pixels = NEW_IMAGE(uint32_t, w, h);
+    if (!img->pixels)
+      return -1;
+    memcpy(img->pixels, data + RAW_HEADER_SIZE, (size_t)w * h * 4);
+    img->kind = IMAGE_MALLOC;
+  }
+  return 0;
+}
+
+// PAM (netpbm P7), 8-bit samples, depth 1 to 4.
+
+static const uint8_t *pam_token(const uint8_t *p, const uint8_t *end,
+                                char *tok, size_t len)
+{
+  for (;;)
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+      p++;
+    if (p < end && *p == '#')
+    {
+      while (p < end && *p != '\n')
+        p++;
+      continue;
+    }
+    break;
+  }
+
+  size_t n = 0;
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+  {
+    if (n + 1 < len)
+      tok[n++] = *p;
+    p++;
+  }
+  tok[n] = 0;
+  return p;
+}
+
+// Parse the header, returns the first sample or NULL
+static const uint8_t *pam_header(const uint8_t *data, size_t size,
+                                 uint32_t *pw, uint32_t *ph, uint32_t *pdepth)
+{
+  const uint8_t *p = data + 2, *end = data + size;
+  uint32_t w = 0, h = 0, depth = 0, maxval = 0;
+  char tok[32];
+
+  for (;;)
+  {
+    p = pam_token(p, end, tok, sizeof(tok));
+    if (tok[0] == 0)
+      return NULL;
+    if (strcmp(tok, "ENDHDR") == 0)
+      break;
+
+    if (strcmp(tok, "TUPLTYPE") == 0)
+    {
+      while (p < end && *p != '\n')
+        p++;
+      continue;
+    }
+
+    char val[32];
+    p = pam_token(p, end, val, sizeof(val));
+    uint32_t v = strtoul(val, NULL, 10);
+    if (strcmp(tok, "WIDTH") == 0)
+      w = v;
+    else if (strcmp(tok, "HEIGHT") == 0)
+      h = v;
+    else if (strcmp(tok, "DEPTH") == 0)
+      depth = v;
+    else if (strcmp(tok, "MAXVAL") == 0)
+      maxval = v;
+    else
+      return NULL;
+  }
+
+  // ENDHDR is followed by exactly one newline
+  if (p < end && *p == '\r')
+    p++;
+  if (p >= end || *p != '\n')
+    return NULL;
+  p++;
+
+  if (!image_size_ok(w, h) || depth < 1 || depth > 4 || maxval != 255)
+    return NULL;
+
+  *pw = w;
+  *ph = h;
+  *pdepth = depth;
+  return p;
+}
+
+static int pam_decode(recel_image_t *img, const uint8_t *data, size_t size,
+                      bool in_place)
+{
+  uint32_t w, h, depth;
+  const uint8_t *p = pam_header(data, size, &w, &h, &depth);
+
+  if (!p || (size_t)(data + size - p) < (size_t)w * h * depth)
+    return -1;
+
+  img->w = w;
+  img->h = h;
+
+  if (depth == 4 && in_place && ((uintptr_t)p & 3) == 0)
+  {
+    img->pixels = (uint32_t*)p;
+    return 0;
+  }
+
+  uint32_t *out = NEW_IMAGE(uint32_t, w, h);
+  if (!out)
+    return -1;
+  img->pixels = out;
+  img->kind = IMAGE_MALLOC;
+
+  if (depth == 4)
+  {
+    memcpy(out, p, (size_t)w * h * 4);
+    return 0;
+  }
+
+  uint8_t *o = (uint8_t*)out;
+  for (size_t i = 0, n = (size_t)w * h; i < n; ++i, p += depth, o += 4)
+  {
+    switch (depth)
+    {
+      case 1: o[0] = o[1] = o[2] = p[0]; o[3] = 255; break;
+      case 2: o[0] = o[1] = o[2] = p[0]; o[3] = p[1]; break;
+      case 3: o[0] = p[0]; o[1] = p[1]; o[2] = p[2]; o[3] = 255; break;
+    }
+  }
+  return 0;
+}
+
+// QOI, see https://qoiformat.org/qoi-specification.pdf
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK     0xc0
+
+#define QOI_HASH(c) (((c)[0] * 3 + (c)[1] * 5 + (c)[2] * 7 + (c)[3] * 11) & 63)
+
+static int qoi_decode(recel_image_t *img, const uint8_t *data, size_t size)
+{
+  uint32_t w = get_be32(data + 4), h = get_be32(data + 8);
+  uint8_t channels = data[12];
+  if (!image_size_ok(w, h) || (channels != 3 && channels != 4))
+    return -1;
+
+  uint32_t *out = NEW_IMAGE(uint32_t, w, h);
+  if (!out)
+    return -1;
+
+  uint8_t index[64][4];
+  uint8_t px[4] = {0, 0, 0, 255};
+  memset(index, 0, sizeof(index));
+
+  const uint8_t *p = data + QOI_HEADER_SIZE;
+  const uint8_t *end = data + size - sizeof(qoi_padding);
+  uint8_t *o = (uint8_t*)out;
+  int run = 0;
+
+  for (size_t i = 0, n = (size_t)w * h; i < n; ++i, o += 4)
+  {
+    if (run > 0)
+      run--;
+    else if (p < end)
+    {
+      uint8_t b1 = *p++;
+
+      if (b1 == QOI_OP_RGB)
+      {
+        if (end - p < 3)
+          break;
+        px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+        p += 3;
+      }
+      else if (b1 == QOI_OP_RGBA)
+      {
+        if (end - p < 4)
+          break;
+        memcpy(px, p, 4);
+        p += 4;
+      }
+      else if ((b1 & QOI_MASK) == QOI_OP_INDEX)
+        memcpy(px, index[b1], 4);
+      else if ((b1 & QOI_MASK) == QOI_OP_DIFF)
+      {
+        px[0] += ((b1 >> 4) & 3) - 2;
+        px[1] += ((b1 >> 2) & 3) - 2;
+        px[2] += (b1 & 3) - 2;
+      }
+      else if ((b1 & QOI_MASK) == QOI_OP_LUMA)
+      {
+        if (p >= end)
+          break;
+        uint8_t b2 = *p++;
+        int vg = (b1 & 0x3f) - 32;
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0f);
+      }
+      else
+        run = b1 & 0x3f;
+
+      memcpy(index[QOI_HASH(px)], px, 4);
+    }
+    else
+      break;
+
+    memcpy(o, px, 4);
+  }
+
+  if (o != (uint8_t*)out + (size_t)w * h * 4)
+  {
+    recel_free(out);
+    return -1;
+  }
+
+  img->w = w;
+  img->h = h;
+  img->pixels = out;
+  img->kind = IMAGE_MALLOC;
+  return 0;
+}
+
+static uint8_t *qoi_encode(uint32_t w, uint32_t h, const uint32_t *pixels,
+                           size_t *out_size)
+{
+  size_t n = (size_t)w * h;
+  uint8_t *buf = recel_malloc(QOI_HEADER_SIZE + n * 5 + sizeof(qoi_padding));
+  if (!buf)
+    return NULL;
+
+  memcpy(buf, "qoif", 4);
+  put_be32(buf + 4, w);
+  put_be32(buf + 8, h);
+  buf[12] = 4; // channels
+  buf[13] = 0; // sRGB with linear alpha
+
+  uint8_t index[64][4];
+  uint8_t prev[4] = {0, 0, 0, 255};
+  memset(index, 0, sizeof(index));
+
+  uint8_t *o = buf + QOI_HEADER_SIZE;
+  const uint8_t *px = (const uint8_t*)pixels;
+  int run = 0;
+
+  for (size_t i = 0; i < n; ++i, px += 4)
+  {
+    if (memcmp(px, prev, 4) == 0)
+    {
+      run++;
+      if (run == 62 || i == n - 1)
+      {
+        *o++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0)
+    {
+      *o++ = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    int hash = QOI_HASH(px);
+    if (memcmp(index[hash], px, 4) == 0)
+      *o++ = QOI_OP_INDEX | hash;
+    else
+    {
+      memcpy(index[hash], px, 4);
+
+      if (px[3] == prev[3])
+      {
+        int8_t vr = px[0] - prev[0];
+        int8_t vg = px[1] - prev[1];
+        int8_t vb = px[2] - prev[2];
+        int8_t vg_r = vr - vg;
+        int8_t vg_b = vb - vg;
+
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+          *o++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                 vg_b > -9 && vg_b < 8)
+        {
+          *o++ = QOI_OP_LUMA | (vg + 32);
+          *o++ = (vg_r + 8) << 4 | (vg_b + 8);
+        }
+        else
+        {
+          *o++ = QOI_OP_RGB;
+          *o++ = px[0]; *o++ = px[1]; *o++ = px[2];
+        }
+      }
+      else
+      {
+        *o++ = QOI_OP_RGBA;
+        memcpy(o, px, 4);
+        o += 4;
+      }
+    }
+
+    memcpy(prev, px, 4);
+  }
+
+  memcpy(o, qoi_padding, sizeof(qoi_padding));
+  o += sizeof(qoi_padding);
+
+  *out_size = o - buf;
+  return buf;
+}
+
+// Decoding
+
+int recel_image_decode(recel_image_t *img, const void *data, size_t size,
+                       recel_format_t format)
+{
+  memset(img, 0, sizeof(*img));
+
+  if (format == RECEL_FORMAT_AUTO)
+    format = format_sniff(data, size);
+
+  switch (format)
+  {
+    case RECEL_FORMAT_RAW:
+      if (size < RAW_HEADER_SIZE || memcmp(data, "RECL", 4) != 0)
+        return -1;
+      return raw_decode(img, data, size, false);
+
+    case RECEL_FORMAT_PAM:
+      if (format_sniff(data, size) != RECEL_FORMAT_PAM)
+        return -1;
+      return pam_decode(img, data, size, false);
+
+    case RECEL_FORMAT_QOI:
+      if (size < QOI_HEADER_SIZE + sizeof(qoi_padding) ||
+          memcmp(data, "qoif", 4) != 0)
+        return -1;
+      return qoi_decode(img, data, size);
+
+    default:
+    {
+      int w, h, n;
+      if (size > INT32_MAX)
+        return -1;
+      img->pixels = (uint32_t*)stbi_load_from_memory(data, size, &w, &h, &n, 4);
+      if (!img->pixels)
+        return -1;
+      img->w = w;
+      img->h = h;
+      img->kind = IMAGE_MALLOC;
+      return 0;
+    }
+  }
+}
+
+static int read_stream(recel_image_t *img, int fd, recel_format_t format)
+{
+  size_t size = 0, capacity = 1 << 16;
+  uint8_t *buf = recel_malloc(capacity);
+
+  for (;;)
+  {
+    if (!buf)
+      return -1;
+    if (size == capacity)
+    {
+      uint8_t *grown = recel_realloc(buf, capacity * 2);
+      if (!grown)
+        break;
+      buf = grown;
+      capacity *= 2;
+    }
+
+    ssize_t n = read(fd, buf + size, capacity - size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    if (n == 0)
+    {
+      int result = size > 0 ? recel_image_decode(img, buf, size, format) : -1;
+      recel_free(buf);
+      return result;
+    }
+    size += n;
+  }
+
+  recel_free(buf);
+  return -1;
+}
+
+int recel_image_read(recel_image_t *img, int fd, recel_format_t format)
+{
+  memset(img, 0, sizeof(*img));
+
+  // Pipes and sockets cannot be mapped
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (!S_ISREG(st.st_mode))
+    return read_stream(img, fd, format);
+  if (st.st_size == 0)
+    return -1;
+
+  size_t size = st.st_size;
+  uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+
+  if (format == RECEL_FORMAT_AUTO)
+    format = format_sniff(map, size);
+
+  // Raw and 4-channel PAM files are used in place
+  int result;
+  if (format == RECEL_FORMAT_RAW && format_sniff(map, size) == format)
+  {
+    madvise(map, size, MADV_WILLNEED);
+    result = raw_decode(img, map, size, true);
+  }
+  else if (format == RECEL_FORMAT_PAM && format_sniff(map, size) == format)
+    result = pam_decode(img, map, size, true);
+  else
+    result = recel_image_decode(img, map, size, format);
+
+  if (result == 0 && img->kind == IMAGE_NONE)
+  {
+    img->kind = IMAGE_MAPPED;
+    img->base = map;
+    img->size = size;
+  }
+  else
+    munmap(map, size);
+
+  return result;
+}
+
+int recel_image_load(recel_image_t *img, const char *path,
+                     recel_format_t format)
+{
+  memset(img, 0, sizeof(*img));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  int result = recel_image_read(img, fd, format);
+  close(fd);
+  return result;
+}
+
+int recel_image_info(const char *path, uint32_t *w, uint32_t *h)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = st.st_size;
+  uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  int result = 0;
+  uint32_t depth;
+  switch (format_sniff(map, size))
+  {
+    case RECEL_FORMAT_RAW:
+      *w = get_le32(map + 4);
+      *h = get_le32(map + 8);
+      break;
+
+    case RECEL_FORMAT_PAM:
+      if (!pam_header(map, size, w, h, &depth))
+        result = -1;
+      break;
+
+    case RECEL_FORMAT_QOI:
+      *w = get_be32(map + 4);
+      *h = get_be32(map + 8);
+      break;
+
+    default:
+    {
+      int iw, ih, n;
+      if (size <= INT32_MAX && stbi_info_from_memory(map, size, &iw, &ih, &n))
+      {
+        *w = iw;
+        *h = ih;
+      }
+      else
+        result = -1;
+    }
+  }
+
+  munmap(map, size);
+  return result;
+}
+
+int recel_image_load_frames(recel_image_t *img, const char *path,
+                            uint32_t *count)
+{
+  memset(img, 0, sizeof(*img));
+  *count = 1;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= 6 && st.st_size <= INT32_MAX)
+  {
+    size_t size = st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      int w, h, n;
+      uint8_t *frames = NULL;
+      if (memcmp(map, "GIF8", 4) == 0)
+        frames = stb_load_gif_frames(map, size, &w, &h, &n);
+      munmap(map, size);
+
+      if (frames)
+      {
+        close(fd);
+        img->w = w;
+        img->h = h;
+        img->pixels = (uint32_t*)frames;
+        img->kind = IMAGE_MALLOC;
+        *count = n;
+        return 0;
+      }
+    }
+  }
+
+  int result = recel_image_read(img, fd, RECEL_FORMAT_AUTO);
+  close(fd);
+  return result;
+}
+
+void recel_image_release(recel_image_t *img)
+{
+  if (img->kind == IMAGE_MALLOC)
+    recel_free(img->pixels);
+  else if (img->kind == IMAGE_MAPPED)
+    munmap(img->base, img->size);
+  memset(img, 0, sizeof(*img));
+}
+
+// Encoding
+
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (uint8_t*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+struct png_writer {
+  int fd;
+  int result;
+};
+
+static void png_write_func(void *context, void *data, int size)
+{
+  struct png_writer *wr = context;
+  struct iovec iov = { data, size };
+  if (wr->result == 0)
+    wr->result = write_all(wr->fd, &iov, 1);
+}
+
+int recel_image_write(int fd, recel_format_t format,
+                      uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  size_t bytes = (size_t)w * h * 4;
+
+  switch (format)
+  {
+    case RECEL_FORMAT_RAW:
+    {
+      uint8_t header[RAW_HEADER_SIZE];
+      memcpy(header, "RECL", 4);
+      put_le32(header + 4, w);
+      put_le32(header + 8, h);
+      put_le32(header + 12, 4);
+      struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void*)pixels, bytes },
+      };
+      return write_all(fd, iov, 2);
+    }
+
+    case RECEL_FORMAT_PAM:
+    {
+      char header[128];
+      int len = snprintf(header, sizeof(header),
+          "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+          "TUPLTYPE RGB_ALPHA\nENDHDR\n", w, h);
+      struct iovec iov[2] = {
+        { header, len },
+        { (void*)pixels, bytes },
+      };
+      return write_all(fd, iov, 2);
+    }
+
+    case RECEL_FORMAT_QOI:
+    {
+      size_t size;
+      uint8_t *buf = qoi_encode(w, h, pixels, &size);
+      if (!buf)
+        return -1;
+      struct iovec iov = { buf, size };
+      int result = write_all(fd, &iov, 1);
+      recel_free(buf);
+      return result;
+    }
+
+    default:
+    {
+      struct png_writer wr = { fd, 0 };
+      if (!stbi_write_png_to_func(png_write_func, &wr, w, h, 4, pixels, 0))
+        return -1;
+      return wr.result;
+    }
+  }
+}
+
+struct mem_writer {
+  uint8_t *data;
+  size_t size, capacity;
+};
+
+static void mem_write_func(void *context, void *data, int size)
+{
+  struct mem_writer *wr = context;
+  if (!wr->data)
+    return;
+
+  if (wr->size + size > wr->capacity)
+  {
+    while (wr->size + size > wr->capacity)
+      wr->capacity *= 2;
+    uint8_t *grown = recel_realloc(wr->data, wr->capacity);
+    if (!grown)
+    {
+      recel_free(wr->data);
+      wr->data = NULL;
+      return;
+    }
+    wr->data = grown;
+  }
+
+  memcpy(wr->data + wr->size, data, size);
+  wr->size += size;
+}
+
+void *recel_image_encode(recel_format_t format, uint32_t w, uint32_t h,
+                         const uint32_t *pixels, size_t *size)
+{
+  size_t bytes = (size_t)w * h * 4;
+
+  switch (format)
+  {
+    case RECEL_FORMAT_RAW:
+    {
+      uint8_t *buf = recel_malloc(RAW_HEADER_SIZE + bytes);
+      if (!buf)
+        return NULL;
+      memcpy(buf, "RECL", 4);
+      put_le32(buf + 4, w);
+      put_le32(buf + 8, h);
+      put_le32(buf + 12, 4);
+      memcpy(buf + RAW_HEADER_SIZE, pixels, bytes);
+      *size = RAW_HEADER_SIZE + bytes;
+      return buf;
+    }
+
+    case RECEL_FORMAT_PAM:
+    {
+      char header[128];
+      int len = snprintf(header, sizeof(header),
+          "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+          "TUPLTYPE RGB_ALPHA\nENDHDR\n", w, h);
+      uint8_t *buf = recel_malloc(len + bytes);
+      if (!buf)
+        return NULL;
+      memcpy(buf, header, len);
+      memcpy(buf + len, pixels, bytes);
+      *size = len + bytes;
+      return buf;
+    }
+
+    case RECEL_FORMAT_QOI:
+      return qoi_encode(w, h, pixels, size);
+
+    default:
+    {
+      struct mem_writer wr = { recel_malloc(1 << 16), 0, 1 << 16 };
+      if (!stbi_write_png_to_func(mem_write_func, &wr, w, h, 4, pixels, 0))
+      {
+        recel_free(wr.data);
+        return NULL;
+      }
+      *size = wr.size;
+      return wr.data;
+    }
+  }
+}
+
+int recel_image_save(const char *path, recel_format_t format,
+                     uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  if (format == RECEL_FORMAT_AUTO)
+    format = recel_format_from_name(path);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+
+  int result = recel_image_write(fd, format, w, h, pixels);
+  if (close(fd) < 0)
+    result = -1;
+  return result;
+}
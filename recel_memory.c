@@ -0,0 +1,187 @@
+#include "recel.h"
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "memory.h"
+
+/* Heap accounting */
+
+// Sizes are the usable sizes reported by the allocator, so that a buffer
+// is accounted for the same amount when it is freed
+static atomic_ullong live, peak, allocs, alloc_bytes;
+
+static void raise_peak(uint64_t now)
+{
+  uint64_t old = atomic_load(&peak);
+  while (now > old && !atomic_compare_exchange_weak(&peak, &old, now))
+    ;
+}
+
+static void *note_alloc(void *p)
+{
+  if (p)
+  {
+    uint64_t size = malloc_usable_size(p);
+    raise_peak(atomic_fetch_add(&live, size) + size);
+    atomic_fetch_add(&allocs, 1);
+    atomic_fetch_add(&alloc_bytes, size);
+  }
+  return p;
+}
+
+void *recel_malloc(size_t size)
+{
+  return note_alloc(malloc(size));
+}
+
+void *recel_calloc(size_t count, size_t size)
+{
+  return note_alloc(calloc(count, size));
+}
+
+void *recel_realloc(void *p, size_t size)
+{
+  size_t old = p ? malloc_usable_size(p) : 0;
+  void *q = realloc(p, size);
+  if (!q && size > 0)
+    return NULL;
+
+  atomic_fetch_sub(&live, old);
+  if (!q)
+    return NULL;
+  uint64_t now = malloc_usable_size(q);
+  raise_peak(atomic_fetch_add(&live, now) + now);
+  atomic_fetch_add(&allocs, 1);
+  atomic_fetch_add(&alloc_bytes, now);
+  return q;
+}
+
+void recel_free(void *p)
+{
+  if (p)
+  {
+    atomic_fetch_sub(&live, malloc_usable_size(p));
+    free(p);
+  }
+}
+
+void recel_memory_get(recel_memory_t *m)
+{
+  m->live_bytes = atomic_load(&live);
+  m->peak_bytes = atomic_load(&peak);
+  m->allocs = atomic_load(&allocs);
+  m->alloc_bytes = atomic_load(&alloc_bytes);
+}
+
+void recel_memory_reset_peak(void)
+{
+  atomic_store(&peak, atomic_load(&live));
+}
+
+uint64_t memory_mark(void)
+{
+  recel_memory_reset_peak();
+  return atomic_load(&allocs);
+}
+
+void memory_stage(recel_stage_stats_t *stage, uint64_t *mark)
+{
+  uint64_t count = atomic_load(&allocs);
+  uint64_t high = atomic_exchange(&peak, atomic_load(&live));
+  stage->allocs += count - *mark;
+  if (high > stage->peak_bytes)
+    stage->peak_bytes = high;
+  *mark = count;
+}
+
+/* Arenas */
+
+#define HUGE_PAGE (2 << 20)
+#define CACHE_LINE 64
+
+static size_t round_up(size_t n, size_t unit)
+{
+  return (n + unit - 1) / unit * unit;
+}
+
+static void *map_pages(size_t size, recel_pages_t pages)
+{
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // Explicit huge pages are reserved by the administrator
+  // (vm.nr_hugepages) and often missing: fall back to transparent ones
+  if (pages == RECEL_PAGES_HUGETLB)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED)
+  {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  return p;
+}
+
+int memory_arena_new(memory_arena_t *arena, size_t size, recel_pages_t pages)
+{
+  arena->mapped = pages != RECEL_PAGES_DEFAULT && size >= HUGE_PAGE;
+  if (!arena->mapped)
+  {
+    arena->size = size;
+    arena->base = recel_malloc(size > 0 ? size : 1);
+    return arena->base ? 0 : -1;
+  }
+
+  arena->size = round_up(size, HUGE_PAGE);
+  arena->base = map_pages(arena->size, pages);
+  if (!arena->base)
+    return -1;
+  raise_peak(atomic_fetch_add(&live, arena->size) + arena->size);
+  atomic_fetch_add(&allocs, 1);
+  atomic_fetch_add(&alloc_bytes, arena->size);
+  return 0;
+}
+
+void memory_arena_delete(memory_arena_t *arena)
+{
+  if (!arena->base)
+    return;
+  if (arena->mapped)
+  {
+    munmap(arena->base, arena->size);
+    atomic_fetch_sub(&live, arena->size);
+  }
+  else
+    recel_free(arena->base);
+  arena->base = NULL;
+}
+
+uint32_t *memory_arena_take(memory_arena_t *arena, size_t *offset, size_t n)
+{
+  uint32_t *p = (uint32_t*)((char*)arena->base + *offset);
+  *offset += round_up(n * sizeof(uint32_t), CACHE_LINE);
+  return p;
+}
+
+size_t memory_arena_bytes(const size_t *pixels, int count)
+{
+  size_t size = 0;
+  for (int i = 0; i < count; ++i)
+    size += round_up(pixels[i] * sizeof(uint32_t), CACHE_LINE);
+  return size;
+}
+
+void memory_faults(uint64_t *minor, uint64_t *major)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  *minor = ru.ru_minflt;
+  *major = ru.ru_majflt;
+}
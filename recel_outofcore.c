@@ -0,0 +1,615 @@
+#include "recel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "fasttable.h"
+#include "memory.h"
+#include "trace.h"
+
+/* Out-of-core distance map.
+ * The input and the distance map are copied into square tiles of a temp
+ * file, with the worklists next to them, and only the tiles being worked
+ * on have to be in memory.
+ * The in-memory engine chains its worklists through the distance map and
+ * walks them generation by generation in list order, which can jump
+ * anywhere in the image.  Here a level is searched in rounds: each tile
+ * with pending pixels is paged in once per round and searched breadth
+ * first from them until the frontier leaves it, and the pixels it reaches
+ * in other tiles wait for the next round.  Which generation a pixel belongs
+ * to does not depend on the order of the search, so this gives the same
+ * generations.  The order still matters, since colors are ranked by count,
+ * then by first push: in memory an item is pushed by its neighbour that
+ * comes first in list order (position, then neighbour index), so the
+ * pushes of each generation are listed once the search is over, and the
+ * lists are rebuilt generation by generation by sorting them, without
+ * going back to the tiles.  Colors are then counted in the same order as
+ * in memory, and the distances are identical.
+ */
+
+#define TILE 64
+#define UNREACHED 0x7FFFFFFFu // generation of pixels not reached yet
+#define PENDING 0x80000000u   // flag of pixels waiting for the next round
+
+typedef struct {
+  uint32_t color;
+  int32_t dist; // >0 distance, 0 not pushed yet, <0 ~serial of its push
+  uint32_t gen; // generation within its level, maybe | PENDING
+} cell_t;
+
+#define GEN(c) ((c)->gen & ~PENDING)
+
+// Items are key << 30 | y << 15 | x: sorting them sorts by key
+#define ITEM(key, x, y) (((uint64_t)(key) << 30) | ((uint64_t)(y) << 15) | (x))
+#define ITEM_X(i) ((uint32_t)(i) & 0x7FFF)
+#define ITEM_Y(i) ((uint32_t)((i) >> 15) & 0x7FFF)
+#define ITEM_PIXEL(i) ((uint32_t)(i) & 0x3FFFFFFF)
+
+typedef struct {
+  uint32_t w, h, tiles_w;
+  cell_t *cells;
+  uint64_t *items;   // current level, one generation after the other
+  uint64_t *next;    // next level
+  uint64_t *order;   // items of a generation or level, by tile
+  uint64_t *work;    // pending pixels of two rounds, then pushes of a level
+  uint32_t *colors;  // colors of the items of the current level
+  uint64_t *seeds;   // in memory: pending pixels of a tile
+  uint64_t *queue;   // in memory: frontier inside a tile
+  uint32_t serial;   // pushes so far
+  void *map;
+  size_t size;
+} ooc_t;
+
+// Neighbours in the order of distance_propagate
+static const int dx8[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+static const int dy8[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+
+static uint64_t tile_of(const ooc_t *o, uint32_t x, uint32_t y)
+{
+  return (uint64_t)(y / TILE) * o->tiles_w + x / TILE;
+}
+
+static cell_t *cell_at(const ooc_t *o, uint32_t x, uint32_t y)
+{
+  size_t tile = tile_of(o, x, y);
+  return &o->cells[tile * TILE * TILE + (y % TILE) * TILE + x % TILE];
+}
+
+// Sort in place on the highest byte of the bits that differ, then on the
+// next bytes within each range, small ranges by insertion.  Unlike qsort,
+// it needs no scratch as large as the list, and it goes through the list
+// in order.
+static void sort_u64(uint64_t *a, size_t n)
+{
+  if (n < 32)
+  {
+    for (size_t i = 1; i < n; ++i)
+    {
+      uint64_t v = a[i];
+      size_t j = i;
+      for (; j > 0 && a[j - 1] > v; --j)
+        a[j] = a[j - 1];
+      a[j] = v;
+    }
+    return;
+  }
+
+  uint64_t differ = 0;
+  for (size_t i = 1; i < n; ++i)
+    differ |= a[i] ^ a[0];
+  if (differ == 0)
+    return;
+  int top = 63 - __builtin_clzll(differ);
+  int shift = top >= 7 ? top - 7 : 0;
+
+  size_t start[257] = { 0 }, next[256];
+  for (size_t i = 0; i < n; ++i)
+    start[((a[i] >> shift) & 255) + 1] += 1;
+  for (int b = 0; b < 256; ++b)
+  {
+    start[b + 1] += start[b];
+    next[b] = start[b];
+  }
+
+  // Move each item to the range of its byte, cycle after cycle
+  for (int b = 0; b < 256; ++b)
+  {
+    while (next[b] < start[b + 1])
+    {
+      uint64_t v = a[next[b]];
+      int d = (v >> shift) & 255;
+      while (d != b)
+      {
+        uint64_t t = a[next[d]];
+        a[next[d]++] = v;
+        v = t;
+        d = (v >> shift) & 255;
+      }
+      a[next[b]++] = v;
+    }
+  }
+
+  if (shift > 0)
+    for (int b = 0; b < 256; ++b)
+      sort_u64(a + start[b], start[b + 1] - start[b]);
+}
+
+static void ooc_close(ooc_t *o)
+{
+  recel_free(o->seeds);
+  recel_free(o->queue);
+  if (o->map != MAP_FAILED)
+    munmap(o->map, o->size);
+}
+
+// Unlinked temp file in dir holding the tiles, the lists and the scratch
+// order, and the buffers of a tile in memory
+static int ooc_open(ooc_t *o, uint32_t w, uint32_t h, const char *dir)
+{
+  o->w = w;
+  o->h = h;
+  o->tiles_w = (w + TILE - 1) / TILE;
+  size_t tiles = (size_t)o->tiles_w * ((h + TILE - 1) / TILE);
+  size_t cells = tiles * TILE * TILE * sizeof(cell_t);
+  size_t list = (size_t)w * h * sizeof(uint64_t);
+  // Lists of w * h items: the level, the next one, the order and the work
+  // area, which holds 4 of them since the pushes of a level join pairs of
+  // neighbours, fewer than 4 per pixel
+  o->size = cells + 7 * list + (size_t)w * h * sizeof(uint32_t);
+  o->map = MAP_FAILED;
+  o->seeds = recel_malloc(sizeof(uint64_t) * TILE * TILE);
+  o->queue = recel_malloc(sizeof(uint64_t) * TILE * TILE);
+  char *path = recel_malloc(strlen(dir) + sizeof("/recel-XXXXXX"));
+  if (!o->seeds || !o->queue || !path)
+  {
+    recel_free(path);
+    ooc_close(o);
+    return -1;
+  }
+  sprintf(path, "%s/recel-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd >= 0)
+    unlink(path);
+  recel_free(path);
+  if (fd >= 0 && ftruncate(fd, o->size) == 0)
+    o->map = mmap(NULL, o->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (o->map == MAP_FAILED)
+  {
+    ooc_close(o);
+    return -1;
+  }
+
+  o->cells = o->map;
+  o->items = (uint64_t*)((char*)o->map + cells);
+  o->next = o->items + (size_t)w * h;
+  o->order = o->next + (size_t)w * h;
+  o->work = o->order + (size_t)w * h;
+  o->colors = (uint32_t*)(o->work + 4 * (size_t)w * h);
+  o->serial = 0;
+  return 0;
+}
+
+// Push (x, y) to list, whose first item is serial base: when several
+// pixels push it, the lowest key, first in list order, wins
+static void offer(ooc_t *o, uint64_t *list, uint32_t base, uint32_t *count,
+                  cell_t *c, uint32_t x, uint32_t y, uint64_t key)
+{
+  uint64_t item = ITEM(key, x, y);
+  if (c->dist == 0 && c->gen == UNREACHED)
+  {
+    c->dist = ~(int32_t)(base + *count);
+    list[(*count)++] = item;
+    o->serial += 1;
+  }
+  else if (c->dist < 0 && (uint32_t)~c->dist >= base)
+  {
+    uint64_t *pushed = &list[(uint32_t)~c->dist - base];
+    if (item < *pushed)
+      *pushed = item;
+  }
+}
+
+// Items of list in o->order, by tile then position
+static void tile_order(ooc_t *o, const uint64_t *list, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    o->order[i] = tile_of(o, ITEM_X(list[i]), ITEM_Y(list[i])) << 32 | i;
+  sort_u64(o->order, n);
+}
+
+static void reverse(uint64_t *list, uint32_t n)
+{
+  for (uint32_t i = 0, j = n; i + 1 < j; ++i, --j)
+  {
+    uint64_t t = list[i];
+    list[i] = list[j - 1];
+    list[j - 1] = t;
+  }
+}
+
+// Sort the pushes of a list by key, which is their order in memory, and
+// count their colors in that order
+static void finish(ooc_t *o, uint64_t *list, uint32_t n,
+                   colorcounter_t *counter)
+{
+  sort_u64(list, n);
+  for (uint32_t i = 0; i < n; ++i)
+    colorcounter_incr(counter, cell_at(o, ITEM_X(list[i]), ITEM_Y(list[i]))->color);
+}
+
+// Copy the input into the tiles and push the borders, as distance_init
+static uint32_t ooc_init(ooc_t *o, const uint32_t *input,
+                         colorcounter_t *counter)
+{
+  uint32_t w = o->w, h = o->h;
+  for (uint32_t y = 0; y < h; ++y)
+  {
+    for (uint32_t x = 0; x < w; ++x)
+    {
+      cell_t *c = cell_at(o, x, y);
+      c->color = input[(size_t)y * w + x];
+      c->dist = 0;
+      c->gen = UNREACHED;
+    }
+  }
+
+  uint32_t n = 0;
+  colorcounter_start(counter);
+  for (uint32_t i = 0; i < w; ++i)
+  {
+    offer(o, o->items, 0, &n, cell_at(o, i, 0), i, 0, n);
+    if (h > 1)
+      offer(o, o->items, 0, &n, cell_at(o, i, h - 1), i, h - 1, n);
+  }
+  for (uint32_t j = 1; j + 1 < h; ++j)
+  {
+    offer(o, o->items, 0, &n, cell_at(o, 0, j), 0, j, n);
+    if (w > 1)
+      offer(o, o->items, 0, &n, cell_at(o, w - 1, j), w - 1, j, n);
+  }
+  finish(o, o->items, n, counter);
+  return n;
+}
+
+// Search a tile breadth first from its seeds, n items of generation and
+// position, each pixel being labelled with its lowest generation so far.
+// New pixels are added to members, pixels of other tiles to pending.
+static void search_tile(ooc_t *o, uint32_t n, uint64_t *pending,
+                        uint32_t *pending_count, uint64_t *members,
+                        uint32_t *member_count)
+{
+  uint64_t *seeds = o->seeds, *queue = o->queue;
+  uint32_t head = 0, tail = 0, s = 0;
+
+  // Seeds join the queue in generation order, so each pixel is labelled
+  // for good the first time it is reached, and queued once
+  sort_u64(seeds, n);
+  while (s < n || head < tail)
+  {
+    uint64_t item;
+    if (s < n && (head == tail || seeds[s] >> 30 <= queue[head] >> 30))
+      item = seeds[s++];
+    else
+      item = queue[head++];
+    uint32_t x = ITEM_X(item), y = ITEM_Y(item), gen = item >> 30;
+    cell_t *c = cell_at(o, x, y);
+    if (GEN(c) != gen)
+      continue; // reached sooner since it was seeded
+
+    for (int k = 0; k < 8; ++k)
+    {
+      uint32_t nx = x + dx8[k], ny = y + dy8[k];
+      if (nx >= o->w || ny >= o->h)
+        continue;
+      cell_t *reached = cell_at(o, nx, ny);
+      if (reached->color != c->color || reached->dist != 0 ||
+          GEN(reached) <= gen + 1)
+        continue;
+      if (GEN(reached) == UNREACHED)
+        members[(*member_count)++] = ITEM(0, nx, ny);
+      reached->gen = (gen + 1) | (reached->gen & PENDING);
+      if (tile_of(o, nx, ny) == tile_of(o, x, y))
+        queue[tail++] = ITEM(gen + 1, nx, ny);
+      else if (!(reached->gen & PENDING))
+      {
+        reached->gen |= PENDING;
+        pending[(*pending_count)++] = ITEM(0, nx, ny);
+      }
+    }
+  }
+}
+
+// Flood each generation into the next one, as distance_propagate.  Returns
+// the size of the level, which is then in list order: last generation
+// first
+static uint32_t ooc_propagate(ooc_t *o, uint32_t n, colorcounter_t *counter)
+{
+  size_t pixels = (size_t)o->w * o->h;
+  uint64_t *members = o->items + n, *pending = o->work;
+  uint32_t member_count = 0, pending_count = 0;
+
+  // First round, from the first generation
+  tile_order(o, o->items, n);
+  for (uint32_t i = 0; i < n;)
+  {
+    uint32_t seeds = 0;
+    for (uint64_t tile = o->order[i] >> 32;
+         i < n && o->order[i] >> 32 == tile; ++i)
+    {
+      uint32_t index = (uint32_t)o->order[i];
+      uint32_t x = ITEM_X(o->items[index]), y = ITEM_Y(o->items[index]);
+      cell_t *c = cell_at(o, x, y);
+      c->gen = 0;
+      o->colors[index] = c->color;
+      o->seeds[seeds++] = ITEM(0, x, y);
+    }
+    search_tile(o, seeds, pending, &pending_count, members, &member_count);
+  }
+
+  // Next rounds, from the pixels reached across tile borders, which are
+  // listed in one half of the work area while the other one is filled
+  for (int round = 1; pending_count > 0; ++round)
+  {
+    uint64_t *seeded = pending;
+    uint32_t count = pending_count;
+    pending = o->work + (round % 2) * pixels;
+    pending_count = 0;
+    tile_order(o, seeded, count);
+    for (uint32_t i = 0; i < count;)
+    {
+      uint32_t seeds = 0;
+      for (uint64_t tile = o->order[i] >> 32;
+           i < count && o->order[i] >> 32 == tile; ++i)
+      {
+        uint64_t item = seeded[(uint32_t)o->order[i]];
+        cell_t *c = cell_at(o, ITEM_X(item), ITEM_Y(item));
+        c->gen &= ~PENDING;
+        o->seeds[seeds++] = ITEM(c->gen, ITEM_X(item), ITEM_Y(item));
+      }
+      search_tile(o, seeds, pending, &pending_count, members,
+                  &member_count);
+    }
+  }
+
+  // Pushes in memory: each pixel from every neighbour of the previous
+  // generation, as generation << 33 | pusher << 3 | neighbour index
+  uint64_t *pushes = o->work;
+  uint32_t push_count = 0;
+  tile_order(o, members, member_count);
+  for (uint32_t i = 0; i < member_count; ++i)
+  {
+    uint64_t item = members[(uint32_t)o->order[i]];
+    uint32_t x = ITEM_X(item), y = ITEM_Y(item);
+    cell_t *c = cell_at(o, x, y);
+    for (int k = 0; k < 8; ++k)
+    {
+      uint32_t px = x - dx8[k], py = y - dy8[k];
+      if (px >= o->w || py >= o->h)
+        continue;
+      cell_t *p = cell_at(o, px, py);
+      if (p->color == c->color && p->dist <= 0 && GEN(p) + 1 == GEN(c))
+        pushes[push_count++] = (uint64_t)GEN(c) << 33 |
+                               (uint64_t)ITEM(0, px, py) << 3 | k;
+    }
+  }
+  sort_u64(pushes, push_count);
+
+  // Each generation, from the positions of the previous one in list order
+  uint32_t start = 0, end = n;
+  for (uint32_t i = 0; i < push_count;)
+  {
+    uint32_t gen = pushes[i] >> 33, first = i, length = end - start;
+    for (uint32_t j = 0; j < length; ++j)
+      o->order[j] = (uint64_t)ITEM_PIXEL(o->items[start + j]) << 32 |
+                    (length - 1 - j);
+    sort_u64(o->order, length);
+
+    // Pushes are sorted by pusher too: turn them into pixel << 33 | key
+    for (uint32_t j = 0; i < push_count && pushes[i] >> 33 == gen; ++i)
+    {
+      uint32_t pusher = (uint32_t)(pushes[i] >> 3) & 0x3FFFFFFF;
+      int k = pushes[i] & 7;
+      while (o->order[j] >> 32 != pusher)
+        ++j;
+      uint64_t key = (uint64_t)(uint32_t)o->order[j] * 8 + k;
+      uint32_t x = ITEM_X(pusher) + dx8[k], y = ITEM_Y(pusher) + dy8[k];
+      pushes[i] = (uint64_t)ITEM(0, x, y) << 33 | key;
+    }
+
+    // The first push of each pixel, which has its lowest key, then the
+    // colors of the generation in push order
+    sort_u64(pushes + first, i - first);
+    uint32_t count = 0;
+    for (uint32_t j = first; j < i; ++j)
+    {
+      uint32_t pixel = pushes[j] >> 33;
+      if (j == first || pixel != pushes[j - 1] >> 33)
+        o->items[end + count++] = ITEM(pushes[j] & 0x1FFFFFFFF,
+                                       ITEM_X(pixel), ITEM_Y(pixel));
+    }
+    sort_u64(o->items + end, count);
+    for (uint32_t j = end; j < end + count; ++j)
+    {
+      uint32_t pos = (uint32_t)(o->items[j] >> 33);
+      o->colors[j] = o->colors[start + length - 1 - pos];
+      colorcounter_incr(counter, o->colors[j]);
+    }
+    start = end;
+    end += count;
+  }
+
+  reverse(o->items, end);
+  return end;
+}
+
+// Number the level and push the next one, as distance_nextlevel.  A color
+// first pushed by this level ranks as the index it was given if the push
+// came before the lookup in list order, and -1 otherwise.  Replaces *n by
+// the size of the next level.  Returns 0 on success, -1 if out of memory.
+static int ooc_nextlevel(ooc_t *o, uint32_t *n, colorcounter_t *counter,
+                         int32_t level)
+{
+  static const int dx[4] = { 0, -1, 1, 0 };
+  static const int dy[4] = { -1, 0, 0, 1 };
+  uint32_t base = o->serial, count = 0;
+
+  tile_order(o, o->items, *n);
+  for (uint32_t i = 0; i < *n; ++i)
+  {
+    uint32_t pos = (uint32_t)o->order[i];
+    uint32_t x = ITEM_X(o->items[pos]), y = ITEM_Y(o->items[pos]);
+    for (int k = 0; k < 4; ++k)
+    {
+      uint32_t nx = x + dx[k], ny = y + dy[k];
+      if (nx < o->w && ny < o->h)
+        offer(o, o->next, base, &count, cell_at(o, nx, ny), nx, ny,
+              (uint64_t)pos * 4 + k);
+    }
+  }
+
+  // Colors new to the counter, with the key of their first push
+  uint32_t ranked = colorcounter_distinct_count(counter);
+  uint32_t added = 0, capacity = 0;
+  uint64_t *first = NULL;
+  sort_u64(o->next, count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t x = ITEM_X(o->next[i]), y = ITEM_Y(o->next[i]);
+    colorcounter_incr(counter, cell_at(o, x, y)->color);
+    if (colorcounter_distinct_count(counter) > ranked + added)
+    {
+      if (added == capacity)
+      {
+        capacity = capacity ? 2 * capacity : 64;
+        uint64_t *grown = recel_realloc(first, sizeof(uint64_t) * capacity);
+        if (!grown)
+        {
+          recel_free(first);
+          return -1;
+        }
+        first = grown;
+      }
+      first[added++] = o->next[i] >> 30;
+    }
+  }
+
+  for (uint32_t i = 0; i < *n; ++i)
+  {
+    uint32_t pos = (uint32_t)o->order[i];
+    uint32_t x = ITEM_X(o->items[pos]), y = ITEM_Y(o->items[pos]);
+    cell_t *c = cell_at(o, x, y);
+    int rank = colorcounter_get_rank(counter, c->color);
+    if (rank >= (int)ranked && first[rank - ranked] > (uint64_t)pos * 4 + 3)
+      rank = -1;
+    c->dist = level + rank;
+  }
+  recel_free(first);
+
+  uint64_t *t = o->items;
+  o->items = o->next;
+  o->next = t;
+  *n = count;
+  return 0;
+}
+
+// Time spent since *t in a step, restarting the clock
+static void account(recel_stats_t *stats, recel_stage_t stage, uint64_t *t,
+                    uint64_t *mark)
+{
+  uint64_t now = trace_now();
+  stats->stage[stage].ns += now - *t;
+  memory_stage(&stats->stage[stage], mark);
+  *t = now;
+}
+
+int recel_distance_out_of_core(uint32_t w, uint32_t h, const uint32_t *input,
+                               uint32_t *output, const char *dir,
+                               recel_stats_t *stats)
+{
+  if (w == 0 || h == 0 || w >= 32768 || h >= 32768)
+    return -1;
+
+  ooc_t o;
+  if (!dir)
+    dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  if (ooc_open(&o, w, h, dir) != 0)
+    return -1;
+
+  uint64_t t = stats ? trace_now() : 0, ranked = 0;
+  uint64_t mark = stats ? memory_mark() : 0;
+  uint32_t levels = 0;
+  TRACE_BEGIN(whole);
+
+  colorcounter_t *counter = colorcounter_new();
+  if (!counter)
+  {
+    ooc_close(&o);
+    return -1;
+  }
+  uint32_t n = ooc_init(&o, input, counter);
+  int32_t level = 1;
+  if (stats)
+    account(stats, RECEL_STAGE_DIST_INIT, &t, &mark);
+
+  while (n > 0)
+  {
+    TRACE_BEGIN(step);
+    level += colorcounter_distinct_count(counter);
+    levels += 1;
+
+    colorcounter_start(counter);
+    n = ooc_propagate(&o, n, counter);
+    if (stats)
+    {
+      account(stats, RECEL_STAGE_DIST_PROPAGATE, &t, &mark);
+      ranked += colorcounter_distinct_count(counter);
+    }
+    TRACE_END(step, "propagate", levels);
+
+    TRACE_BEGIN(rank);
+    colorcounter_rank(counter);
+    if (stats)
+      account(stats, RECEL_STAGE_DIST_RANK, &t, &mark);
+    TRACE_END(rank, "rank", levels);
+
+    TRACE_BEGIN(next);
+    int failed = ooc_nextlevel(&o, &n, counter, level);
+    if (stats)
+      account(stats, RECEL_STAGE_DIST_NEXTLEVEL, &t, &mark);
+    TRACE_END(next, "nextlevel", levels);
+    if (failed)
+    {
+      colorcounter_delete(counter);
+      ooc_close(&o);
+      return -1;
+    }
+  }
+  colorcounter_delete(counter);
+
+  for (uint32_t y = 0; y < h; ++y)
+    for (uint32_t x = 0; x < w; ++x)
+      output[(size_t)y * w + x] = cell_at(&o, x, y)->dist;
+  ooc_close(&o);
+  TRACE_END(whole, "distance", levels);
+
+  if (stats)
+  {
+    account(stats, RECEL_STAGE_DIST_INIT, &t, &mark);
+    // Every pixel is searched and its pushes listed (8 neighbours each),
+    // then it is numbered (4 neighbours)
+    uint64_t pixels = (uint64_t)w * h;
+    stats->levels += levels;
+    stats->stage[RECEL_STAGE_DIST_INIT].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_INIT].bytes += pixels * 16;
+    stats->stage[RECEL_STAGE_DIST_PROPAGATE].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_PROPAGATE].bytes += pixels * (16 * 12 + 64);
+    stats->stage[RECEL_STAGE_DIST_RANK].items += ranked;
+    stats->stage[RECEL_STAGE_DIST_RANK].bytes += ranked * 16;
+    stats->stage[RECEL_STAGE_DIST_NEXTLEVEL].items += pixels;
+    stats->stage[RECEL_STAGE_DIST_NEXTLEVEL].bytes += pixels * (4 * 12 + 24);
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "recel.h"
+#include "cpu.h"
 
 void recel_scanline(
     uint32_t w,
@@ -7,14 +8,18 @@ void recel_scanline(
     uint32_t *disto, uint32_t *lineo
     )
 {
+  const cpu_kernels_t *k = cpu_kernels();
   int i = 0;
   while (i < w - 1)
   {
     if (dista[i] == distb[i])
-    { // Flat area
-      lineo[i] = linea[i];
-      disto[i] = dista[i];
-      i += 1;
+    { // Flat area, up to the next column where the rows differ
+      int j = k->flat_end(dista, distb, i + 1, w - 1);
+      for (; i < j; i++)
+      {
+        lineo[i] = linea[i];
+        disto[i] = dista[i];
+      }
     }
     else
     { // Compute length of scan
@@ -105,17 +110,24 @@ void recel_scanline(
   }
 }
 
+void recel_scan_view(recel_view_t dist, recel_view_t line,
+                     recel_view_t disto, recel_view_t lineo)
+{
+  for (uint32_t y = 0; y + 1 < dist.h; ++y)
+  {
+    recel_scanline(dist.w,
+        &VIEW_PIX(dist, 0, y), &VIEW_PIX(dist, 0, y + 1),
+        &VIEW_PIX(line, 0, y), &VIEW_PIX(line, 0, y + 1),
+        &VIEW_PIX(disto, 0, y), &VIEW_PIX(lineo, 0, y));
+  }
+}
+
 void recel_scan(
     uint32_t w, uint32_t h,
     const uint32_t *disti, const uint32_t *linei,
     uint32_t *disto, uint32_t *lineo
     )
 {
-  for (uint32_t y = 0; y < h - 1; ++y)
-  {
-    recel_scanline(w,
-        disti + y * w, disti + y * w + w,
-        linei + y * w, linei + y * w + w,
-        disto + y * w, lineo + y * w);
-  }
+  recel_scan_view(recel_view(disti, w, h), recel_view(linei, w, h),
+                  recel_view(disto, w, h), recel_view(lineo, w, h));
 }
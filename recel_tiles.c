@@ -0,0 +1,273 @@
+#include "recel.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threadpool.h"
+#include "trace.h"
+
+/* Tiled upscaling and sprite sheets */
+
+typedef struct {
+  uint32_t x0, y0, x1, y1; // tile, in input pixels
+  uint32_t rx0, ry0, rx1, ry1; // tile and its context
+  recel_hash_t key;
+  uint32_t *result; // upscaled context, only set on the first of a group
+  uint32_t first; // index of the tile holding the result
+} tile_t;
+
+struct tiling {
+  uint32_t w, h;
+  const uint32_t *input;
+  recel_cache_t *cache;
+  uint32_t *output;
+  tile_t *tiles;
+  uint32_t count;
+  uint32_t *unique; // index of the first tile of each group
+  uint32_t unique_count;
+  atomic_bool failed;
+  atomic_ullong upscale_ns;
+};
+
+static uint32_t *copy_region(const struct tiling *t, const tile_t *tile)
+{
+  uint32_t rw = tile->rx1 - tile->rx0, rh = tile->ry1 - tile->ry0;
+  uint32_t *region = recel_malloc((size_t)rw * rh * 4);
+  if (region)
+  {
+    for (uint32_t y = 0; y < rh; ++y)
+      memcpy(region + (size_t)y * rw,
+             t->input + (size_t)(tile->ry0 + y) * t->w + tile->rx0, rw * 4);
+  }
+  return region;
+}
+
+static int compare_tiles(const void *a, const void *b)
+{
+  const tile_t *x = a, *y = b;
+  for (int i = 0; i < 2; ++i)
+  {
+    if (x->key.h[i] != y->key.h[i])
+      return x->key.h[i] < y->key.h[i] ? -1 : 1;
+  }
+  // Same content: keep the grid order, the first tile owns the result
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static void upscale_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  struct tiling *t = ctx;
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    TRACE_BEGIN(traced);
+    tile_t *tile = &t->tiles[t->unique[i]];
+    uint32_t *region = copy_region(t, tile);
+    uint32_t rw = tile->rx1 - tile->rx0, rh = tile->ry1 - tile->ry0;
+
+    recel_options_t options = { .cache = t->cache };
+    uint64_t start = trace_now();
+    tile->result = region ? recel_upscale(&options, &rw, &rh, region) : NULL;
+    atomic_fetch_add(&t->upscale_ns, trace_now() - start);
+
+    recel_free(region);
+    if (!tile->result)
+      atomic_store(&t->failed, true);
+    TRACE_END(traced, "tile", t->unique[i]);
+  }
+}
+
+// Copy the part of an upscaled context that belongs to its tile
+static void stamp_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  struct tiling *t = ctx;
+  uint32_t ow = 3 * t->w - 2, oh = 3 * t->h - 2;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    const tile_t *tile = &t->tiles[i];
+    const uint32_t *result = t->tiles[tile->first].result;
+    uint32_t rw = 3 * (tile->rx1 - tile->rx0) - 2;
+
+    uint32_t x0 = 3 * tile->x0, x1 = 3 * tile->x1;
+    uint32_t y0 = 3 * tile->y0, y1 = 3 * tile->y1;
+    if (x1 > ow) x1 = ow;
+    if (y1 > oh) y1 = oh;
+
+    for (uint32_t y = y0; y < y1; ++y)
+      memcpy(t->output + (size_t)y * ow + x0,
+             result + (size_t)(y - 3 * tile->ry0) * rw + (x0 - 3 * tile->rx0),
+             (x1 - x0) * 4);
+  }
+}
+
+// Split the input in tiles of cw * ch pixels, each with its context, and
+// group identical ones
+static int tiling_init(struct tiling *t, uint32_t cw, uint32_t ch,
+                       uint32_t border, uint32_t ow, uint32_t oh)
+{
+  uint32_t w = t->w, h = t->h;
+  uint32_t cols = (w + cw - 1) / cw, rows = (h + ch - 1) / ch;
+  t->count = cols * rows;
+  t->tiles = recel_calloc(t->count, sizeof(tile_t));
+  t->unique = recel_malloc(sizeof(uint32_t) * t->count);
+  t->output = NEW_IMAGE(uint32_t, ow, oh);
+  atomic_init(&t->failed, false);
+  atomic_init(&t->upscale_ns, 0);
+  if (!t->tiles || !t->unique || !t->output)
+    return -1;
+
+  for (uint32_t i = 0; i < t->count; ++i)
+  {
+    tile_t *tile = &t->tiles[i];
+    tile->x0 = (i % cols) * cw;
+    tile->y0 = (i / cols) * ch;
+    tile->x1 = tile->x0 + cw < w ? tile->x0 + cw : w;
+    tile->y1 = tile->y0 + ch < h ? tile->y0 + ch : h;
+    tile->rx0 = tile->x0 > border ? tile->x0 - border : 0;
+    tile->ry0 = tile->y0 > border ? tile->y0 - border : 0;
+    tile->rx1 = tile->x1 + border < w ? tile->x1 + border : w;
+    tile->ry1 = tile->y1 + border < h ? tile->y1 + border : h;
+    tile->first = i;
+
+    // Context clipped at the image edge: the tile position within its
+    // context is part of the key
+    uint32_t *region = copy_region(t, tile);
+    if (!region)
+      return -1;
+    tile->key = recel_hash_pixels(tile->rx1 - tile->rx0,
+                                  tile->ry1 - tile->ry0, region);
+    tile->key.h[0] ^= (uint64_t)(tile->x0 - tile->rx0) << 32 |
+                      (tile->y0 - tile->ry0);
+    tile->key.h[1] ^= (uint64_t)(tile->x1 - tile->x0) << 32 |
+                      (tile->y1 - tile->y0);
+    recel_free(region);
+  }
+
+  // Group identical tiles, then restore the grid order
+  tile_t *sorted = recel_malloc(sizeof(tile_t) * t->count);
+  if (!sorted)
+    return -1;
+  memcpy(sorted, t->tiles, sizeof(tile_t) * t->count);
+  qsort(sorted, t->count, sizeof(tile_t), compare_tiles);
+
+  t->unique_count = 0;
+  for (uint32_t i = 0; i < t->count; ++i)
+  {
+    if (i == 0 || memcmp(&sorted[i].key, &sorted[i - 1].key,
+                         sizeof(recel_hash_t)) != 0)
+      t->unique[t->unique_count++] = sorted[i].first;
+    t->tiles[sorted[i].first].first = t->unique[t->unique_count - 1];
+  }
+  recel_free(sorted);
+  return 0;
+}
+
+static void tiling_release(struct tiling *t, bool keep_output)
+{
+  if (t->tiles)
+  {
+    for (uint32_t i = 0; i < t->count; ++i)
+      recel_free(t->tiles[i].result);
+  }
+  recel_free(t->tiles);
+  recel_free(t->unique);
+  if (!keep_output)
+    recel_free(t->output);
+}
+
+// Upscale unique tiles and copy them to the output, NULL on failure
+static uint32_t *tiling_run(const recel_options_t *opt, struct tiling *t,
+                            void (*stamp)(void *ctx, uint32_t begin, uint32_t end),
+                            recel_tile_stats_t *stats)
+{
+  threadpool_t *pool = opt ? opt->pool : NULL;
+  threadpool_parallel_for(pool, t->unique_count, 1, upscale_task, t);
+  if (atomic_load(&t->failed))
+    return NULL;
+  threadpool_parallel_for(pool, t->count, 16, stamp, t);
+
+  if (stats)
+  {
+    stats->tiles = t->count;
+    stats->unique = t->unique_count;
+    stats->upscale_ns = atomic_load(&t->upscale_ns);
+    stats->saved_ns = stats->upscale_ns * (t->count - t->unique_count) /
+                      t->unique_count;
+  }
+  return t->output;
+}
+
+uint32_t *recel_upscale_tiles(const recel_options_t *opt,
+                              uint32_t size, uint32_t border,
+                              uint32_t *pw, uint32_t *ph,
+                              const uint32_t *input, recel_tile_stats_t *stats)
+{
+  uint32_t w = *pw, h = *ph;
+  if (w < 2 || h < 2 || size == 0)
+    return NULL;
+
+  // Output rows and columns between two input pixels need the next one
+  if (border < 1)
+    border = 1;
+
+  struct tiling t = { .w = w, .h = h, .input = input };
+  uint32_t *output = NULL;
+  if (tiling_init(&t, size, size, border, 3 * w - 2, 3 * h - 2) == 0)
+    output = tiling_run(opt, &t, stamp_task, stats);
+  tiling_release(&t, output != NULL);
+
+  if (output)
+  {
+    *pw = 3 * w - 2;
+    *ph = 3 * h - 2;
+  }
+  return output;
+}
+
+// Copy an upscaled cell to its 3cw * 3ch slot, repeating its last column
+// and row to fill the slot
+static void stamp_cell_task(void *ctx, uint32_t begin, uint32_t end)
+{
+  struct tiling *t = ctx;
+  uint32_t ow = 3 * t->w;
+
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    const tile_t *tile = &t->tiles[i];
+    const uint32_t *result = t->tiles[tile->first].result;
+    uint32_t cw = tile->x1 - tile->x0, ch = tile->y1 - tile->y0;
+    uint32_t rw = 3 * cw - 2, rh = 3 * ch - 2;
+
+    for (uint32_t y = 0; y < 3 * ch; ++y)
+    {
+      const uint32_t *src = result + (size_t)(y < rh ? y : rh - 1) * rw;
+      uint32_t *dst = t->output + (size_t)(3 * tile->y0 + y) * ow + 3 * tile->x0;
+      memcpy(dst, src, rw * 4);
+      dst[rw] = dst[rw + 1] = src[rw - 1];
+    }
+  }
+}
+
+uint32_t *recel_upscale_cells(const recel_options_t *opt,
+                              uint32_t cw, uint32_t ch,
+                              uint32_t *pw, uint32_t *ph,
+                              const uint32_t *input, recel_tile_stats_t *stats)
+{
+  uint32_t w = *pw, h = *ph;
+  if (w == 0 || h == 0 || cw == 0 || ch == 0)
+    return NULL;
+
+  struct tiling t = {
+    .w = w, .h = h, .input = input, .cache = opt ? opt->cache : NULL,
+  };
+  uint32_t *output = NULL;
+  if (tiling_init(&t, cw, ch, 0, 3 * w, 3 * h) == 0)
+    output = tiling_run(opt, &t, stamp_cell_task, stats);
+  tiling_release(&t, output != NULL);
+
+  if (output)
+  {
+    *pw = 3 * w;
+    *ph = 3 * h;
+  }
+  return output;
+}
@@ -0,0 +1,790 @@
+#include "recel.h"
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "fasttable.h"
+#include "memory.h"
+#include "stb_image_write.h"
+#include "threadpool.h"
+#include "trace.h"
+
+/* Upscaling */
+
+// Distances on 32 bits, and on 16 bits for the image and for the
+// distances themselves
+
+#define DIST_T uint32_t
+#define PIX_T uint32_t
+#define FLAT_END flat_end
+#define NAME(x) x##_32
+#include "inflate.h"
+
+#define DIST_T uint16_t
+#define PIX_T uint32_t
+#define FLAT_END flat_end16
+#define NAME(x) x##_16
+#include "inflate.h"
+
+#define DIST_T uint16_t
+#define PIX_T uint16_t
+#define FLAT_END flat_end16
+#define NAME(x) x##_16_16
+#include "inflate.h"
+
+void inflate_rows(const uint32_t *dist,
+                  const uint32_t *imag,
+                  int w, int h,
+                  uint32_t *out,
+                  int y0, int y1)
+{
+  inflate_rows_32(dist, w, imag, w, w, h, out, w, y0, y1);
+}
+
+void inflate_view(recel_view_t dist, recel_view_t imag, recel_view_t out,
+                  int y0, int y1)
+{
+  inflate_rows_32(dist.pixels, dist.stride, imag.pixels, imag.stride,
+                  dist.w, dist.h, out.pixels, out.stride, y0, y1);
+}
+
+void inflate_rows16(const uint16_t *dist, const uint32_t *imag, int w, int h,
+                    uint32_t *out, int y0, int y1)
+{
+  inflate_rows_16(dist, w, imag, w, w, h, out, w, y0, y1);
+}
+
+void inflate_dist16(const uint16_t *dist, int w, int h, uint16_t *out,
+                    int y0, int y1)
+{
+  inflate_rows_16_16(dist, w, dist, w, w, h, out, w, y0, y1);
+}
+
+void inflate(const uint32_t *dist,
+             const uint32_t *imag,
+             int w, int h,
+             uint32_t *out)
+{
+  inflate_rows(dist, imag, w, h, out, 0, h - 1);
+}
+
+void fliph(uint32_t *image, int w, int h)
+{
+  for (int y = 0; y < h - 1; y++)
+  {
+    uint32_t *p = image + w * y;
+    for (int x = 0; x < w / 2; x++)
+    {
+      uint32_t v = p[x];
+      p[x] = p[w - 1 - x];
+      p[w - 1 - x] = v;
+    }
+  }
+}
+
+// Rows of size bytes, os, ts and is bytes apart in out, outer and inner
+static void interleave_bytes(char *out, size_t os, const char *outer,
+                             size_t ts, const char *inner, size_t is,
+                             size_t size, int h, int y0, int y1)
+{
+  if (y0 == 0)
+    memcpy(out, outer, size);
+  if (y1 > h - 1)
+    y1 = h - 1;
+  for (int y = y0; y < y1; y++)
+  {
+    memcpy(out + os * (3 * y + 1), inner + is * (2 * y + 0), size);
+    memcpy(out + os * (3 * y + 2), inner + is * (2 * y + 1), size);
+    memcpy(out + os * (3 * y + 3), outer + ts * (y + 1), size);
+  }
+}
+
+void interleave_rows(uint32_t *out, const uint32_t *outer, const uint32_t *inner,
+                     int w, int h, int y0, int y1)
+{
+  size_t size = sizeof(uint32_t) * w;
+  interleave_bytes((char*)out, size, (const char*)outer, size,
+                   (const char*)inner, size, size, h, y0, y1);
+}
+
+void interleave_rows16(uint16_t *out, const uint16_t *outer,
+                       const uint16_t *inner, int w, int h, int y0, int y1)
+{
+  size_t size = sizeof(uint16_t) * w;
+  interleave_bytes((char*)out, size, (const char*)outer, size,
+                   (const char*)inner, size, size, h, y0, y1);
+}
+
+void interleave_view(recel_view_t out, recel_view_t outer,
+                     recel_view_t inner, int y0, int y1)
+{
+  size_t px = sizeof(uint32_t);
+  interleave_bytes((char*)out.pixels, px * out.stride,
+                   (const char*)outer.pixels, px * outer.stride,
+                   (const char*)inner.pixels, px * inner.stride,
+                   px * outer.w, outer.h, y0, y1);
+}
+
+void interleave(uint32_t *out, const uint32_t *outer, const uint32_t *inner, int w, int h)
+{
+  interleave_rows(out, outer, inner, w, h, 0, h - 1);
+}
+
+// Transpose columns x0 to x1 - 1 of in
+void transpose_rows(uint32_t *out, const uint32_t *in, int w, int h,
+                    int x0, int x1)
+{
+  cpu_kernels()->transpose(out, h, in, w, h, x0, x1);
+}
+
+void transpose_view(recel_view_t out, recel_view_t in, int x0, int x1)
+{
+  cpu_kernels()->transpose(out.pixels, out.stride, in.pixels, in.stride,
+                           in.h, x0, x1);
+}
+
+void transpose_rows16(uint16_t *out, const uint16_t *in, int w, int h,
+                      int x0, int x1)
+{
+  cpu_kernels()->transpose16(out, h, in, w, h, x0, x1);
+}
+
+uint32_t *transpose(const uint32_t *in, int w, int h)
+{
+  uint32_t *result = NEW_IMAGE(uint32_t, h, w);
+  if (result)
+    transpose_rows(result, in, w, h, 0, w);
+  return result;
+}
+
+/* Statistics */
+
+static const char *const stage_names[RECEL_STAGE_COUNT] = {
+  "decode", "dist_init", "dist_propagate", "dist_rank", "dist_nextlevel",
+  "inflate", "interleave", "transpose", "encode",
+};
+
+const char *recel_stage_name(recel_stage_t stage)
+{
+  return stage < RECEL_STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+// Add a stage that started at *t and *mark, restarting the clock
+static void account(recel_stats_t *stats, recel_stage_t stage, uint64_t *t,
+                    uint64_t *mark, uint64_t items, uint64_t bytes)
+{
+  uint64_t now = trace_now();
+  stats->stage[stage].ns += now - *t;
+  stats->stage[stage].items += items;
+  stats->stage[stage].bytes += bytes;
+  memory_stage(&stats->stage[stage], mark);
+  *t = now;
+}
+
+/* Parallel stages */
+
+// Rows handed to a worker at once, so that a chunk is a few hundred KB
+static uint32_t grain_rows(int w)
+{
+  return w >= 16384 ? 1 : 16384 / w;
+}
+
+struct stage {
+  int w, h;
+  bool imag_only; // last pass of a plan, the distance map is not needed
+  bool compact;   // dist, disti and distii hold uint16_t distances
+  size_t stride;  // of imag in transpose, which may be the caller output
+  const uint32_t *dist, *imag;
+  uint32_t *disti, *imagi;
+  uint32_t *distii, *imagii;
+};
+
+// Chunks are traced with their first row or column
+static void inflate_task(void *ctx, uint32_t y0, uint32_t y1)
+{
+  struct stage *s = ctx;
+  TRACE_BEGIN(t);
+  if (s->compact)
+  {
+    const uint16_t *dist = (const uint16_t*)s->dist;
+    if (!s->imag_only)
+      inflate_dist16(dist, s->w, s->h, (uint16_t*)s->disti, y0, y1);
+    inflate_rows16(dist, s->imag, s->w, s->h, s->imagi, y0, y1);
+  }
+  else
+  {
+    if (!s->imag_only)
+      inflate_rows(s->dist, s->dist, s->w, s->h, s->disti, y0, y1);
+    inflate_rows(s->dist, s->imag, s->w, s->h, s->imagi, y0, y1);
+  }
+  TRACE_END(t, "inflate", y0);
+}
+
+static void interleave_task(void *ctx, uint32_t y0, uint32_t y1)
+{
+  struct stage *s = ctx;
+  TRACE_BEGIN(t);
+  if (!s->imag_only && s->compact)
+    interleave_rows16((uint16_t*)s->distii, (const uint16_t*)s->dist,
+                      (const uint16_t*)s->disti, s->w, s->h, y0, y1);
+  else if (!s->imag_only)
+    interleave_rows(s->distii, s->dist, s->disti, s->w, s->h, y0, y1);
+  interleave_rows(s->imagii, s->imag, s->imagi, s->w, s->h, y0, y1);
+  TRACE_END(t, "interleave", y0);
+}
+
+static void transpose_task(void *ctx, uint32_t x0, uint32_t x1)
+{
+  // Here the stage is already (w, 3h-2) and dist/imag are the outputs
+  struct stage *s = ctx;
+  TRACE_BEGIN(t);
+  if (s->compact)
+    transpose_rows16((uint16_t*)s->dist, (const uint16_t*)s->distii,
+                     s->w, s->h, x0, x1);
+  else
+    transpose_rows((uint32_t*)s->dist, s->distii, s->w, s->h, x0, x1);
+  cpu_kernels()->transpose((uint32_t*)s->imag, s->stride, s->imagii, s->w,
+                           s->h, x0, x1);
+  TRACE_END(t, "transpose", x0);
+}
+
+static void transpose_imag_task(void *ctx, uint32_t x0, uint32_t x1)
+{
+  struct stage *s = ctx;
+  TRACE_BEGIN(t);
+  cpu_kernels()->transpose((uint32_t*)s->imag, s->stride, s->imagii, s->w,
+                           s->h, x0, x1);
+  TRACE_END(t, "transpose", x0);
+}
+
+/* Buffers of recel_upscale.
+ * They are carved from one arena sized for both passes, and reused from one
+ * pass to the next: a pass reads its source pair, inflates it into the
+ * inner pair, interleaves into the outer pair, and transposes the outer
+ * pair back into the source pair, which is not read anymore.  The second
+ * pass transposes into the output instead; without dump, it only needs
+ * the image of the inner and outer pairs.
+ */
+enum {
+  SRC_DIST, SRC_IMAG, INNER_DIST, INNER_IMAG, OUTER_DIST, OUTER_IMAG,
+  BUFFERS
+};
+
+static void upscale_buffers(size_t w, size_t h, bool dump,
+                            size_t pixels[BUFFERS])
+{
+  // The second pass works on the transposed (3h-2) * w image
+  size_t w2 = 3 * h - 2, h2 = w;
+  size_t inner = w * (2 * h - 2), inner2 = w2 * (2 * h2 - 2);
+  size_t outer = w * (3 * h - 2), outer2 = w2 * (3 * h2 - 2);
+
+  pixels[SRC_DIST] = pixels[SRC_IMAG] = outer;
+  pixels[INNER_DIST] = dump && inner2 > inner ? inner2 : inner;
+  pixels[INNER_IMAG] = inner2 > inner ? inner2 : inner;
+  pixels[OUTER_DIST] = dump && outer2 > outer ? outer2 : outer;
+  pixels[OUTER_IMAG] = outer2 > outer ? outer2 : outer;
+}
+
+size_t upscale_arena_bytes(uint32_t w, uint32_t h)
+{
+  size_t pixels[BUFFERS];
+  if (w == 0 || h == 0)
+    return 0;
+  upscale_buffers(w, h, false, pixels);
+  return memory_arena_bytes(pixels, BUFFERS);
+}
+
+// Upscale a w * h image into out, which is (3w-2) * (3h-2)
+static int upscale(const recel_options_t *opt, int w, int h,
+                   const uint32_t *input, recel_view_t out)
+{
+  threadpool_t *pool = opt->pool;
+  recel_stats_t *stats = opt->stats;
+  uint32_t *imag, *dist;
+
+  uint64_t minor = 0, major = 0;
+  if (stats)
+    memory_faults(&minor, &major);
+
+  memory_arena_t arena;
+  size_t pixels[BUFFERS], offset = 0;
+  uint32_t *buffer[BUFFERS];
+  upscale_buffers(w, h, opt->dump, pixels);
+  if (memory_arena_new(&arena, memory_arena_bytes(pixels, BUFFERS),
+                       opt->pages) != 0)
+    return -1;
+  for (int i = 0; i < BUFFERS; i++)
+    buffer[i] = memory_arena_take(&arena, &offset, pixels[i]);
+
+  imag = (uint32_t*)input;
+  dist = buffer[SRC_DIST];
+  colorcounter_t *counter = colorcounter_new();
+  int result = recel_distance_into(w, h, imag, dist, counter, stats);
+  colorcounter_delete(counter);
+  if (result != 0)
+  {
+    memory_arena_delete(&arena);
+    return -1;
+  }
+  if (stats)
+    stats->colors += recel_count_colors(w, h, input, 0);
+  if (opt->dump)
+    recel_save_dist("dist.png", w, h, dist);
+
+  // Distances usually fit on 16 bits, which saves a quarter of the memory
+  // traffic of both passes; dumps are saved from 32-bit maps
+  bool compact = !opt->dump && recel_distance_narrow(w, h, dist) == 0;
+  uint64_t pixel_bytes = compact ? 6 : 8;
+
+  uint32_t *output_dist = NULL;
+  for (int i = 0; i < 2; i++)
+  {
+    TRACE_BEGIN(pass);
+    struct stage s = {
+      .w = w, .h = h, .dist = dist, .imag = imag,
+      .imag_only = i == 1 && !opt->dump, .compact = compact,
+      .disti = buffer[INNER_DIST], .imagi = buffer[INNER_IMAG],
+      .distii = buffer[OUTER_DIST], .imagii = buffer[OUTER_IMAG],
+    };
+
+    // Items are pixels of the interpolated image, bytes count both the
+    // distance map and the image
+    uint64_t start = stats ? trace_now() : 0, mark = stats ? memory_mark() : 0;
+    uint64_t in = (uint64_t)w * h, inner = (uint64_t)w * (2*h-2);
+    uint64_t out_pixels = (uint64_t)w * (3*h-2);
+    threadpool_parallel_for(pool, h - 1, grain_rows(w), inflate_task, &s);
+    if (stats)
+      account(stats, RECEL_STAGE_INFLATE, &start, &mark, inner,
+              pixel_bytes * (in + inner));
+    threadpool_parallel_for(pool, h - 1, grain_rows(w), interleave_task, &s);
+    if (h == 1)
+      interleave_task(&s, 0, 0);
+    if (stats)
+      account(stats, RECEL_STAGE_INTERLEAVE, &start, &mark, out_pixels,
+              pixel_bytes * (in + inner + out_pixels));
+
+    if (opt->dump && i == 0)
+      stbi_write_png("outh.png", w, 3*h-2, 4, s.imagii, 0);
+    h = h * 3 - 2;
+
+    if (opt->dump)
+    {
+      char fdist[] = "dist-_.png";
+      char fimag[] = "imag-_.png";
+      fdist[5] = fimag[5] = '0' + i;
+
+      stbi_write_png(fimag, w, h, 4, s.imagii, 0);
+      recel_save_dist(fdist, w, h, s.distii);
+    }
+
+    // The first pass goes back to the source pair, the second one to the
+    // output
+    if (i == 0)
+    {
+      imag = buffer[SRC_IMAG];
+      dist = buffer[SRC_DIST];
+      s.stride = h;
+    }
+    else
+    {
+      imag = out.pixels;
+      s.stride = out.stride;
+      dist = output_dist = opt->dump ? NEW_IMAGE(uint32_t, h, w) : NULL;
+      if (opt->dump && !output_dist)
+        goto fail;
+    }
+
+    s.w = w; s.h = h;
+    s.dist = dist; s.imag = imag;
+    start = stats ? trace_now() : 0;
+    mark = stats ? memory_mark() : 0;
+    threadpool_parallel_for(pool, w, grain_rows(h),
+                            s.imag_only ? transpose_imag_task : transpose_task,
+                            &s);
+    if (stats)
+      account(stats, RECEL_STAGE_TRANSPOSE, &start, &mark, out_pixels,
+              (s.imag_only ? 8 : 2 * pixel_bytes) * out_pixels);
+
+    int t = w;
+    w = h;
+    h = t;
+    TRACE_END(pass, "pass", i);
+  }
+
+  if (opt->dump)
+    recel_save_dist("outd.png", w, h, output_dist);
+  recel_free(output_dist);
+  memory_arena_delete(&arena);
+
+  if (stats)
+  {
+    uint64_t minor1, major1;
+    memory_faults(&minor1, &major1);
+    stats->minor_faults += minor1 - minor;
+    stats->major_faults += major1 - major;
+  }
+  return 0;
+
+fail:
+  memory_arena_delete(&arena);
+  return -1;
+}
+
+uint32_t *recel_upscale(const recel_options_t *opt,
+                        uint32_t *pw, uint32_t *ph, const uint32_t *input)
+{
+  static const recel_options_t defaults;
+  if (!opt)
+    opt = &defaults;
+
+  uint32_t w = *pw, h = *ph;
+  if (w == 0 || h == 0)
+    return NULL;
+
+  // Intermediate images are only produced by a real run
+  recel_cache_t *cache = opt->dump ? NULL : opt->cache;
+  recel_hash_t key;
+  if (cache)
+  {
+    key = recel_hash_pixels(w, h, input);
+    uint32_t *cached = recel_cache_get(cache, &key, pw, ph);
+    if (cached)
+      return cached;
+  }
+
+  uint32_t ow = 3 * w - 2, oh = 3 * h - 2;
+  uint32_t *output = NEW_IMAGE(uint32_t, ow, oh);
+  if (!output || upscale(opt, w, h, input, recel_view(output, ow, oh)) != 0)
+  {
+    recel_free(output);
+    return NULL;
+  }
+
+  if (cache)
+    recel_cache_put(cache, &key, ow, oh, output);
+
+  *pw = ow;
+  *ph = oh;
+  return output;
+}
+
+int recel_upscale_into(const recel_options_t *opt, uint32_t w, uint32_t h,
+                       const uint32_t *input, recel_view_t output)
+{
+  static const recel_options_t defaults;
+  if (!opt)
+    opt = &defaults;
+
+  uint32_t ow = 3 * w - 2, oh = 3 * h - 2;
+  if (w == 0 || h == 0 || output.w < ow || output.h < oh)
+    return -1;
+
+  // Cached results are copied, packed outputs are cached as they are
+  recel_cache_t *cache = opt->dump ? NULL : opt->cache;
+  recel_hash_t key;
+  if (cache)
+  {
+    key = recel_hash_pixels(w, h, input);
+    uint32_t cw = w, ch = h;
+    uint32_t *cached = recel_cache_get(cache, &key, &cw, &ch);
+    if (cached)
+    {
+      for (uint32_t y = 0; y < oh; ++y)
+        memcpy(&VIEW_PIX(output, 0, y), cached + (size_t)y * ow,
+               sizeof(uint32_t) * ow);
+      recel_free(cached);
+      return 0;
+    }
+  }
+
+  if (upscale(opt, w, h, input, output) != 0)
+    return -1;
+  if (cache && output.stride == ow)
+    recel_cache_put(cache, &key, ow, oh, output.pixels);
+  return 0;
+}
+
+/* Plans */
+
+struct recel_plan {
+  threadpool_t *pool;
+  int w, h;
+  colorcounter_t *counter;
+  uint32_t *dist;          // distance map of the input
+  uint32_t *disti, *imagi; // inflated rows, both passes
+  uint32_t *distii, *imagii; // interleaved rows, both passes
+  uint32_t *tdist, *timag; // first pass result, transposed
+
+  // State of the last frame, for recel_plan_update
+  bool valid;
+  uint32_t *prev;          // input
+  uint32_t *next_dist;     // distance map being computed
+  uint8_t *rows, *cols;    // changed rows of each pass
+
+  memory_arena_t arena;    // all the buffers above
+};
+
+recel_plan_t *recel_plan_new(const recel_options_t *opt, uint32_t w, uint32_t h)
+{
+  if (w < 2 || h < 2 || w >= 32768 || h >= 32768)
+    return NULL;
+
+  // Second pass works on the transposed (3h-2) * w image
+  size_t w2 = 3 * (size_t)h - 2, h2 = w;
+  size_t inflated = (size_t)w * (2 * h - 2), interleaved = (size_t)w * w2;
+  if (w2 * (2 * h2 - 2) > inflated)
+    inflated = w2 * (2 * h2 - 2);
+  if (w2 * (3 * h2 - 2) > interleaved)
+    interleaved = w2 * (3 * h2 - 2);
+
+  recel_plan_t *p = recel_calloc(1, sizeof(recel_plan_t));
+  if (!p)
+    return NULL;
+  p->pool = opt ? opt->pool : NULL;
+  p->w = w;
+  p->h = h;
+  p->counter = colorcounter_new();
+  if (!p->counter || colorcounter_reserve(p->counter, w * h) != 0)
+  {
+    recel_plan_delete(p);
+    return NULL;
+  }
+
+  // Every buffer in one arena, flags counted in pixels
+  size_t pixels[] = {
+    (size_t)w * h, inflated, inflated, interleaved, interleaved,
+    w2 * h2, w2 * h2, (size_t)w * h, (size_t)w * h, (h + 3) / 4, (w + 3) / 4,
+  };
+  size_t offset = 0;
+  recel_pages_t pages = opt ? opt->pages : RECEL_PAGES_DEFAULT;
+  if (memory_arena_new(&p->arena, memory_arena_bytes(pixels, 11), pages) != 0)
+  {
+    recel_plan_delete(p);
+    return NULL;
+  }
+  p->dist = memory_arena_take(&p->arena, &offset, pixels[0]);
+  p->disti = memory_arena_take(&p->arena, &offset, pixels[1]);
+  p->imagi = memory_arena_take(&p->arena, &offset, pixels[2]);
+  p->distii = memory_arena_take(&p->arena, &offset, pixels[3]);
+  p->imagii = memory_arena_take(&p->arena, &offset, pixels[4]);
+  p->tdist = memory_arena_take(&p->arena, &offset, pixels[5]);
+  p->timag = memory_arena_take(&p->arena, &offset, pixels[6]);
+  p->prev = memory_arena_take(&p->arena, &offset, pixels[7]);
+  p->next_dist = memory_arena_take(&p->arena, &offset, pixels[8]);
+  p->rows = (uint8_t*)memory_arena_take(&p->arena, &offset, pixels[9]);
+  p->cols = (uint8_t*)memory_arena_take(&p->arena, &offset, pixels[10]);
+  return p;
+}
+
+void recel_plan_delete(recel_plan_t *p)
+{
+  if (!p)
+    return;
+  colorcounter_delete(p->counter);
+  memory_arena_delete(&p->arena);
+  recel_free(p);
+}
+
+// Whole first pass, from the distance map into tdist and timag
+static void first_pass(recel_plan_t *p, const uint32_t *input)
+{
+  int w = p->w, h = p->h;
+  struct stage s = {
+    .w = w, .h = h, .dist = p->dist, .imag = input,
+    .disti = p->disti, .imagi = p->imagi,
+    .distii = p->distii, .imagii = p->imagii,
+  };
+
+  TRACE_BEGIN(t);
+  threadpool_parallel_for(p->pool, h - 1, grain_rows(w), inflate_task, &s);
+  threadpool_parallel_for(p->pool, h - 1, grain_rows(w), interleave_task, &s);
+  s.h = 3 * h - 2;
+  s.dist = p->tdist;
+  s.imag = p->timag;
+  s.stride = s.h;
+  threadpool_parallel_for(p->pool, w, grain_rows(s.h), transpose_task, &s);
+  TRACE_END(t, "pass", 0);
+}
+
+// Whole second pass, the distance map is not needed anymore
+static void second_pass(recel_plan_t *p, recel_view_t output)
+{
+  int w = 3 * p->h - 2, h = p->w;
+  struct stage s = {
+    .w = w, .h = h, .dist = p->tdist, .imag = p->timag,
+    .disti = p->disti, .imagi = p->imagi,
+    .distii = p->distii, .imagii = p->imagii,
+    .imag_only = true,
+  };
+
+  TRACE_BEGIN(t);
+  threadpool_parallel_for(p->pool, h - 1, grain_rows(w), inflate_task, &s);
+  threadpool_parallel_for(p->pool, h - 1, grain_rows(w), interleave_task, &s);
+  s.h = 3 * h - 2;
+  s.imag = output.pixels;
+  s.stride = output.stride;
+  threadpool_parallel_for(p->pool, w, grain_rows(s.h), transpose_imag_task, &s);
+  TRACE_END(t, "pass", 1);
+}
+
+void recel_plan_run_view(recel_plan_t *p, const uint32_t *input,
+                         recel_view_t output)
+{
+  recel_distance_into(p->w, p->h, input, p->dist, p->counter, NULL);
+  first_pass(p, input);
+  second_pass(p, output);
+
+  memcpy(p->prev, input, sizeof(uint32_t) * p->w * p->h);
+  p->valid = true;
+}
+
+void recel_plan_run(recel_plan_t *p, const uint32_t *input, uint32_t *output)
+{
+  recel_plan_run_view(p, input,
+                      recel_view(output, 3 * p->w - 2, 3 * p->h - 2));
+}
+
+/* Incremental update.
+ * A row pair of a pass is inflated from its two rows only, so a pass only
+ * has to redo the pairs next to a changed row, and interleave and transpose
+ * them.  Rows of the second pass are columns of the first one: they changed
+ * if a redone first pass row differs from the last frame.
+ * The distance map is global (a level is numbered after all the colors of
+ * the levels before it) and is always recomputed, then compared row by row.
+ * When most rows changed, as in a scrolling frame, the whole pass is redone
+ * on the pool instead.
+ */
+
+// First [start, end) range of pairs next to a flagged row, from y on
+static bool dirty_pairs(const uint8_t *flags, int h, int *y, int *start, int *end)
+{
+  while (*y < h - 1 && !flags[*y] && !flags[*y + 1])
+    *y += 1;
+  if (*y >= h - 1)
+    return false;
+  *start = *y;
+  while (*y < h - 1 && (flags[*y] || flags[*y + 1]))
+    *y += 1;
+  *end = *y;
+  return true;
+}
+
+// Rows of the interleaved image written by interleave_rows on [y0, y1)
+static void interleaved_span(int y0, int y1, int *r0, int *r1)
+{
+  *r0 = y0 == 0 ? 0 : 3 * y0 + 1;
+  *r1 = 3 * y1 + 1;
+}
+
+bool recel_plan_update_view(recel_plan_t *p, const uint32_t *input,
+                            recel_view_t output, const recel_rect_t *changed)
+{
+  if (!p->valid)
+  {
+    recel_plan_run_view(p, input, output);
+    return false;
+  }
+
+  int w = p->w, h = p->h;
+  int w2 = 3 * h - 2, h2 = w;
+
+  recel_distance_into(w, h, input, p->next_dist, p->counter, NULL);
+
+  // Pixels are only compared and copied inside the changed rectangle
+  int rx0 = 0, rx1 = w, ry0 = 0, ry1 = h;
+  if (changed)
+  {
+    rx0 = changed->x < (uint32_t)w ? (int)changed->x : w;
+    ry0 = changed->y < (uint32_t)h ? (int)changed->y : h;
+    rx1 = changed->w < (uint32_t)(w - rx0) ? rx0 + (int)changed->w : w;
+    ry1 = changed->h < (uint32_t)(h - ry0) ? ry0 + (int)changed->h : h;
+  }
+
+  int dirty = 0;
+  for (int y = 0; y < h; ++y)
+  {
+    size_t row = (size_t)y * w, span = sizeof(uint32_t) * (rx1 - rx0);
+    bool pixels = y >= ry0 && y < ry1 &&
+      memcmp(p->prev + row + rx0, input + row + rx0, span) != 0;
+    p->rows[y] = pixels ||
+      memcmp(p->dist + row, p->next_dist + row, sizeof(uint32_t) * w) != 0;
+    if (pixels)
+      memcpy(p->prev + row + rx0, input + row + rx0, span);
+    dirty += p->rows[y];
+  }
+  uint32_t *t = p->dist;
+  p->dist = p->next_dist;
+  p->next_dist = t;
+
+  if (2 * dirty > h)
+  {
+    first_pass(p, p->prev);
+    second_pass(p, output);
+    return false;
+  }
+
+  // First pass, transposing redone rows and flagging the columns that
+  // changed
+  memset(p->cols, 0, w);
+  int y = 0, y0, y1;
+  while (dirty_pairs(p->rows, h, &y, &y0, &y1))
+  {
+    inflate_rows(p->dist, p->dist, w, h, p->disti, y0, y1);
+    inflate_rows(p->dist, p->prev, w, h, p->imagi, y0, y1);
+    interleave_rows(p->distii, p->dist, p->disti, w, h, y0, y1);
+    interleave_rows(p->imagii, p->prev, p->imagi, w, h, y0, y1);
+
+    int r0, r1;
+    interleaved_span(y0, y1, &r0, &r1);
+    for (int r = r0; r < r1; ++r)
+    {
+      const uint32_t *dist = p->distii + (size_t)r * w;
+      const uint32_t *imag = p->imagii + (size_t)r * w;
+      for (int x = 0; x < w; ++x)
+      {
+        size_t i = (size_t)x * w2 + r;
+        if (p->tdist[i] != dist[x] || p->timag[i] != imag[x])
+        {
+          p->tdist[i] = dist[x];
+          p->timag[i] = imag[x];
+          p->cols[x] = 1;
+        }
+      }
+    }
+  }
+
+  dirty = 0;
+  for (int x = 0; x < w; ++x)
+    dirty += p->cols[x];
+  if (2 * dirty > h2)
+  {
+    second_pass(p, output);
+    return true;
+  }
+
+  // Second pass, into the columns of the output
+  y = 0;
+  while (dirty_pairs(p->cols, h2, &y, &y0, &y1))
+  {
+    inflate_rows(p->tdist, p->timag, w2, h2, p->imagi, y0, y1);
+    interleave_rows(p->imagii, p->timag, p->imagi, w2, h2, y0, y1);
+
+    int r0, r1;
+    interleaved_span(y0, y1, &r0, &r1);
+    for (int r = r0; r < r1; ++r)
+    {
+      const uint32_t *imag = p->imagii + (size_t)r * w2;
+      for (int x = 0; x < w2; ++x)
+        VIEW_PIX(output, r, x) = imag[x];
+    }
+  }
+
+  return true;
+}
+
+bool recel_plan_update(recel_plan_t *p, const uint32_t *input,
+                       uint32_t *output, const recel_rect_t *changed)
+{
+  return recel_plan_update_view(p, input,
+                                recel_view(output, 3 * p->w - 2, 3 * p->h - 2),
+                                changed);
+}
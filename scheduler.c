@@ -0,0 +1,194 @@
+#include "scheduler.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recel.h"
+#include "trace.h"
+
+typedef struct job {
+  void (*fn)(void *arg);
+  void *arg;
+  uint64_t submitted;
+  struct job *next;
+} job_t;
+
+typedef struct {
+  uint64_t *values;
+  size_t count, capacity;
+} samples_t;
+
+typedef struct {
+  const char *name;
+  job_t *head, *tail;
+  samples_t wait, service;
+} lane_t;
+
+struct scheduler {
+  threadpool_t *pool;
+  uint64_t threshold;
+  int large_share;
+
+  pthread_mutex_t lock;
+  lane_t fast, large;
+  int large_running;
+  int deferred; // runners that gave up because of large_share
+};
+
+static void samples_add(samples_t *s, uint64_t v)
+{
+  if (s->count == s->capacity)
+  {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    s->values = realloc(s->values, sizeof(uint64_t) * s->capacity);
+  }
+  s->values[s->count++] = v;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void lane_push(lane_t *l, job_t *job)
+{
+  job->next = NULL;
+  if (l->tail)
+    l->tail->next = job;
+  else
+    l->head = job;
+  l->tail = job;
+}
+
+static job_t *lane_pop(lane_t *l)
+{
+  job_t *job = l->head;
+  if (job)
+  {
+    l->head = job->next;
+    if (!l->head)
+      l->tail = NULL;
+  }
+  return job;
+}
+
+// Each submitted job gets one runner task, which runs the best job
+// available when it starts.
+static void runner(void *arg)
+{
+  scheduler_t *s = arg;
+
+  pthread_mutex_lock(&s->lock);
+  lane_t *lane = &s->fast;
+  job_t *job = lane_pop(lane);
+  if (!job && s->large_running < s->large_share)
+  {
+    lane = &s->large;
+    job = lane_pop(lane);
+    if (job)
+      s->large_running += 1;
+  }
+  if (!job)
+  {
+    s->deferred += 1;
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  uint64_t start = trace_now();
+  job->fn(job->arg);
+  uint64_t end = trace_now();
+
+  pthread_mutex_lock(&s->lock);
+  samples_add(&lane->wait, start - job->submitted);
+  samples_add(&lane->service, end - start);
+  bool resubmit = false;
+  if (lane == &s->large)
+  {
+    s->large_running -= 1;
+    if (s->deferred > 0 && s->large.head)
+    {
+      s->deferred -= 1;
+      resubmit = true;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  free(job);
+  if (resubmit)
+    threadpool_submit(s->pool, runner, s);
+}
+
+scheduler_t *scheduler_new(threadpool_t *pool, uint64_t threshold,
+                           int large_share)
+{
+  scheduler_t *s = calloc(1, sizeof(scheduler_t));
+  s->pool = pool;
+  s->threshold = threshold ? threshold : recel_cost(512, 512, 0);
+  s->large_share = large_share > 0 ? large_share : threadpool_size(pool) / 2;
+  if (s->large_share < 1)
+    s->large_share = 1;
+  pthread_mutex_init(&s->lock, NULL);
+  s->fast.name = "fast";
+  s->large.name = "large";
+  return s;
+}
+
+void scheduler_delete(scheduler_t *s)
+{
+  pthread_mutex_destroy(&s->lock);
+  free(s->fast.wait.values);
+  free(s->fast.service.values);
+  free(s->large.wait.values);
+  free(s->large.service.values);
+  free(s);
+}
+
+void scheduler_submit(scheduler_t *s, uint64_t cost,
+                      void (*fn)(void *arg), void *arg)
+{
+  job_t *job = malloc(sizeof(job_t));
+  job->fn = fn;
+  job->arg = arg;
+  job->submitted = trace_now();
+
+  pthread_mutex_lock(&s->lock);
+  lane_push(cost < s->threshold ? &s->fast : &s->large, job);
+  pthread_mutex_unlock(&s->lock);
+
+  threadpool_submit(s->pool, runner, s);
+}
+
+static void percentiles(FILE *f, const char *name, const samples_t *samples)
+{
+  size_t n = samples->count;
+  uint64_t *v = malloc(sizeof(uint64_t) * n);
+  memcpy(v, samples->values, sizeof(uint64_t) * n);
+  qsort(v, n, sizeof(uint64_t), compare_u64);
+  fprintf(f, "  %s p50 %.3f  p90 %.3f  p99 %.3f  max %.3f ms",
+          name, v[n / 2] / 1e6, v[n * 9 / 10] / 1e6, v[n * 99 / 100] / 1e6,
+          v[n - 1] / 1e6);
+  free(v);
+}
+
+void scheduler_report(scheduler_t *s, FILE *f)
+{
+  pthread_mutex_lock(&s->lock);
+  lane_t *lanes[] = { &s->fast, &s->large };
+  for (int i = 0; i < 2; ++i)
+  {
+    lane_t *l = lanes[i];
+    fprintf(f, "%-5s lane: %zu jobs", l->name, l->service.count);
+    if (l->service.count > 0)
+    {
+      fprintf(f, "\n ");
+      percentiles(f, "wait   ", &l->wait);
+      fprintf(f, "\n ");
+      percentiles(f, "service", &l->service);
+    }
+    fprintf(f, "\n");
+  }
+  pthread_mutex_unlock(&s->lock);
+}
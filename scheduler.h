@@ -0,0 +1,31 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "threadpool.h"
+
+typedef struct scheduler scheduler_t;
+
+/* Size-aware job scheduler on top of a thread pool.
+ * Jobs are put in a fast lane or a large lane according to their cost
+ * (see recel_cost).  Workers always take fast lane jobs first, and at most
+ * large_share jobs of the large lane run at the same time, so a huge image
+ * cannot hold every worker while small ones wait.
+ * Queue wait and service time of every job are recorded per lane.
+ */
+
+/* threshold: cost from which a job goes to the large lane, 0 for default.
+ * large_share: maximum of concurrent large jobs, 0 for half of the pool.
+ */
+scheduler_t *scheduler_new(threadpool_t *pool, uint64_t threshold,
+                           int large_share);
+void scheduler_delete(scheduler_t *s);
+
+void scheduler_submit(scheduler_t *s, uint64_t cost,
+                      void (*fn)(void *arg), void *arg);
+
+/* Print count and wait/service percentiles of each lane. */
+void scheduler_report(scheduler_t *s, FILE *f);
+
+#endif /*SCHEDULER_H*/
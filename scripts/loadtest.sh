@@ -0,0 +1,48 @@
+#!/bin/sh
+# Load test for the local server.
+#
+#   scripts/loadtest.sh socket image [clients [requests]]
+#
+# Starts `clients` concurrent clients, each sending `requests` requests for
+# image over one connection, then prints throughput and latency percentiles
+# over all requests. The server must already be running:
+#
+#   build/recel --serve /tmp/recel.sock &
+
+set -e
+
+RECEL=${RECEL:-build/recel}
+SOCKET=$1
+IMAGE=$2
+CLIENTS=${3:-4}
+REQUESTS=${4:-100}
+
+if [ -z "$SOCKET" ] || [ -z "$IMAGE" ]; then
+  sed -n '3,10p' "$0" | sed 's/^# \{0,1\}//'
+  exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+START=$(date +%s.%N)
+i=0
+while [ $i -lt "$CLIENTS" ]; do
+  "$RECEL" --client "$SOCKET" --repeat "$REQUESTS" $CLIENT_FLAGS "$IMAGE" \
+    > "$TMP/lat.$i" 2> "$TMP/err.$i" &
+  i=$((i + 1))
+done
+wait
+END=$(date +%s.%N)
+
+cat "$TMP"/err.* >&2
+sort -n "$TMP"/lat.* | awk -v start="$START" -v end="$END" '
+  { v[NR] = $1; sum += $1 }
+  END {
+    if (NR == 0) { print "no successful request"; exit 1 }
+    wall = end - start
+    printf "%d requests in %.3f s, %.1f requests/s\n", NR, wall, NR / wall
+    printf "latency (ms): mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+      sum / NR / 1000, v[int(NR * 0.5) + 1] / 1000, v[int(NR * 0.9) + 1] / 1000,
+      v[int(NR * 0.99) + 1] / 1000, v[NR] / 1000
+  }'
@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include "cli.h"
+#include "server.h"
+#include "scheduler.h"
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Server mode */
+
+int proto_send(int sock, const void *msg, size_t size, int fd)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = { (void*)msg, size };
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  if (fd >= 0)
+  {
+    memset(&control, 0, sizeof(control));
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  // Headers are small: a short send only happens on errors
+  ssize_t n;
+  do n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return -1;
+
+  return proto_write(sock, (const char*)msg + n, size - n);
+}
+
+int proto_recv(int sock, void *msg, size_t size, int *fd)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = { msg, size };
+  struct msghdr mh = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+  };
+
+  *fd = -1;
+
+  ssize_t n;
+  do n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return -1;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if (proto_read(sock, (char*)msg + n, size - n) != 0)
+  {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int proto_write(int sock, const void *data, size_t size)
+{
+  const char *p = data;
+  while (size > 0)
+  {
+    ssize_t n = send(sock, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int proto_read(int sock, void *data, size_t size)
+{
+  char *p = data;
+  while (size > 0)
+  {
+    ssize_t n = recv(sock, p, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+typedef struct connection {
+  int sock;
+  threadpool_t *pool;
+  recel_cache_t *cache;
+  recel_pages_t pages;
+  scheduler_t *sched;
+  struct connection *prev, *next;
+} connection_t;
+
+// Open connections, closed on shutdown before the pool goes away
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t closed;
+  connection_t *first;
+} connections = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL };
+
+// Result in a fresh memfd, or -1
+static int result_memfd(uint32_t w, uint32_t h, const uint32_t *pixels)
+{
+  size_t bytes = (size_t)w * h * 4;
+  int fd = memfd_create("recel-result", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, bytes) == 0)
+  {
+    void *map = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      memcpy(map, pixels, bytes);
+      munmap(map, bytes);
+      if (fcntl(fd, F_ADD_SEALS, MEMFD_SEALS) == 0)
+        return fd;
+    }
+  }
+
+  close(fd);
+  return -1;
+}
+
+// One upscale, run by the scheduler while the connection thread waits
+typedef struct {
+  threadpool_t *pool;
+  recel_cache_t *cache;
+  recel_pages_t pages;
+  uint32_t w, h;
+  const uint32_t *pixels;
+  uint32_t *result;
+  sem_t done;
+} work_t;
+
+static void work_run(void *arg)
+{
+  work_t *work = arg;
+  recel_options_t options = {
+    .pool = work->pool, .cache = work->cache, .pages = work->pages,
+  };
+  work->result = recel_upscale(&options, &work->w, &work->h, work->pixels);
+  sem_post(&work->done);
+}
+
+static uint32_t *schedule_upscale(connection_t *c, uint32_t *w, uint32_t *h,
+                                  const uint32_t *pixels)
+{
+  work_t work = { .pool = c->pool, .cache = c->cache, .pages = c->pages,
+                  .w = *w, .h = *h, .pixels = pixels };
+  uint32_t colors = recel_count_colors(*w, *h, pixels, 4096);
+
+  sem_init(&work.done, 0, 0);
+  scheduler_submit(c->sched, recel_cost(*w, *h, colors), work_run, &work);
+  while (sem_wait(&work.done) != 0)
+    ;
+  sem_destroy(&work.done);
+
+  *w = work.w;
+  *h = work.h;
+  return work.result;
+}
+
+static int serve_request(connection_t *c, const request_t *req, int fd)
+{
+  reply_t reply = { REPLY_MAGIC, 0, req->w, req->h };
+  bool inline_pixels = req->flags & REQUEST_INLINE;
+  size_t bytes = (size_t)req->w * req->h * 4;
+  uint32_t *pixels = NULL, *result = NULL;
+  void *map = NULL;
+  int status = 0;
+
+  if (req->w == 0 || req->h == 0 || req->w >= 32768 || req->h >= 32768)
+    return -1;
+
+  if (inline_pixels)
+  {
+    pixels = malloc(bytes);
+    if (!pixels || proto_read(c->sock, pixels, bytes) != 0)
+    {
+      free(pixels);
+      return -1;
+    }
+  }
+  else
+  {
+    // Without seals, the client could shrink the memfd while it is mapped
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < bytes)
+      reply.status = EINVAL;
+    else if ((fcntl(fd, F_GET_SEALS) & MEMFD_SEALS) != MEMFD_SEALS)
+      reply.status = EPERM;
+    else
+    {
+      map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+      {
+        map = NULL;
+        reply.status = errno;
+      }
+      pixels = map;
+    }
+  }
+
+  if (reply.status == 0)
+  {
+    result = schedule_upscale(c, &reply.w, &reply.h, pixels);
+    if (!result)
+      reply.status = ENOMEM;
+  }
+
+  if (map)
+    munmap(map, bytes);
+  else
+    free(pixels);
+
+  if (reply.status != 0)
+    reply.w = reply.h = 0;
+
+  if (inline_pixels)
+  {
+    status = proto_send(c->sock, &reply, sizeof(reply), -1);
+    if (status == 0 && result)
+      status = proto_write(c->sock, result, (size_t)reply.w * reply.h * 4);
+  }
+  else
+  {
+    int rfd = -1;
+    if (result)
+    {
+      rfd = result_memfd(reply.w, reply.h, result);
+      if (rfd < 0)
+      {
+        reply.status = errno;
+        reply.w = reply.h = 0;
+      }
+    }
+    status = proto_send(c->sock, &reply, sizeof(reply), rfd);
+    if (rfd >= 0)
+      close(rfd);
+  }
+
+  recel_free(result);
+  return status;
+}
+
+static void *connection_main(void *arg)
+{
+  connection_t *c = arg;
+  request_t req;
+  int fd;
+
+  while (proto_recv(c->sock, &req, sizeof(req), &fd) == 0)
+  {
+    int status = req.magic == REQUEST_MAGIC ? serve_request(c, &req, fd) : -1;
+    if (fd >= 0)
+      close(fd);
+    if (status != 0)
+      break;
+  }
+
+  pthread_mutex_lock(&connections.lock);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    connections.first = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  pthread_cond_signal(&connections.closed);
+  pthread_mutex_unlock(&connections.lock);
+
+  close(c->sock);
+  free(c);
+  return NULL;
+}
+
+static volatile sig_atomic_t stopping, reporting;
+
+static void on_signal(int sig)
+{
+  if (sig == SIGUSR1)
+    reporting = 1;
+  else
+    stopping = 1;
+}
+
+// Touch the code paths and the thread pool once before serving
+static void warm_up(threadpool_t *pool)
+{
+  enum { W = 64, H = 64 };
+  static uint32_t pixels[W * H];
+  for (int i = 0; i < W * H; ++i)
+    pixels[i] = (i % W) < W / 2 ? 0xff000000 : 0xffffffff;
+
+  recel_options_t options = { .pool = pool };
+  uint32_t w = W, h = H;
+  recel_free(recel_upscale(&options, &w, &h, pixels));
+}
+
+int server_main(const cli_options_t *opt, threadpool_t *pool,
+                const char *path)
+{
+  // Keep freed buffers in the heap: large images would otherwise be
+  // mmap'ed, page faulted and unmapped again for every request.
+  mallopt(M_MMAP_THRESHOLD, 32 << 20);
+  mallopt(M_TRIM_THRESHOLD, 256 << 20);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(sock, 64) != 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  struct sigaction sa = { .sa_handler = on_signal };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  warm_up(pool);
+  scheduler_t *sched = scheduler_new(pool, 0, opt->large_share);
+  fprintf(stderr, "listening on %s, %d threads\n", path, threadpool_size(pool));
+
+  while (!stopping)
+  {
+    int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (reporting)
+    {
+      reporting = 0;
+      scheduler_report(sched, stderr);
+    }
+    if (client < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+      continue;
+    }
+
+    connection_t *c = malloc(sizeof(connection_t));
+    if (!c)
+    {
+      fprintf(stderr, "cannot allocate a connection\n");
+      close(client);
+      continue;
+    }
+    c->sock = client;
+    c->pool = pool;
+    c->cache = opt->cache;
+    c->pages = opt->pages;
+    c->sched = sched;
+    c->prev = NULL;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&connections.lock);
+    if (pthread_create(&thread, &attr, connection_main, c) == 0)
+    {
+      c->next = connections.first;
+      if (c->next)
+        c->next->prev = c;
+      connections.first = c;
+    }
+    else
+    {
+      close(client);
+      free(c);
+    }
+    pthread_mutex_unlock(&connections.lock);
+    pthread_attr_destroy(&attr);
+  }
+
+  close(sock);
+  unlink(path);
+
+  // Let requests in flight finish, then wait for connection threads
+  pthread_mutex_lock(&connections.lock);
+  for (connection_t *c = connections.first; c; c = c->next)
+    shutdown(c->sock, SHUT_RD);
+  while (connections.first)
+    pthread_cond_wait(&connections.closed, &connections.lock);
+  pthread_mutex_unlock(&connections.lock);
+
+  threadpool_wait(pool);
+  scheduler_report(sched, stderr);
+  scheduler_delete(sched);
+  return 0;
+}
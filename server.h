@@ -0,0 +1,49 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Protocol of the local server (recel --serve).
+ *
+ * The client sends a request header on a Unix stream socket, with a memfd
+ * holding w * h RGBA pixels attached as SCM_RIGHTS.  With REQUEST_INLINE,
+ * no descriptor is attached and the pixels follow the header instead.
+ * The server answers with a reply header and the result, the same way.
+ * A connection can carry any number of requests.
+ * Memfds are sealed with MEMFD_SEALS, so that the receiver can map them
+ * without the sender truncating or changing them meanwhile; the server
+ * rejects unsealed ones with EPERM.
+ */
+
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+#define REQUEST_MAGIC 0x51434552 /* "RECQ" */
+#define REPLY_MAGIC   0x52434552 /* "RECR" */
+
+#define REQUEST_INLINE 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t w, h;
+  uint32_t flags;
+} request_t;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status; /* 0 or an errno value */
+  uint32_t w, h;
+} reply_t;
+
+/* Send or receive exactly size bytes, with an optional descriptor.
+ * Returns 0, or -1 on error or end of stream.
+ */
+int proto_send(int sock, const void *msg, size_t size, int fd);
+int proto_recv(int sock, void *msg, size_t size, int *fd);
+
+/* Plain stream transfer, for inline pixels */
+int proto_write(int sock, const void *data, size_t size);
+int proto_read(int sock, void *data, size_t size);
+
+#endif /*SERVER_H*/
@@ -1,5 +1,66 @@
+#include "recel.h"
+
+// Decoded and encoded images are accounted with the other buffers
+#define STBI_MALLOC(size) recel_malloc(size)
+#define STBI_REALLOC(p, size) recel_realloc(p, size)
+#define STBI_FREE(p) recel_free(p)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#define STBIW_MALLOC(size) recel_malloc(size)
+#define STBIW_REALLOC(p, size) recel_realloc(p, size)
+#define STBIW_FREE(p) recel_free(p)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+
+// Every frame of an animated GIF, each w * h RGBA pixels, one after the
+// other, or NULL if data is not a GIF.  Free with recel_free.
+unsigned char *stb_load_gif_frames(const unsigned char *data, int size,
+                                   int *w, int *h, int *count)
+{
+  stbi__context s;
+  stbi__start_mem(&s, data, size);
+  if (!stbi__gif_test(&s))
+    return NULL;
+
+  // Each frame is decoded in a new buffer, the previous ones are needed
+  // to dispose of it
+  stbi__gif *g = recel_calloc(1, sizeof(stbi__gif));
+  unsigned char **decoded = NULL, *frames = NULL;
+  int comp, n = 0;
+  *count = 0;
+
+  for (;;)
+  {
+    stbi_uc *out = g->out, *u = stbi__gif_load_next(&s, g, &comp, 4);
+    if (g->out != out)
+    {
+      decoded = recel_realloc(decoded, sizeof(unsigned char*) * (n + 1));
+      decoded[n++] = g->out;
+    }
+    if (!u || u == (stbi_uc*)&s)
+      break;
+
+    size_t bytes = (size_t)4 * g->w * g->h;
+    unsigned char *grown = recel_realloc(frames, bytes * (*count + 1));
+    if (!grown)
+      break;
+    frames = grown;
+    memcpy(frames + bytes * *count, u, bytes);
+    *count += 1;
+  }
+
+  *w = g->w;
+  *h = g->h;
+  for (int i = 0; i < n; ++i)
+    recel_free(decoded[i]);
+  recel_free(decoded);
+  recel_free(g);
+
+  if (*count == 0)
+  {
+    recel_free(frames);
+    frames = NULL;
+  }
+  return frames;
+}
@@ -0,0 +1,362 @@
+#include "threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A group of chunks from one threadpool_parallel_for call
+struct group {
+  atomic_uint remaining;
+  void (*fn)(void *ctx, uint32_t begin, uint32_t end);
+  void *ctx;
+};
+
+struct chunk {
+  struct group *group;
+  uint32_t begin, end;
+};
+
+struct task {
+  void (*fn)(void *arg);
+  void *arg;
+  struct group *group; // NULL for submitted tasks
+};
+
+// Ring buffer, owner works at the tail, thieves take from the head
+struct deque {
+  pthread_mutex_t lock;
+  struct task *tasks;
+  uint32_t head, tail, capacity;
+};
+
+struct worker {
+  threadpool_t *pool;
+  pthread_t thread;
+  struct deque deque;
+  uint32_t seed;
+};
+
+struct threadpool {
+  int size;
+  struct worker *workers;
+
+  // Tasks pushed from outside the pool: submitted tasks and chunks
+  struct deque shared;
+  struct deque shared_chunks;
+
+  atomic_int queued;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  int pending;
+  bool stop;
+};
+
+static __thread struct worker *current;
+
+static void deque_init(struct deque *d)
+{
+  pthread_mutex_init(&d->lock, NULL);
+  d->capacity = 64;
+  d->head = d->tail = 0;
+  d->tasks = malloc(sizeof(struct task) * d->capacity);
+}
+
+static void deque_destroy(struct deque *d)
+{
+  pthread_mutex_destroy(&d->lock);
+  free(d->tasks);
+}
+
+static void deque_push(struct deque *d, struct task task)
+{
+  pthread_mutex_lock(&d->lock);
+  if (d->tail - d->head == d->capacity)
+  {
+    struct task *tasks = malloc(sizeof(struct task) * d->capacity * 2);
+    for (uint32_t i = d->head; i != d->tail; ++i)
+      tasks[i & (d->capacity * 2 - 1)] = d->tasks[i & (d->capacity - 1)];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->capacity *= 2;
+  }
+  d->tasks[d->tail & (d->capacity - 1)] = task;
+  d->tail += 1;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static bool deque_pop(struct deque *d, bool chunks_only, struct task *task)
+{
+  bool found = false;
+  pthread_mutex_lock(&d->lock);
+  if (d->tail != d->head)
+  {
+    struct task *t = &d->tasks[(d->tail - 1) & (d->capacity - 1)];
+    if (!chunks_only || t->group)
+    {
+      *task = *t;
+      d->tail -= 1;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool deque_steal(struct deque *d, bool chunks_only, struct task *task)
+{
+  bool found = false;
+  pthread_mutex_lock(&d->lock);
+  if (d->tail != d->head)
+  {
+    struct task *t = &d->tasks[d->head & (d->capacity - 1)];
+    if (!chunks_only || t->group)
+    {
+      *task = *t;
+      d->head += 1;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static void pool_push(threadpool_t *pool, struct task task)
+{
+  if (current && current->pool == pool)
+    deque_push(&current->deque, task);
+  else if (task.group)
+    deque_push(&pool->shared_chunks, task);
+  else
+    deque_push(&pool->shared, task);
+
+  atomic_fetch_add(&pool->queued, 1);
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Look for work: own tasks first, then new jobs, then chunks of running jobs.
+// Starting new jobs first keeps small jobs from waiting behind the stages
+// of a large one; a worker blocked in threadpool_parallel_for only takes
+// chunks.
+static bool pool_take(threadpool_t *pool, struct worker *self,
+                      bool chunks_only, struct task *task)
+{
+  bool found = false;
+
+  if (self && deque_pop(&self->deque, chunks_only, task))
+    found = true;
+  else if (!chunks_only && deque_steal(&pool->shared, false, task))
+    found = true;
+  else if (deque_steal(&pool->shared_chunks, chunks_only, task))
+    found = true;
+  else
+  {
+    uint32_t start = 0;
+    if (self)
+    {
+      self->seed = self->seed * 1103515245 + 12345;
+      start = (self->seed >> 16) % pool->size;
+    }
+
+    for (int i = 0; i < pool->size && !found; ++i)
+    {
+      struct worker *victim = &pool->workers[(start + i) % pool->size];
+      if (victim != self)
+        found = deque_steal(&victim->deque, chunks_only, task);
+    }
+  }
+
+  if (found)
+    atomic_fetch_sub(&pool->queued, 1);
+  return found;
+}
+
+static void pool_run(threadpool_t *pool, struct task *task)
+{
+  task->fn(task->arg);
+
+  if (task->group)
+    atomic_fetch_sub(&task->group->remaining, 1);
+  else
+  {
+    pthread_mutex_lock(&pool->lock);
+    pool->pending -= 1;
+    if (pool->pending == 0)
+      pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *self = arg;
+  threadpool_t *pool = self->pool;
+  current = self;
+
+  for (;;)
+  {
+    struct task task;
+    if (pool_take(pool, self, false, &task))
+    {
+      pool_run(pool, &task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->queued) == 0 && !pool->stop)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    bool stop = pool->stop && atomic_load(&pool->queued) == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stop)
+      break;
+  }
+
+  return NULL;
+}
+
+threadpool_t *threadpool_new(int threads)
+{
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+
+  threadpool_t *pool = malloc(sizeof(threadpool_t));
+  pool->size = threads;
+  pool->workers = calloc(threads, sizeof(struct worker));
+  deque_init(&pool->shared);
+  deque_init(&pool->shared_chunks);
+  atomic_init(&pool->queued, 0);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->pending = 0;
+  pool->stop = false;
+
+  for (int i = 0; i < threads; ++i)
+  {
+    pool->workers[i].pool = pool;
+    pool->workers[i].seed = i + 1;
+    deque_init(&pool->workers[i].deque);
+  }
+
+  for (int i = 0; i < threads; ++i)
+    pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+
+  return pool;
+}
+
+void threadpool_delete(threadpool_t *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->size; ++i)
+    pthread_join(pool->workers[i].thread, NULL);
+
+  for (int i = 0; i < pool->size; ++i)
+    deque_destroy(&pool->workers[i].deque);
+  deque_destroy(&pool->shared);
+  deque_destroy(&pool->shared_chunks);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->workers);
+  free(pool);
+}
+
+int threadpool_size(threadpool_t *pool)
+{
+  return pool->size;
+}
+
+void threadpool_submit(threadpool_t *pool, void (*fn)(void *arg), void *arg)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->pending += 1;
+  pthread_mutex_unlock(&pool->lock);
+
+  struct task task = { fn, arg, NULL };
+  pool_push(pool, task);
+}
+
+void threadpool_wait(threadpool_t *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void run_chunk(void *arg)
+{
+  struct chunk *c = arg;
+  c->group->fn(c->group->ctx, c->begin, c->end);
+}
+
+void threadpool_parallel_for(threadpool_t *pool, uint32_t n, uint32_t grain,
+                             void (*fn)(void *ctx, uint32_t begin, uint32_t end),
+                             void *ctx)
+{
+  if (grain == 0)
+    grain = 1;
+
+  if (!pool || pool->size == 1 || n <= grain)
+  {
+    if (n > 0)
+      fn(ctx, 0, n);
+    return;
+  }
+
+  // A few chunks per worker leaves room for stealing
+  uint32_t count = (n + grain - 1) / grain;
+  if (count > (uint32_t)pool->size * 4)
+    count = pool->size * 4;
+
+  // Small pools keep chunks on the stack, so that frame loops do not
+  // allocate
+  struct chunk local[64];
+  struct chunk *chunks = count <= 64 ? local : malloc(sizeof(struct chunk) * count);
+  struct group group = { .fn = fn, .ctx = ctx };
+  atomic_init(&group.remaining, count);
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    chunks[i].group = &group;
+    chunks[i].begin = (uint64_t)n * i / count;
+    chunks[i].end = (uint64_t)n * (i + 1) / count;
+  }
+
+  // Push in reverse so that the owner pops chunks in order
+  for (uint32_t i = count - 1; i > 0; --i)
+  {
+    struct task task = { run_chunk, &chunks[i], &group };
+    pool_push(pool, task);
+  }
+
+  struct task first = { run_chunk, &chunks[0], &group };
+  pool_run(pool, &first);
+
+  // Help with chunks until ours are all done
+  struct worker *self = current && current->pool == pool ? current : NULL;
+  while (atomic_load(&group.remaining) > 0)
+  {
+    struct task task;
+    if (pool_take(pool, self, true, &task))
+      pool_run(pool, &task);
+    else
+      sched_yield();
+  }
+
+  if (chunks != local)
+    free(chunks);
+}
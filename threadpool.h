@@ -0,0 +1,38 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+
+typedef struct threadpool threadpool_t;
+
+/* Work-stealing thread pool.
+ * Each worker owns a deque: it pushes and pops its own tasks at one end,
+ * idle workers steal from the other end.  Tasks submitted from outside the
+ * pool go to a shared queue.
+ * Idle workers start new tasks before helping with chunks of running ones.
+ */
+
+/* threads == 0 uses one worker per online CPU. */
+threadpool_t *threadpool_new(int threads);
+void threadpool_delete(threadpool_t *pool);
+int threadpool_size(threadpool_t *pool);
+
+void threadpool_submit(threadpool_t *pool, void (*fn)(void *arg), void *arg);
+
+/* Wait until every submitted task is finished.
+ * Must not be called from a task.
+ */
+void threadpool_wait(threadpool_t *pool);
+
+/* Run fn on [0, n) split in chunks of at least grain items and return when
+ * all chunks are done.
+ * Can be called from a task: the caller runs chunks itself and idle workers
+ * steal the others, so a large job borrows free workers without blocking
+ * the pool.
+ * pool can be NULL, fn is then called once on the whole range.
+ */
+void threadpool_parallel_for(threadpool_t *pool, uint32_t n, uint32_t grain,
+                             void (*fn)(void *ctx, uint32_t begin, uint32_t end),
+                             void *ctx);
+
+#endif /*THREADPOOL_H*/
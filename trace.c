@@ -0,0 +1,127 @@
+#include "recel.h"
+#include <time.h>
+#include "trace.h"
+
+/* Clock */
+
+uint64_t trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Tracing */
+
+#ifdef RECEL_TRACE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Events kept per thread, the oldest ones are overwritten
+#define TRACE_EVENTS 65536
+
+struct event {
+  const char *name;
+  uint32_t arg;
+  uint64_t start, end;
+};
+
+// One ring per thread, only written by its thread
+struct ring {
+  struct ring *next;
+  uint32_t tid;
+  uint64_t count;
+  struct event events[TRACE_EVENTS];
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;
+static uint32_t ring_count;
+static __thread struct ring *local;
+
+static struct ring *ring_get(void)
+{
+  if (!local)
+  {
+    struct ring *r = calloc(1, sizeof(struct ring));
+    if (!r)
+      return NULL;
+    pthread_mutex_lock(&rings_lock);
+    r->tid = ++ring_count;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    local = r;
+  }
+  return local;
+}
+
+void trace_event(const char *name, uint32_t arg, uint64_t start)
+{
+  uint64_t end = trace_now();
+  struct ring *r = ring_get();
+  if (!r)
+    return;
+  struct event *e = &r->events[r->count++ % TRACE_EVENTS];
+  e->name = name;
+  e->arg = arg;
+  e->start = start;
+  e->end = end;
+}
+
+// Complete events ("X"), with microsecond timestamps relative to the first
+// event kept
+int recel_trace_save(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+
+  pthread_mutex_lock(&rings_lock);
+  uint64_t origin = UINT64_MAX;
+  for (struct ring *r = rings; r; r = r->next)
+  {
+    uint64_t first = r->count > TRACE_EVENTS ? r->count - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < r->count; ++i)
+    {
+      if (r->events[i % TRACE_EVENTS].start < origin)
+        origin = r->events[i % TRACE_EVENTS].start;
+    }
+  }
+
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  const char *sep = "";
+  for (struct ring *r = rings; r; r = r->next)
+  {
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %u, \"args\": {\"name\": \"thread %u\"}}",
+            sep, r->tid, r->tid);
+    sep = ",\n";
+
+    uint64_t first = r->count > TRACE_EVENTS ? r->count - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < r->count; ++i)
+    {
+      const struct event *e = &r->events[i % TRACE_EVENTS];
+      fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+              "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"arg\": %u}}",
+              sep, e->name, r->tid, (e->start - origin) / 1e3,
+              (e->end - e->start) / 1e3, e->arg);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  pthread_mutex_unlock(&rings_lock);
+
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+#else
+
+int recel_trace_save(const char *path)
+{
+  (void)path;
+  return -1;
+}
+
+#endif
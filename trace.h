@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Timeline of stages, tiles and levels, per thread.
+ * Built with -DRECEL_TRACE (make TRACE=1), otherwise the macros expand to
+ * nothing.  Usage:
+ *   TRACE_BEGIN(t);
+ *   ...
+ *   TRACE_END(t, "inflate", y0);
+ * name must be a static string, arg is shown with the event.
+ */
+
+/* Monotonic clock in nanoseconds, also for timings outside traces. */
+uint64_t trace_now(void);
+
+#ifdef RECEL_TRACE
+
+void trace_event(const char *name, uint32_t arg, uint64_t start);
+
+#define TRACE_BEGIN(t) uint64_t t = trace_now()
+#define TRACE_END(t, name, arg) trace_event(name, arg, t)
+
+#else
+
+#define TRACE_BEGIN(t) do {} while (0)
+#define TRACE_END(t, name, arg) do {} while (0)
+
+#endif
+
+#endif /*TRACE_H*/
@@ -0,0 +1,278 @@
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Size of a single read or write request
+#define URING_BLOCK (1 << 20)
+
+struct uring {
+  int fd;
+  unsigned entries;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+uring_t *uring_new(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return NULL;
+
+  uring_t *ring = calloc(1, sizeof(uring_t));
+  ring->fd = fd;
+  ring->entries = p.sq_entries;
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+  {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    goto fail;
+
+  if (single)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+  {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED)
+    {
+      munmap(ring->sq_ptr, ring->sq_size);
+      goto fail;
+    }
+  }
+
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    if (!single)
+      munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    goto fail;
+  }
+
+  uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  return ring;
+
+fail:
+  close(fd);
+  free(ring);
+  return NULL;
+}
+
+void uring_delete(uring_t *ring)
+{
+  munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+  free(ring);
+}
+
+static void uring_push(uring_t *ring, int op, int fd, void *buf,
+                       size_t len, uint64_t offset, uint64_t user_data)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+
+  ring->sq_array[index] = index;
+  atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + 1,
+                        memory_order_release);
+}
+
+// Submit up to submit entries and wait for one completion if wait.
+// Returns the entries submitted, or -1 with errno.
+static int uring_enter(uring_t *ring, unsigned submit, unsigned wait)
+{
+  return syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// Interrupted, or out of resources until completions are reaped
+static bool transient(int error)
+{
+  return error == EINTR || error == EAGAIN || error == EBUSY;
+}
+
+static bool uring_pop(uring_t *ring, struct io_uring_cqe *out)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail,
+                                       memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  *out = ring->cqes[head & *ring->cq_mask];
+  atomic_store_explicit((_Atomic unsigned*)ring->cq_head, head + 1,
+                        memory_order_release);
+  return true;
+}
+
+// Issue [0, size) of fd as blocks of URING_BLOCK, keeping the ring full.
+// Short transfers are resubmitted for the remaining bytes.
+// Returns 0 or -errno, always after the last submitted request completed:
+// until then the kernel may still access data, and its completions would
+// be taken for those of the next transfer.
+static int uring_transfer(uring_t *ring, int op, int fd, uint8_t *data,
+                          size_t size)
+{
+  size_t next = 0;
+  unsigned pending = 0, inflight = 0; // pushed, then submitted
+  int result = 0;
+
+  while ((result == 0 && next < size) || pending > 0 || inflight > 0)
+  {
+    while (result == 0 && next < size && pending + inflight < ring->entries)
+    {
+      size_t len = size - next < URING_BLOCK ? size - next : URING_BLOCK;
+      uring_push(ring, op, fd, data + next, len, next,
+                 ((uint64_t)next << 24) | len);
+      next += len;
+      pending++;
+    }
+
+    if (result != 0 && pending > 0)
+    { // After a failure, take back what the kernel has not seen
+      atomic_store_explicit((_Atomic unsigned*)ring->sq_tail,
+                            *ring->sq_tail - pending, memory_order_release);
+      pending = 0;
+      if (inflight == 0)
+        break;
+    }
+
+    int r = uring_enter(ring, pending, 1);
+    if (r >= 0)
+    {
+      pending -= r;
+      inflight += r;
+    }
+    else if (!transient(errno))
+    {
+      if (inflight > 0 && pending == 0)
+      { // Cannot wait for requests that still own data
+        perror("io_uring_enter");
+        abort();
+      }
+      if (result == 0)
+        result = -errno;
+    }
+
+    struct io_uring_cqe cqe;
+    while (uring_pop(ring, &cqe))
+    {
+      inflight--;
+      size_t offset = cqe.user_data >> 24;
+      size_t len = cqe.user_data & ((1 << 24) - 1);
+
+      if (cqe.res <= 0)
+      { // End of file before size: the file shrank
+        if (result == 0)
+          result = cqe.res < 0 ? cqe.res : -EIO;
+      }
+      else if ((size_t)cqe.res < len && result == 0)
+      { // Short read or write: queue the rest
+        uring_push(ring, op, fd, data + offset + cqe.res, len - cqe.res,
+                   offset + cqe.res,
+                   ((uint64_t)(offset + cqe.res) << 24) | (len - cqe.res));
+        pending++;
+      }
+    }
+  }
+
+  return result;
+}
+
+void *uring_read_file(uring_t *ring, const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  uint8_t *data = malloc(st.st_size);
+  int result = data ? uring_transfer(ring, IORING_OP_READ, fd, data,
+                                     st.st_size) : -ENOMEM;
+  close(fd);
+  if (result != 0)
+  {
+    free(data);
+    errno = -result;
+    return NULL;
+  }
+
+  *size = st.st_size;
+  return data;
+}
+
+int uring_write_file(uring_t *ring, const char *path,
+                     const void *data, size_t size)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+
+  int result = uring_transfer(ring, IORING_OP_WRITE, fd, (uint8_t*)data, size);
+  if (close(fd) < 0 && result == 0)
+    result = -errno;
+  if (result != 0)
+  {
+    errno = -result;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+typedef struct uring uring_t;
+
+/* Minimal io_uring wrapper for whole-file reads and writes.
+ * A ring must only be used by one thread at a time.
+ */
+
+/* Returns NULL when io_uring is not available. */
+uring_t *uring_new(unsigned entries);
+void uring_delete(uring_t *ring);
+
+/* Read a whole file into a malloc(3) buffer, NULL on failure.
+ * Failures set errno; EINVAL or EOPNOTSUPP mean that the kernel does not
+ * support the operation on io_uring, and read(2) should be used instead.
+ */
+void *uring_read_file(uring_t *ring, const char *path, size_t *size);
+
+/* Create or truncate path and write data to it. Returns 0, or -1 with
+ * errno as above. */
+int uring_write_file(uring_t *ring, const char *path,
+                     const void *data, size_t size);
+
+#endif /*URING_H*/